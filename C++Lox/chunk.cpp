@@ -1,4 +1,5 @@
 #include "chunk.h"
+#include "object.h"
 
 uint8_t asByte(OpCode code) {
 	return static_cast<uint8_t>(code);
@@ -13,6 +14,125 @@ OpCode asOpCode(uint8_t byte) {
 	return static_cast<OpCode>(byte);
 }
 
+OpCode genericOpCode(OpCode code) {
+	switch (code) {
+		case OpCode::AddNumber:
+		case OpCode::AddString:
+		case OpCode::AddNumberUnchecked:
+			return OpCode::Add;
+		case OpCode::SubtractNumber:
+		case OpCode::SubtractNumberUnchecked:
+			return OpCode::Subtract;
+		case OpCode::MultiplyNumber:
+		case OpCode::MultiplyNumberUnchecked:
+			return OpCode::Multiply;
+		case OpCode::DivideNumber:
+		case OpCode::DivideNumberUnchecked:
+			return OpCode::Divide;
+		case OpCode::LessNumber:
+		case OpCode::LessNumberUnchecked:
+			return OpCode::Less;
+		case OpCode::GreaterNumber:
+		case OpCode::GreaterNumberUnchecked:
+			return OpCode::Greater;
+		case OpCode::NegateNumberUnchecked:
+			return OpCode::Negate;
+		default:
+			return code;
+	}
+}
+
+bool isUncheckedNumberOp(OpCode code) {
+	switch (code) {
+		case OpCode::AddNumberUnchecked:
+		case OpCode::SubtractNumberUnchecked:
+		case OpCode::MultiplyNumberUnchecked:
+		case OpCode::DivideNumberUnchecked:
+		case OpCode::LessNumberUnchecked:
+		case OpCode::GreaterNumberUnchecked:
+		case OpCode::NegateNumberUnchecked:
+			return true;
+		default:
+			return false;
+	}
+}
+
+size_t instructionLength(const Chunk& chunk, size_t offset) {
+	switch (asOpCode(chunk.code[offset])) {
+		case OpCode::Constant:
+		case OpCode::DefineGlobal:
+		case OpCode::DefineConstant:
+		case OpCode::GetGlobal:
+		case OpCode::SetGlobal:
+		case OpCode::GetLocal:
+		case OpCode::SetLocal:
+		case OpCode::Call:
+		case OpCode::GetUpvalue:
+		case OpCode::SetUpvalue:
+		case OpCode::Class:
+		case OpCode::Method:
+		case OpCode::GetSuper:
+		case OpCode::Array:
+		case OpCode::Map:
+			return 2;
+		case OpCode::ConditionalJump:
+		case OpCode::Jump:
+		case OpCode::JumpBack:
+		case OpCode::JumpBackIfTrue:
+		case OpCode::SuperInvoke:
+			return 3;
+		case OpCode::GetProperty:
+		case OpCode::SetProperty:
+			return 4;
+		case OpCode::Invoke:
+			return 5;
+		case OpCode::TableSwitch:
+		case OpCode::LookupSwitch:
+			return 3;
+		case OpCode::ForPrep:
+			return 7;
+		case OpCode::ForLoop:
+			return 8;
+		case OpCode::Closure: {
+			auto constant = chunk.constants[chunk.code[offset + 1]];
+			auto function = static_cast<ObjFunction*>(constant.asObjRawUnsafe());
+			return 2 + 2 * function->upvalueCount;
+		}
+		default:
+			return 1;
+	}
+}
+
+bool isJump(OpCode code) {
+	switch (code) {
+		case OpCode::ConditionalJump:
+		case OpCode::Jump:
+		case OpCode::JumpBack:
+		case OpCode::JumpBackIfTrue:
+		case OpCode::ForPrep:
+		case OpCode::ForLoop:
+			return true;
+		default:
+			return false;
+	}
+}
+
+bool isSwitch(OpCode code) {
+	return code == OpCode::TableSwitch || code == OpCode::LookupSwitch;
+}
+
+bool isBackwardJump(OpCode code) {
+	return code == OpCode::JumpBack || code == OpCode::JumpBackIfTrue || code == OpCode::ForLoop;
+}
+
+size_t jumpTarget(const Chunk& chunk, size_t offset) {
+	// the distance is always the last operand, counted from the next instruction
+	auto end = offset + instructionLength(chunk, offset);
+	auto jump = static_cast<size_t>((chunk.code[end - 2] << 8) | chunk.code[end - 1]);
+	if (isBackwardJump(asOpCode(chunk.code[offset]))) return end - jump;
+	return end + jump;
+}
+
 void Chunk::addInstruction(OpCode instruction, int line) {
 	addByte(asByte(instruction), line);
 }
@@ -22,7 +142,48 @@ void Chunk::addByte(uint8_t byte, int line) {
 	lines.push_back(line);
 }
 
+// numbers compare by bits and representation, so 0 and -0 or 1 and 1.0 keep their own entries
+static bool sameConstant(Value a, Value b) {
+	if (!a.isNumber() || !b.isNumber()) return a == b;
+	return a.isInteger() == b.isInteger() && std::bit_cast<uint64_t>(a.asNumberUnsafe()) == std::bit_cast<uint64_t>(b.asNumberUnsafe());
+}
+
 size_t Chunk::addConstant(Value value) {
+	auto existing = std::find_if(constants.begin(), constants.end(), [&value](Value constant) { return sameConstant(constant, value); });
+	if (existing != constants.end()) return static_cast<size_t>(existing - constants.begin());
 	constants.push_back(value);
 	return constants.size() - 1;
 }
+
+size_t Chunk::addCache() {
+	caches.emplace_back();
+	return caches.size() - 1;
+}
+
+size_t Chunk::addSwitch() {
+	switches.emplace_back();
+	return switches.size() - 1;
+}
+
+std::vector<size_t*> SwitchTable::targets() {
+	std::vector<size_t*> result{ &defaultTarget };
+	for (auto& target : dense) result.push_back(&target);
+	for (auto& [label, target] : numbers) result.push_back(&target);
+	for (auto& [label, target] : strings) result.push_back(&target);
+	return result;
+}
+
+CacheEntry* InlineCache::find(const std::shared_ptr<Shape>& shape) {
+	auto size = std::min(count, inlineCacheSize);
+	for (size_t i = 0; i < size; i++) {
+		if (entries[i].shape == shape) return &entries[i];
+	}
+	return nullptr;
+}
+
+CacheEntry& InlineCache::add(CacheEntry entry) {
+	// once polymorphic slots run out, older shapes are evicted round-robin
+	auto& slot = entries[count++ % inlineCacheSize];
+	slot = entry;
+	return slot;
+}
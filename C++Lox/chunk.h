@@ -21,6 +21,8 @@ enum class OpCode : uint8_t {
 	Drop,
 	Print,
 	DefineGlobal,
+	// DefineGlobal for a `const`, which nothing may assign afterwards
+	DefineConstant,
 	GetGlobal,
 	SetGlobal,
 	GetLocal,
@@ -28,6 +30,53 @@ enum class OpCode : uint8_t {
 	ConditionalJump, // jump if false
 	Jump,
 	JumpBack,
+	JumpBackIfTrue, // the bottom test of a rotated loop, leaves the condition like ConditionalJump
+	Call,
+	Closure,
+	GetUpvalue,
+	SetUpvalue,
+	CloseUpvalue,
+	Class,
+	Inherit,
+	Method,
+	GetProperty,
+	SetProperty,
+	Invoke,
+	GetSuper,
+	SuperInvoke,
+	Array,
+	GetIndex,
+	SetIndex,
+	Map,
+	HasKey,
+	DeleteKey,
+	// counting loop over a number local: the test before the first iteration, and the
+	// fused increment, test and backward branch that ends each one
+	ForPrep,
+	ForLoop,
+	// pop a value and jump through a SwitchTable
+	TableSwitch,
+	LookupSwitch,
+	// pop a value and hand it to whichever fiber runs next
+	Yield,
+	// pop a value and a fiber, and run the fiber until it yields or finishes
+	Resume,
+	// quickened forms, only ever written by the VM over their generic opcode
+	AddNumber,
+	AddString,
+	SubtractNumber,
+	MultiplyNumber,
+	DivideNumber,
+	LessNumber,
+	GreaterNumber,
+	// emitted only where the compiler proved both operands are numbers
+	AddNumberUnchecked,
+	SubtractNumberUnchecked,
+	MultiplyNumberUnchecked,
+	DivideNumberUnchecked,
+	LessNumberUnchecked,
+	GreaterNumberUnchecked,
+	NegateNumberUnchecked,
 
 	OPCODE_LEN
 };
@@ -38,14 +87,93 @@ bool validOpCode(uint8_t byte);
 
 OpCode asOpCode(uint8_t byte);
 
+// the opcode a quickened or unchecked form stands in for; any other is its own
+OpCode genericOpCode(OpCode code);
+
+// the forms that take the compiler's word that every operand is a number
+bool isUncheckedNumberOp(OpCode code);
+
+// how ForPrep and ForLoop test the loop variable; <= and >= are negated > and <, as in Lox
+enum class ForCompare : uint8_t {
+	Less,
+	LessEqual,
+	Greater,
+	GreaterEqual,
+};
+
+// where ForPrep and ForLoop read the bound from, re-read on every test
+enum class ForLimit : uint8_t {
+	Constant,
+	Local,
+	Global,
+};
+
+struct Chunk;
+
+// bytes taken by the instruction at offset, opcode and operands together
+size_t instructionLength(const Chunk& chunk, size_t offset);
+
+// instructions ending in a 16 bit jump distance
+bool isJump(OpCode code);
+bool isBackwardJump(OpCode code);
+
+bool isSwitch(OpCode code);
+
+// absolute offset a jump instruction at offset lands on
+size_t jumpTarget(const Chunk& chunk, size_t offset);
+
+struct Shape;
+struct ObjString;
+
+struct CacheEntry {
+	std::shared_ptr<Shape> shape;
+	// field slot, or nullopt when an invoke resolved to a class method
+	std::optional<size_t> slot{};
+	// shape after a field-adding store
+	std::shared_ptr<Shape> transition{};
+	Value method{};
+};
+
+constexpr size_t inlineCacheSize = 4;
+
+// per-instruction polymorphic cache for property access, keyed by shape
+struct InlineCache {
+	std::array<CacheEntry, inlineCacheSize> entries{};
+	size_t count{ 0 };
+
+	CacheEntry* find(const std::shared_ptr<Shape>& shape);
+	CacheEntry& add(CacheEntry entry);
+};
+
+// where a switch statement goes for each case label, as absolute offsets into the chunk
+struct SwitchTable {
+	size_t defaultTarget{ 0 };
+	// TableSwitch: the integer label low + i goes to dense[i]
+	double low{ 0 };
+	std::vector<size_t> dense{};
+	// LookupSwitch; string labels are re-keyed by their interned string when the chunk is loaded
+	std::unordered_map<double, size_t> numbers{};
+	std::unordered_map<std::shared_ptr<ObjString>, size_t> strings{};
+
+	// every target, in an order that stays fixed while the table is not resized
+	std::vector<size_t*> targets();
+};
+
 struct Chunk {
 	std::vector<uint8_t> code;
 	std::vector<Value> constants;
 	std::vector<int> lines;
+	std::vector<InlineCache> caches;
+	std::vector<SwitchTable> switches;
 
 	void addInstruction(OpCode instruction, int line);
 
 	void addByte(uint8_t byte, int line);
 
+	// an entry already holding the same constant is shared rather than added again
 	size_t addConstant(Value value);
+
+	size_t addCache();
+
+	size_t addSwitch();
 };
\ No newline at end of file
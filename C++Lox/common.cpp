@@ -1,5 +1,16 @@
 #include "common.h"
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 std::vector<std::string> parseArgs(int argc, const char* argv[]) {
 	std::vector<std::string> out{};
 	for (size_t i = 1; i < argc; i++) {
@@ -9,15 +20,71 @@ std::vector<std::string> parseArgs(int argc, const char* argv[]) {
 	return out;
 }
 
+[[noreturn]] static void couldNotOpen(const std::string& path) {
+	std::cerr << "Could not open file " << path << "." << std::endl;
+	exit(74);
+}
+
 std::string readFile(const std::string& path) {
 	std::ifstream input_file{ path };
-	if (!input_file.is_open()) {
-		std::cerr << "Could not open file " << path << "." << std::endl;
-		exit(74);
-	}
+	if (!input_file.is_open()) couldNotOpen(path);
 	return std::string(std::istreambuf_iterator<char>(input_file), std::istreambuf_iterator<char>());
 }
 
+#ifdef _WIN32
+MappedFile::MappedFile(const std::string& path) {
+	auto handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (handle == INVALID_HANDLE_VALUE) couldNotOpen(path);
+	file = handle;
+
+	LARGE_INTEGER length;
+	if (!GetFileSizeEx(handle, &length)) couldNotOpen(path);
+	size = size_t(length.QuadPart);
+	// a zero-length file can't be mapped, and has nothing to map anyway
+	if (size == 0) return;
+
+	mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping) couldNotOpen(path);
+	data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	if (!data) couldNotOpen(path);
+}
+
+MappedFile::~MappedFile() {
+	if (data) UnmapViewOfFile(data);
+	if (mapping) CloseHandle(mapping);
+	if (file) CloseHandle(file);
+}
+#else
+MappedFile::MappedFile(const std::string& path) {
+	auto fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) couldNotOpen(path);
+
+	struct stat info;
+	if (fstat(fd, &info) != 0) couldNotOpen(path);
+	size = size_t(info.st_size);
+	if (size == 0) {
+		close(fd);
+		return;
+	}
+
+	auto mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// the mapping keeps its own reference to the file
+	close(fd);
+	if (mapped == MAP_FAILED) couldNotOpen(path);
+	// the scanner reads front to back exactly once
+	madvise(mapped, size, MADV_SEQUENTIAL);
+	data = static_cast<const char*>(mapped);
+}
+
+MappedFile::~MappedFile() {
+	if (data) munmap(const_cast<char*>(data), size);
+}
+#endif
+
+std::string_view MappedFile::view() const {
+	return std::string_view{ data, size };
+}
+
 bool isDigit(char c) {
 	return '0' <= c && c <= '9';
 }
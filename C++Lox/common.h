@@ -2,8 +2,8 @@
 
 #ifdef _DEBUG
 constexpr auto debug_printCode = true;
-constexpr auto debug_traceExecution = true;
 constexpr auto debug_logFrees = true;
+constexpr auto debug_logQuickening = true;
 
 #define assert(expr, err) do {\
 	if (!expr) {\
@@ -19,14 +19,12 @@ constexpr auto debug_logFrees = true;
 } while (false)
 #else
 constexpr auto debug_printCode = false;
-constexpr auto debug_traceExecution = false;
 constexpr auto debug_logFrees = false;
+constexpr auto debug_logQuickening = false;
 
 #define assert(expr, err) ((void)0)
 #endif
 
-#define unreachable() assert(false, "Unreachable code")
-
 #include <cstddef>
 #include <cstdint>
 #include <cstdarg>
@@ -43,15 +41,55 @@ constexpr auto debug_logFrees = false;
 #include <unordered_set>
 #include <ios>
 #include <variant>
+#include <memory>
+#include <span>
+#include <algorithm>
+#include <ctime>
+#include <cmath>
+#include <cstring>
+#include <bit>
+#include <utility>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <queue>
+#include <chrono>
+#include <atomic>
+#include <csignal>
+#include <iomanip>
 
 #undef EOF
 
+// after the standard headers, which may declare std::unreachable
+#define unreachable() assert(false, "Unreachable code")
+
 using namespace std::literals;
 
 std::vector<std::string> parseArgs(int argc, const char* argv[]);
 
 std::string readFile(const std::string & path);
 
+// read-only view of a whole file, mapped instead of copied so that large
+// sources cost no upfront read; exits like readFile when the file can't be opened
+struct MappedFile {
+	MappedFile(const std::string& path);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	std::string_view view() const;
+
+	private:
+	const char* data{ nullptr };
+	size_t size{ 0 };
+#ifdef _WIN32
+	void* file{ nullptr };
+	void* mapping{ nullptr };
+#endif
+};
+
 bool isDigit(char c);
 
 bool isAlpha(char c);
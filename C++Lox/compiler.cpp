@@ -3,12 +3,14 @@
 #include "scanner.h"
 #include "vm.h"
 #include "debug.h"
+#include "optimizer.h"
+#include "probes.h"
 
 void Compiler::advance() {
 	parser.previous = parser.current;
 
 	while (true) {
-		parser.current = scanner.scanToken();
+		parser.current = tokens.scanToken();
 		if (parser.current.type != TokenType::Error) break;
 
 		errorAtCurrent(parser.current.text);
@@ -16,7 +18,7 @@ void Compiler::advance() {
 }
 
 void Compiler::emitByte(uint8_t byte) {
-	currentChunk.addByte(byte, parser.previous.line);
+	currentChunk().addByte(byte, parser.previous.line);
 }
 
 void Compiler::emitOpCodeAndByte(OpCode code, uint8_t byte) {
@@ -37,24 +39,56 @@ void Compiler::consume(TokenType type, const std::string& message) {
 	}
 }
 
-void Compiler::endCompilation() {
+FunctionState& Compiler::state() {
+	return states.back();
+}
+
+Chunk& Compiler::currentChunk() {
+	return state().function->chunk;
+}
+
+void Compiler::beginFunction(FunctionType type) {
+	auto name = type == FunctionType::Script ? ""s : parser.previous.text;
+	states.push_back(FunctionState{ std::make_shared<ObjFunction>(name), type });
+	// slot zero holds the callee itself, or the receiver in methods
+	auto slotName = type == FunctionType::Method || type == FunctionType::Initializer ? "this"s : ""s;
+	state().locals.push_back(Local{ Token{ TokenType::Identifier, slotName, 0 }, 0, false, nextLocalId++ });
+}
+
+FunctionState Compiler::endFunction() {
 	emitReturn();
+	auto finished = states.back();
+	finished.function->upvalueCount = finished.upvalues.size();
+	if (optimizationLevel > 0 && !parser.hadError) {
+		optimizeChunk(finished.function->chunk);
+	}
 	if (debug_printCode && !parser.hadError) {
-		disassembleChunk(currentChunk, "code");
+		disassembleChunk(finished.function->chunk, finished.function->name.empty() ? "<script>" : finished.function->name, std::cout);
 	}
+	states.pop_back();
+	return finished;
 }
 
 void Compiler::emitOpCode(OpCode code) {
+	state().lastInstruction = currentChunk().code.size();
 	emitByte(asByte(code));
 }
 
 void Compiler::emitReturn() {
+	if (state().type == FunctionType::Initializer) {
+		emitOpCodeAndByte(OpCode::GetLocal, 0);
+	} else {
+		emitOpCode(OpCode::Nil);
+	}
 	emitOpCode(OpCode::Return);
 }
 
 uint8_t Compiler::makeConstant(Value value) {
-	auto constant = currentChunk.addConstant(value);
+	if (value.isNumber()) value = Value::number(value.asNumberUnsafe());
+	auto constant = currentChunk().addConstant(value);
 	if (constant > std::numeric_limits<uint8_t>::max()) {
+		// keeps the pool at its limit, so looking for a shared entry stays cheap
+		currentChunk().constants.pop_back();
 		error("Too many constants in one chunk.");
 		return 0;
 	}
@@ -65,6 +99,48 @@ void Compiler::emitConstant(Value value) {
 	emitOpCodeAndByte(OpCode::Constant, makeConstant(value));
 }
 
+// nil and booleans have their own opcodes, everything else goes through the constant table
+void Compiler::emitValue(Value value) {
+	if (value.isNil()) {
+		emitOpCode(OpCode::Nil);
+	} else if (value.isBool()) {
+		emitOpCode(value.asBoolUnsafe() ? OpCode::True : OpCode::False);
+	} else {
+		emitConstant(value);
+	}
+}
+
+static size_t pushSize(Value value) {
+	return value.isNil() || value.isBool() ? 1 : 2;
+}
+
+// a push of a value known here, typed so that later folds can take it back
+StaticType Compiler::emitKnownValue(Value value) {
+	auto& constants = currentChunk().constants;
+	auto before = constants.size();
+	emitValue(value);
+	StaticType type{ value.isNumber(), {}, value };
+	if (constants.size() > before) type.addedConstant = constants.size() - 1;
+	return type;
+}
+
+// removes the last push in the chunk, along with its pool entry if it added the newest one
+void Compiler::dropPush(const StaticType& operand) {
+	auto& chunk = currentChunk();
+	auto start = chunk.code.size() - pushSize(operand.constant.value());
+	chunk.code.resize(start);
+	chunk.lines.resize(start);
+	if (operand.addedConstant && operand.addedConstant.value() == chunk.constants.size() - 1) chunk.constants.pop_back();
+}
+
+void Compiler::emitCache() {
+	auto cache = currentChunk().addCache();
+	if (cache > std::numeric_limits<uint16_t>::max()) {
+		error("Too many property accesses in one chunk.");
+	}
+	emitBytes(static_cast<uint8_t>(cache >> 8), static_cast<uint8_t>(cache));
+}
+
 bool Compiler::check(TokenType type) {
 	return parser.current.type == type;
 }
@@ -76,14 +152,16 @@ bool Compiler::match(TokenType type) {
 }
 
 void Compiler::beginScope() {
-	scopeDepth++;
+	state().scopeDepth++;
 }
 
 void Compiler::endScope() {
-	scopeDepth--;
+	auto& locals = state().locals;
+	state().scopeDepth--;
 
-	while (locals.size() && locals.back().depth > scopeDepth) {
-		emitOpCode(OpCode::Drop);
+	while (locals.size() && locals.back().depth > state().scopeDepth) {
+		// only captured slots pay for moving their value off the stack
+		emitOpCode(locals.back().isCaptured ? OpCode::CloseUpvalue : OpCode::Drop);
 		locals.pop_back();
 	}
 }
@@ -97,12 +175,16 @@ void Compiler::parsePrecedence(Precedence precedence) {
 	}
 
 	auto canAssign = precedence <= Precedence::Assignment;
+	exprType = {};
 	(this->*prefixRule)(canAssign);
+	if (!isTypedRule(prefixRule)) exprType = {};
 
 	while (precedence <= rule(parser.current.type).precedence) {
 		advance();
 		auto infixRule = rule(parser.previous.type).infix;
+		leftType = std::exchange(exprType, {});
 		(this->*infixRule)(canAssign);
+		if (!isTypedRule(infixRule)) exprType = {};
 	}
 
 	if (canAssign && match(TokenType::Equal)) {
@@ -110,20 +192,126 @@ void Compiler::parsePrecedence(Precedence precedence) {
 	}
 }
 
+// only these rules set exprType; anything else yields a value of unknown type
+bool Compiler::isTypedRule(ParseFn rule) {
+	return rule == &Compiler::number || rule == &Compiler::string || rule == &Compiler::literal
+		|| rule == &Compiler::grouping || rule == &Compiler::unary || rule == &Compiler::binary
+		|| rule == &Compiler::variable;
+}
+
+static std::optional<Value> foldOperator(TokenType operatorType, Value a, Value b) {
+	switch (operatorType) {
+		case TokenType::EqualEqual: return Value{ a == b };
+		case TokenType::BangEqual: return Value{ !(a == b) };
+		default: break;
+	}
+
+	if (operatorType == TokenType::Plus && a.isObj() && b.isObj() && a.asObjRawUnsafe()->isString() && b.asObjRawUnsafe()->isString()) {
+		auto str = a.asObjRawUnsafe()->asStringUnsafe() + b.asObjRawUnsafe()->asStringUnsafe();
+		return Value{ std::make_shared<ObjString>(str) };
+	}
+	if (!a.isNumber() || !b.isNumber()) return std::nullopt;
+
+	auto x = a.asNumberUnsafe();
+	auto y = b.asNumberUnsafe();
+	switch (operatorType) {
+		case TokenType::Plus: return Value{ x + y };
+		case TokenType::Minus: return Value{ x - y };
+		case TokenType::Star: return Value{ x * y };
+		case TokenType::Slash: return Value{ x / y };
+		case TokenType::Less: return Value{ x < y };
+		case TokenType::Greater: return Value{ x > y };
+		// compiled as negated > and <, so NaN must fold the same way
+		case TokenType::LessEqual: return Value{ !(x > y) };
+		case TokenType::GreaterEqual: return Value{ !(x < y) };
+		default: return std::nullopt;
+	}
+}
+
+// both operands compiled to single pushes at the end of the chunk; swaps them for the result
+bool Compiler::foldConstant(TokenType operatorType, const StaticType& left, const StaticType& right) {
+	if (!left.constant || !right.constant) return false;
+	auto result = foldOperator(operatorType, left.constant.value(), right.constant.value());
+	if (!result) return false;
+
+	dropPush(right);
+	dropPush(left);
+	exprType = emitKnownValue(result.value());
+	return true;
+}
+
+static void mergeDependencies(std::vector<size_t>& into, const std::vector<size_t>& from) {
+	for (auto id : from) {
+		if (std::find(into.begin(), into.end(), id) == into.end()) into.push_back(id);
+	}
+}
+
+void Compiler::emitNumberOp(OpCode generic, OpCode unchecked, const StaticType& left, const StaticType& right) {
+	if (!left.isNumber || !right.isNumber) {
+		emitOpCode(generic);
+		return;
+	}
+
+	UncheckedSite site{ currentChunk().code.size(), generic, left.dependsOn };
+	mergeDependencies(site.dependsOn, right.dependsOn);
+	emitOpCode(unchecked);
+	if (!site.dependsOn.empty()) state().uncheckedSites.push_back(site);
+}
+
+void Compiler::assignProof(FunctionState& state, size_t id, const StaticType& type) {
+	if (!type.isNumber) {
+		invalidateProof(state, id);
+		return;
+	}
+
+	// a proof can only start at the declaration; parameters and the like never get one
+	auto proof = state.proofs.find(id);
+	if (proof == state.proofs.end()) {
+		state.proofs[id] = StaticType{};
+	} else if (proof->second.isNumber) {
+		mergeDependencies(proof->second.dependsOn, type.dependsOn);
+	}
+}
+
+// called when a local may hold a non-number after all: every unchecked opcode
+// already emitted on its behalf, and every local proven through it, falls back
+void Compiler::invalidateProof(FunctionState& state, size_t id) {
+	auto proof = state.proofs.find(id);
+	if (proof == state.proofs.end()) {
+		state.proofs[id] = StaticType{};
+		return;
+	}
+	if (!proof->second.isNumber) return;
+	proof->second = StaticType{};
+
+	auto& code = state.function->chunk.code;
+	for (auto& site : state.uncheckedSites) {
+		if (std::find(site.dependsOn.begin(), site.dependsOn.end(), id) != site.dependsOn.end()) {
+			code[site.offset] = asByte(site.generic);
+		}
+	}
+
+	std::vector<size_t> dependents{};
+	for (auto& [other, otherProof] : state.proofs) {
+		auto& deps = otherProof.dependsOn;
+		if (otherProof.isNumber && std::find(deps.begin(), deps.end(), id) != deps.end()) dependents.push_back(other);
+	}
+	for (auto other : dependents) invalidateProof(state, other);
+}
+
 void Compiler::expression() {
 	parsePrecedence(Precedence::Assignment);
 }
 
 void Compiler::number(bool) {
-	auto value = read_cast<double>(parser.previous.text);
-	emitConstant(value);
+	exprType = emitKnownValue(read_cast<double>(parser.previous.text));
 }
 
 void Compiler::string(bool) {
 	auto value = parser.previous.text.substr(1, parser.previous.text.size() - 2);
 	// lives forever, I think.
 	auto string = std::make_shared<ObjString>(value);
-	emitConstant(Value{ string });
+	exprType = emitKnownValue(Value{ string });
 }
 
 void Compiler::grouping(bool) {
@@ -135,10 +323,23 @@ void Compiler::unary(bool) {
 	auto operatorType = parser.previous.type;
 
 	parsePrecedence(Precedence::Unary);
+	auto operand = exprType;
+
+	if (operand.constant && (operatorType == TokenType::Bang || operand.constant->isNumber())) {
+		auto value = operand.constant.value();
+		auto result = operatorType == TokenType::Bang ? Value{ !value.castToBool() } : Value{ -value.asNumberUnsafe() };
+		dropPush(operand);
+		exprType = emitKnownValue(result);
+		return;
+	}
 
 	switch (operatorType) {
-		case TokenType::Bang: emitOpCode(OpCode::Not); break;
-		case TokenType::Minus: emitOpCode(OpCode::Negate); break;
+		case TokenType::Bang: emitOpCode(OpCode::Not); exprType = {}; break;
+		case TokenType::Minus:
+			emitNumberOp(OpCode::Negate, OpCode::NegateNumberUnchecked, operand, operand);
+			// the operand's constant, if any, is no longer what's on the stack
+			exprType = operand.isNumber ? StaticType{ true, operand.dependsOn } : StaticType{};
+			break;
 		default:
 			unreachable();
 	}
@@ -147,35 +348,211 @@ void Compiler::unary(bool) {
 void Compiler::binary(bool) {
 	auto operatorType = parser.previous.type;
 	auto rule = Compiler::rule(operatorType);
+	auto left = leftType;
 
 	parsePrecedence(nextPrecedence(rule.precedence));
+	auto right = exprType;
+
+	if (foldConstant(operatorType, left, right)) return;
 
 	switch (operatorType) {
 		case TokenType::BangEqual: emitOpCode(OpCode::Equal); emitOpCode(OpCode::Not); break;
 		case TokenType::EqualEqual: emitOpCode(OpCode::Equal); break;
-		case TokenType::Greater: emitOpCode(OpCode::Greater); break;
-		case TokenType::GreaterEqual: emitOpCode(OpCode::Less); emitOpCode(OpCode::Not); break;
-		case TokenType::Less: emitOpCode(OpCode::Less); break;
-		case TokenType::LessEqual: emitOpCode(OpCode::Greater); emitOpCode(OpCode::Not); break;
-		case TokenType::Plus:  emitOpCode(OpCode::Add); break;
-		case TokenType::Minus: emitOpCode(OpCode::Subtract); break;
-		case TokenType::Star:  emitOpCode(OpCode::Multiply); break;
-		case TokenType::Slash: emitOpCode(OpCode::Divide); break;
+		case TokenType::Greater: emitNumberOp(OpCode::Greater, OpCode::GreaterNumberUnchecked, left, right); break;
+		case TokenType::GreaterEqual: emitNumberOp(OpCode::Less, OpCode::LessNumberUnchecked, left, right); emitOpCode(OpCode::Not); break;
+		case TokenType::Less: emitNumberOp(OpCode::Less, OpCode::LessNumberUnchecked, left, right); break;
+		case TokenType::LessEqual: emitNumberOp(OpCode::Greater, OpCode::GreaterNumberUnchecked, left, right); emitOpCode(OpCode::Not); break;
+		case TokenType::Plus:  emitNumberOp(OpCode::Add, OpCode::AddNumberUnchecked, left, right); break;
+		case TokenType::Minus: emitNumberOp(OpCode::Subtract, OpCode::SubtractNumberUnchecked, left, right); break;
+		case TokenType::Star:  emitNumberOp(OpCode::Multiply, OpCode::MultiplyNumberUnchecked, left, right); break;
+		case TokenType::Slash: emitNumberOp(OpCode::Divide, OpCode::DivideNumberUnchecked, left, right); break;
+		case TokenType::In:    emitOpCode(OpCode::HasKey); break;
 		default:
 			unreachable();
 	}
+
+	exprType = {};
+	switch (operatorType) {
+		case TokenType::Plus:
+		case TokenType::Minus:
+		case TokenType::Star:
+		case TokenType::Slash:
+			if (left.isNumber && right.isNumber) {
+				exprType = StaticType{ true, left.dependsOn };
+				mergeDependencies(exprType.dependsOn, right.dependsOn);
+			}
+			break;
+		default:
+			break;
+	}
 }
 
 void Compiler::literal(bool) {
 	switch (parser.previous.type) {
-		case TokenType::False: emitOpCode(OpCode::False); break;
-		case TokenType::True: emitOpCode(OpCode::True); break;
-		case TokenType::Nil: emitOpCode(OpCode::Nil); break;
+		case TokenType::False: emitOpCode(OpCode::False); exprType.constant = Value{ false }; break;
+		case TokenType::True: emitOpCode(OpCode::True); exprType.constant = Value{ true }; break;
+		case TokenType::Nil: emitOpCode(OpCode::Nil); exprType.constant = Value{}; break;
 		default:
 			unreachable();
 	}
 }
 
+void Compiler::call(bool) {
+	auto argCount = argumentList();
+	emitOpCodeAndByte(OpCode::Call, argCount);
+}
+
+uint8_t Compiler::argumentList() {
+	uint8_t argCount = 0;
+	if (!check(TokenType::RightParen)) {
+		do {
+			expression();
+			if (argCount == std::numeric_limits<uint8_t>::max()) {
+				error("Can't have more than 255 arguments.");
+			}
+			argCount++;
+		} while (match(TokenType::Comma));
+	}
+	consume(TokenType::RightParen, "Expected ')' after arguments.");
+	return argCount;
+}
+
+void Compiler::dot(bool canAssign) {
+	consume(TokenType::Identifier, "Expected property name after '.'.");
+	auto name = identifierConstant(parser.previous);
+
+	if (canAssign && match(TokenType::Equal)) {
+		expression();
+		emitOpCodeAndByte(OpCode::SetProperty, name);
+	} else if (match(TokenType::LeftParen)) {
+		auto argCount = argumentList();
+		emitOpCodeAndByte(OpCode::Invoke, name);
+		emitByte(argCount);
+	} else {
+		emitOpCodeAndByte(OpCode::GetProperty, name);
+	}
+	emitCache();
+}
+
+void Compiler::thisExpr(bool) {
+	if (classes.empty()) {
+		error("Can't use 'this' outside of a class.");
+		return;
+	}
+
+	variable(false);
+}
+
+void Compiler::superExpr(bool) {
+	if (classes.empty()) {
+		error("Can't use 'super' outside of a class.");
+	} else if (!classes.back().hasSuperclass) {
+		error("Can't use 'super' in a class with no superclass.");
+	}
+
+	consume(TokenType::Dot, "Expected '.' after 'super'.");
+	consume(TokenType::Identifier, "Expected superclass method name.");
+	auto name = identifierConstant(parser.previous);
+
+	namedVariable(Token{ TokenType::This, "this", parser.previous.line }, false);
+	if (match(TokenType::LeftParen)) {
+		auto argCount = argumentList();
+		namedVariable(Token{ TokenType::Super, "super", parser.previous.line }, false);
+		emitOpCodeAndByte(OpCode::SuperInvoke, name);
+		emitByte(argCount);
+	} else {
+		namedVariable(Token{ TokenType::Super, "super", parser.previous.line }, false);
+		emitOpCodeAndByte(OpCode::GetSuper, name);
+	}
+}
+
+void Compiler::array(bool) {
+	uint8_t count = 0;
+	if (!check(TokenType::RightBracket)) {
+		do {
+			expression();
+			if (count == std::numeric_limits<uint8_t>::max()) {
+				error("Can't have more than 255 elements in an array literal.");
+			}
+			count++;
+		} while (match(TokenType::Comma));
+	}
+	consume(TokenType::RightBracket, "Expected ']' after array elements.");
+	emitOpCodeAndByte(OpCode::Array, count);
+}
+
+void Compiler::index(bool canAssign) {
+	expression();
+	consume(TokenType::RightBracket, "Expected ']' after index.");
+
+	if (canAssign && match(TokenType::Equal)) {
+		expression();
+		emitOpCode(OpCode::SetIndex);
+	} else {
+		emitOpCode(OpCode::GetIndex);
+	}
+}
+
+void Compiler::map(bool) {
+	uint8_t count = 0;
+	if (!check(TokenType::RightBrace)) {
+		do {
+			expression();
+			consume(TokenType::Colon, "Expected ':' after map key.");
+			expression();
+			if (count == std::numeric_limits<uint8_t>::max()) {
+				error("Can't have more than 255 entries in a map literal.");
+			}
+			count++;
+		} while (match(TokenType::Comma));
+	}
+	consume(TokenType::RightBrace, "Expected '}' after map entries.");
+	emitOpCodeAndByte(OpCode::Map, count);
+}
+
+void Compiler::deleteExpr(bool) {
+	parsePrecedence(Precedence::Unary);
+
+	auto& code = currentChunk().code;
+	if (code.empty() || state().lastInstruction != code.size() - 1 || code.back() != asByte(OpCode::GetIndex)) {
+		error("Can only delete a map entry.");
+		return;
+	}
+	// the operand compiled to a lookup; turn it into a removal of the same key
+	code.back() = asByte(OpCode::DeleteKey);
+}
+
+// `yield` alone hands over nil
+void Compiler::yieldExpr(bool) {
+	switch (parser.current.type) {
+		case TokenType::Semicolon:
+		case TokenType::RightParen:
+		case TokenType::RightBracket:
+		case TokenType::RightBrace:
+		case TokenType::Comma:
+		case TokenType::Colon:
+		case TokenType::EOF:
+			emitOpCode(OpCode::Nil);
+			break;
+		default:
+			parsePrecedence(Precedence::Assignment);
+	}
+	emitOpCode(OpCode::Yield);
+}
+
+// resume(fiber) or resume(fiber, value)
+void Compiler::resumeExpr(bool) {
+	consume(TokenType::LeftParen, "Expected '(' after 'resume'.");
+	expression();
+	if (match(TokenType::Comma)) {
+		expression();
+	} else {
+		emitOpCode(OpCode::Nil);
+	}
+	consume(TokenType::RightParen, "Expected ')' after resume arguments.");
+	emitOpCode(OpCode::Resume);
+}
+
 void Compiler::andExpr(bool) {
 	auto endJump = emitJump(OpCode::ConditionalJump);
 
@@ -200,14 +577,26 @@ void Compiler::variable(bool canAssign) {
 	namedVariable(parser.previous, canAssign);
 }
 
-void Compiler::namedVariable(Token& name, bool canAssign) {
+void Compiler::namedVariable(const Token& name, bool canAssign) {
 	OpCode getOp, setOp;
-	auto argMaybe = resolveLocal(name);
+	auto argMaybe = resolveLocal(state(), name);
 	uint8_t arg;
 	if (argMaybe) {
 		arg = static_cast<uint8_t>(argMaybe.value());
 		getOp = OpCode::GetLocal;
 		setOp = OpCode::SetLocal;
+	} else if (auto upvalue = resolveUpvalue(states.size() - 1, name)) {
+		arg = static_cast<uint8_t>(upvalue.value());
+		getOp = OpCode::GetUpvalue;
+		setOp = OpCode::SetUpvalue;
+	} else if (auto constant = constantGlobals.find(name.text); constant != constantGlobals.end()) {
+		if (canAssign && match(TokenType::Equal)) {
+			error("Can't assign to a constant.");
+			expression();
+			return;
+		}
+		exprType = emitKnownValue(constant->second);
+		return;
 	} else {
 		arg = identifierConstant(name);
 		getOp = OpCode::GetGlobal;
@@ -217,18 +606,31 @@ void Compiler::namedVariable(Token& name, bool canAssign) {
 	if (canAssign && match(TokenType::Equal)) {
 		expression();
 		emitOpCodeAndByte(setOp, arg);
+		// the assignment's value keeps its type; the local's proof absorbs it
+		if (setOp == OpCode::SetLocal) assignProof(state(), state().locals[arg].id, exprType);
+		exprType.constant.reset();
 	} else {
 		emitOpCodeAndByte(getOp, arg);
+		exprType = {};
+		if (getOp == OpCode::GetLocal) {
+			auto id = state().locals[arg].id;
+			auto proof = state().proofs.find(id);
+			if (proof != state().proofs.end() && proof->second.isNumber) exprType = StaticType{ true, { id } };
+		}
 	}
 }
 
 void Compiler::declareVariable() {
-	if (scopeDepth == 0) return;
+	if (state().scopeDepth == 0) {
+		if (constantGlobals.contains(parser.previous.text)) error("Already a constant with this name.");
+		return;
+	}
 
+	auto& locals = state().locals;
 	auto name = parser.previous;
 	for (auto i = locals.size() - 1; i != std::numeric_limits<size_t>::max(); i--) {
 		auto local = locals[i];
-		if (local.depth != -1 && local.depth < scopeDepth) break;
+		if (local.depth != -1 && local.depth < state().scopeDepth) break;
 
 		if (name.text == local.name.text) {
 			error("A variable with this name is already in scope.");
@@ -237,16 +639,17 @@ void Compiler::declareVariable() {
 	addLocal(name);
 }
 
-void Compiler::addLocal(Token& name) {
-	if (locals.size() > std::numeric_limits<uint8_t>::max()) {
+void Compiler::addLocal(const Token& name) {
+	if (state().locals.size() > std::numeric_limits<uint8_t>::max()) {
 		error("Too many local variables.");
 		return;
 	}
 
-	locals.push_back(Local{ name, -1 });
+	state().locals.push_back(Local{ name, -1, false, nextLocalId++ });
 }
 
-std::optional<size_t> Compiler::resolveLocal(Token& name) {
+std::optional<size_t> Compiler::resolveLocal(FunctionState& state, const Token& name) {
+	auto& locals = state.locals;
 	for (auto i = locals.size() - 1; i != std::numeric_limits<size_t>::max(); i--) {
 		auto local = locals[i];
 		if (name.text == local.name.text) {
@@ -259,6 +662,39 @@ std::optional<size_t> Compiler::resolveLocal(Token& name) {
 	return std::nullopt;
 }
 
+std::optional<size_t> Compiler::resolveUpvalue(size_t depth, const Token& name) {
+	if (depth == 0) return std::nullopt;
+
+	auto& enclosing = states[depth - 1];
+	if (auto local = resolveLocal(enclosing, name)) {
+		enclosing.locals[local.value()].isCaptured = true;
+		// the closure may store anything through its upvalue
+		invalidateProof(enclosing, enclosing.locals[local.value()].id);
+		return addUpvalue(states[depth], static_cast<uint8_t>(local.value()), true);
+	}
+
+	if (auto upvalue = resolveUpvalue(depth - 1, name)) {
+		return addUpvalue(states[depth], static_cast<uint8_t>(upvalue.value()), false);
+	}
+
+	return std::nullopt;
+}
+
+size_t Compiler::addUpvalue(FunctionState& state, uint8_t index, bool isLocal) {
+	auto& upvalues = state.upvalues;
+	for (size_t i = 0; i < upvalues.size(); i++) {
+		if (upvalues[i].index == index && upvalues[i].isLocal == isLocal) return i;
+	}
+
+	if (upvalues.size() > std::numeric_limits<uint8_t>::max()) {
+		error("Too many closure variables in function.");
+		return 0;
+	}
+
+	upvalues.push_back(Upvalue{ index, isLocal });
+	return upvalues.size() - 1;
+}
+
 void Compiler::synchronize() {
 	parser.panicMode = false;
 	while (parser.current.type != TokenType::EOF) {
@@ -267,8 +703,10 @@ void Compiler::synchronize() {
 			case TokenType::Class:
 			case TokenType::Fun:
 			case TokenType::Var:
+			case TokenType::Const:
 			case TokenType::For:
 			case TokenType::While:
+			case TokenType::Switch:
 			case TokenType::If:
 			case TokenType::Print:
 			case TokenType::Return:
@@ -286,29 +724,57 @@ void Compiler::varDeclaration() {
 		expression();
 	} else {
 		emitOpCode(OpCode::Nil);
+		exprType = {};
 	}
 
 	consume(TokenType::Semicolon, "Expected ';' after variable declaration.");
 
+	if (state().scopeDepth > 0) state().proofs[state().locals.back().id] = exprType;
+
 	defineVariable(global);
 }
 
+// a global whose value is known at compile time; reads are replaced by the value itself.
+// It is still defined at runtime for functions compiled before it and later REPL lines
+void Compiler::constDeclaration() {
+	consume(TokenType::Identifier, "Expected constant name.");
+	auto name = parser.previous;
+	auto topLevel = state().scopeDepth == 0;
+	if (topLevel) {
+		declareVariable();
+	} else {
+		error("Constants can only be declared at top level.");
+	}
+	auto global = identifierConstant(name);
+
+	consume(TokenType::Equal, "Expected '=' after constant name.");
+	expression();
+	if (!exprType.constant) {
+		error("A constant must be initialized with literals and other constants.");
+	} else if (topLevel) {
+		constantGlobals[name.text] = exprType.constant.value();
+	}
+	consume(TokenType::Semicolon, "Expected ';' after constant declaration.");
+
+	if (topLevel) emitOpCodeAndByte(OpCode::DefineConstant, global);
+}
+
 uint8_t Compiler::parseVariable(const std::string& message) {
 	consume(TokenType::Identifier, message);
 
 	declareVariable();
-	if (scopeDepth > 0) return 0;
+	if (state().scopeDepth > 0) return 0;
 
 	return identifierConstant(parser.previous);
 }
 
-uint8_t Compiler::identifierConstant(Token& name) {
+uint8_t Compiler::identifierConstant(const Token& name) {
 	auto string = std::make_shared<ObjString>(name.text);
 	return makeConstant(Value{ string });
 }
 
 void Compiler::defineVariable(uint8_t global) {
-	if (scopeDepth > 0) {
+	if (state().scopeDepth > 0) {
 		markInitialized();
 		return;
 	}
@@ -317,12 +783,111 @@ void Compiler::defineVariable(uint8_t global) {
 }
 
 void Compiler::markInitialized() {
-	locals.back().depth = scopeDepth;
+	if (state().scopeDepth == 0) return;
+	state().locals.back().depth = state().scopeDepth;
+}
+
+void Compiler::function(FunctionType type) {
+	beginFunction(type);
+	beginScope();
+
+	consume(TokenType::LeftParen, "Expected '(' after function name.");
+	if (!check(TokenType::RightParen)) {
+		do {
+			state().function->arity++;
+			if (state().function->arity > std::numeric_limits<uint8_t>::max()) {
+				errorAtCurrent("Can't have more than 255 parameters.");
+			}
+			auto constant = parseVariable("Expected parameter name.");
+			defineVariable(constant);
+		} while (match(TokenType::Comma));
+	}
+	consume(TokenType::RightParen, "Expected ')' after parameters.");
+	consume(TokenType::LeftBrace, "Expected '{' before function body.");
+	block();
+
+	auto finished = endFunction();
+	auto constant = makeConstant(Value{ finished.function });
+	if (finished.upvalues.empty()) {
+		// nothing captured, so the bare function is callable without a closure
+		emitOpCodeAndByte(OpCode::Constant, constant);
+		return;
+	}
+
+	emitOpCodeAndByte(OpCode::Closure, constant);
+	for (auto& upvalue : finished.upvalues) {
+		emitBytes(upvalue.isLocal ? 1 : 0, upvalue.index);
+	}
+}
+
+void Compiler::funDeclaration() {
+	auto global = parseVariable("Expected function name.");
+	markInitialized();
+	function(FunctionType::Function);
+	defineVariable(global);
+}
+
+void Compiler::method() {
+	consume(TokenType::Identifier, "Expected method name.");
+	auto name = identifierConstant(parser.previous);
+
+	auto type = parser.previous.text == "init" ? FunctionType::Initializer : FunctionType::Method;
+	function(type);
+	emitOpCodeAndByte(OpCode::Method, name);
+}
+
+void Compiler::classDeclaration() {
+	consume(TokenType::Identifier, "Expected class name.");
+	auto className = parser.previous;
+	auto nameConstant = identifierConstant(parser.previous);
+	declareVariable();
+
+	emitOpCodeAndByte(OpCode::Class, nameConstant);
+	defineVariable(nameConstant);
+
+	classes.push_back(ClassState{});
+
+	if (match(TokenType::Less)) {
+		consume(TokenType::Identifier, "Expected superclass name.");
+		variable(false);
+
+		if (className.text == parser.previous.text) {
+			error("A class can't inherit from itself.");
+		}
+
+		beginScope();
+		addLocal(Token{ TokenType::Super, "super", parser.previous.line });
+		defineVariable(0);
+
+		namedVariable(className, false);
+		emitOpCode(OpCode::Inherit);
+		classes.back().hasSuperclass = true;
+	}
+
+	namedVariable(className, false);
+	consume(TokenType::LeftBrace, "Expected '{' before class body.");
+	while (!check(TokenType::RightBrace) && !check(TokenType::EOF)) {
+		method();
+	}
+	consume(TokenType::RightBrace, "Expected '}' after class body.");
+	emitOpCode(OpCode::Drop);
+
+	if (classes.back().hasSuperclass) {
+		endScope();
+	}
+
+	classes.pop_back();
 }
 
 void Compiler::declaration() {
-	if (match(TokenType::Var)) {
+	if (match(TokenType::Class)) {
+		classDeclaration();
+	} else if (match(TokenType::Fun)) {
+		funDeclaration();
+	} else if (match(TokenType::Var)) {
 		varDeclaration();
+	} else if (match(TokenType::Const)) {
+		constDeclaration();
 	} else {
 		statement();
 	}
@@ -339,6 +904,10 @@ void Compiler::statement() {
 		whileStatement();
 	} else if (match(TokenType::For)) {
 		forStatement();
+	} else if (match(TokenType::Switch)) {
+		switchStatement();
+	} else if (match(TokenType::Return)) {
+		returnStatement();
 	} else if (match(TokenType::LeftBrace)) {
 		beginScope();
 		block();
@@ -372,16 +941,22 @@ void Compiler::ifStatement() {
 	patchJump(falseJump);
 }
 
+// loops are rotated: the condition is tested once on entry and then again after
+// each iteration, so an iteration takes a single backward branch
 void Compiler::whileStatement() {
-	auto loopStart = currentChunk.code.size();
 	consume(TokenType::LeftParen, "Expected '(' after 'while'.");
+	auto conditionStart = currentChunk().code.size();
 	expression();
+	auto conditionEnd = currentChunk().code.size();
 	consume(TokenType::RightParen, "Expected '(' after condition.");
 
 	auto exitJump = emitJump(OpCode::ConditionalJump);
+	auto loopStart = currentChunk().code.size();
 	emitOpCode(OpCode::Drop);
 	statement();
-	emitLoop(loopStart);
+
+	emitCode(copyCode(conditionStart, conditionEnd));
+	emitLoop(OpCode::JumpBackIfTrue, loopStart);
 
 	patchJump(exitJump);
 	emitOpCode(OpCode::Drop);
@@ -394,69 +969,317 @@ void Compiler::forStatement() {
 	if (match(TokenType::Semicolon)) {
 
 	} else if (match(TokenType::Var)) {
+		auto variable = parser.current;
 		varDeclaration();
+
+		auto loop = numericLoopHeader(variable);
+		if (loop) {
+			numericForLoop(loop.value());
+			endScope();
+			return;
+		}
 	} else {
 		expressionStatement();
 	}
 
-	auto loopStart = currentChunk.code.size();
+	auto conditionStart = currentChunk().code.size();
+	std::optional<size_t> conditionEnd{};
 	std::optional<size_t> exitJump{};
 	if (!match(TokenType::Semicolon)) {
 		expression();
+		conditionEnd = currentChunk().code.size();
 		consume(TokenType::Semicolon, "Expected ';' after for condition");
 
 		exitJump = emitJump(OpCode::ConditionalJump);
-		emitOpCode(OpCode::Drop);
 	}
 
+	auto loopStart = currentChunk().code.size();
+	if (exitJump) emitOpCode(OpCode::Drop);
+
+	// compiled here but run after the body, where it is moved once the body is done
+	std::optional<CodeFragment> increment{};
 	if (!match(TokenType::RightParen)) {
-		auto bodyJump = emitJump(OpCode::Jump);
-		auto incrementStart = currentChunk.code.size();
+		auto incrementStart = currentChunk().code.size();
 		expression();
 		emitOpCode(OpCode::Drop);
 		consume(TokenType::RightParen, "Expected ')' after for clauses");
-
-		emitLoop(loopStart);
-		loopStart = incrementStart;
-		patchJump(bodyJump);
+		increment = cutCode(incrementStart);
 	}
 
 	statement();
-	emitLoop(loopStart);
+	if (increment) emitCode(increment.value());
 
-	if (exitJump) {
+	if (conditionEnd) {
+		emitCode(copyCode(conditionStart, conditionEnd.value()));
+		emitLoop(OpCode::JumpBackIfTrue, loopStart);
 		patchJump(exitJump.value());
 		emitOpCode(OpCode::Drop);
+	} else {
+		emitLoop(OpCode::JumpBack, loopStart);
 	}
 
 	endScope();
 }
 
+std::optional<NumericLoop> Compiler::numericLoopHeader(const Token& variable) {
+	static const std::unordered_map<TokenType, ForCompare> compares{
+		{ TokenType::Less, ForCompare::Less },
+		{ TokenType::LessEqual, ForCompare::LessEqual },
+		{ TokenType::Greater, ForCompare::Greater },
+		{ TokenType::GreaterEqual, ForCompare::GreaterEqual },
+	};
+	constexpr size_t headerLength = 10;
+
+	if (variable.type != TokenType::Identifier || parser.hadError) return std::nullopt;
+
+	// only peeks, so a mismatch leaves nothing to undo
+	std::vector<Token> header{ parser.current };
+	while (header.size() < headerLength) header.push_back(tokens.peek(header.size() - 1));
+
+	auto isVariable = [&](const Token& token) {
+		return token.type == TokenType::Identifier && token.text == variable.text;
+	};
+	auto& limit = header[2];
+	if (!isVariable(header[0]) || !compares.contains(header[1].type)) return std::nullopt;
+	if (limit.type != TokenType::Number && limit.type != TokenType::Identifier) return std::nullopt;
+	if (header[3].type != TokenType::Semicolon) return std::nullopt;
+	if (!isVariable(header[4]) || header[5].type != TokenType::Equal || !isVariable(header[6])) return std::nullopt;
+	if (header[7].type != TokenType::Plus && header[7].type != TokenType::Minus) return std::nullopt;
+	if (header[8].type != TokenType::Number || header[9].type != TokenType::RightParen) return std::nullopt;
+
+	// a bound captured from an enclosing function would need an upvalue
+	if (limit.type == TokenType::Identifier && !resolveLocal(state(), limit)) {
+		for (size_t depth = 0; depth + 1 < states.size(); depth++) {
+			if (resolveLocal(states[depth], limit)) return std::nullopt;
+		}
+	}
+
+	auto step = read_cast<double>(header[8].text);
+	NumericLoop loop{ compares.at(header[1].type), limit, header[7].type == TokenType::Minus ? -step : step };
+	for (size_t i = 0; i < headerLength; i++) advance();
+	return loop;
+}
+
+void Compiler::numericForLoop(const NumericLoop& loop) {
+	auto slot = static_cast<uint8_t>(state().locals.size() - 1);
+
+	auto kind = ForLimit::Global;
+	uint8_t limit = 0;
+	if (loop.limit.type == TokenType::Number) {
+		kind = ForLimit::Constant;
+		limit = makeConstant(Value{ read_cast<double>(loop.limit.text) });
+	} else if (auto local = resolveLocal(state(), loop.limit)) {
+		kind = ForLimit::Local;
+		limit = static_cast<uint8_t>(local.value());
+	} else {
+		limit = identifierConstant(loop.limit);
+	}
+	auto step = makeConstant(Value{ loop.step });
+
+	emitOpCode(OpCode::ForPrep);
+	emitBytes(slot, static_cast<uint8_t>(kind));
+	emitBytes(limit, static_cast<uint8_t>(loop.compare));
+	emitBytes(0xff, 0xff);
+	auto exitJump = currentChunk().code.size() - 2;
+
+	auto bodyStart = currentChunk().code.size();
+	statement();
+
+	emitOpCode(OpCode::ForLoop);
+	emitBytes(slot, static_cast<uint8_t>(kind));
+	emitBytes(limit, static_cast<uint8_t>(loop.compare));
+	emitByte(step);
+	auto offset = currentChunk().code.size() - bodyStart + 2;
+	if (offset > std::numeric_limits<uint16_t>::max()) error("Loop body too large.");
+	emitBytes(static_cast<uint8_t>(offset >> 8), static_cast<uint8_t>(offset));
+
+	patchJump(exitJump);
+}
+
+// cases don't fall through; the switch instruction's opcode is settled once every label is known
+void Compiler::switchStatement() {
+	consume(TokenType::LeftParen, "Expected '(' after 'switch'.");
+	expression();
+	consume(TokenType::RightParen, "Expected ')' after switch value.");
+	consume(TokenType::LeftBrace, "Expected '{' before switch cases.");
+
+	auto index = currentChunk().addSwitch();
+	if (index > std::numeric_limits<uint16_t>::max()) {
+		error("Too many switch statements in one chunk.");
+	}
+	auto instruction = currentChunk().code.size();
+	emitOpCode(OpCode::LookupSwitch);
+	emitBytes(static_cast<uint8_t>(index >> 8), static_cast<uint8_t>(index));
+
+	std::vector<std::pair<double, size_t>> numberCases{};
+	std::vector<std::pair<std::string, size_t>> stringCases{};
+	std::optional<size_t> defaultTarget{};
+	std::vector<size_t> endJumps{};
+
+	auto caseLabel = [&](size_t target) {
+		auto negate = match(TokenType::Minus);
+		if (match(TokenType::Number)) {
+			auto label = read_cast<double>(parser.previous.text);
+			if (negate) label = -label;
+			if (std::any_of(numberCases.begin(), numberCases.end(), [label](auto& entry) { return entry.first == label; })) {
+				error("Duplicate case label.");
+			}
+			numberCases.emplace_back(label, target);
+		} else if (!negate && match(TokenType::String)) {
+			auto label = parser.previous.text.substr(1, parser.previous.text.size() - 2);
+			if (std::any_of(stringCases.begin(), stringCases.end(), [&label](auto& entry) { return entry.first == label; })) {
+				error("Duplicate case label.");
+			}
+			stringCases.emplace_back(label, target);
+		} else {
+			errorAtCurrent("Expected a number or string literal as case label.");
+		}
+	};
+
+	while (!check(TokenType::RightBrace) && !check(TokenType::EOF)) {
+		auto target = currentChunk().code.size();
+		if (match(TokenType::Default)) {
+			if (defaultTarget) error("Switch already has a default case.");
+			defaultTarget = target;
+		} else {
+			consume(TokenType::Case, "Expected 'case' or 'default' in switch.");
+			do {
+				caseLabel(target);
+			} while (match(TokenType::Comma));
+		}
+		consume(TokenType::Colon, "Expected ':' after case label.");
+
+		beginScope();
+		while (!check(TokenType::Case) && !check(TokenType::Default) && !check(TokenType::RightBrace) && !check(TokenType::EOF)) {
+			declaration();
+		}
+		endScope();
+		endJumps.push_back(emitJump(OpCode::Jump));
+	}
+	consume(TokenType::RightBrace, "Expected '}' after switch cases.");
+
+	// the last case runs into the end of the switch anyway
+	if (!endJumps.empty()) {
+		currentChunk().code.resize(endJumps.back() - 1);
+		currentChunk().lines.resize(endJumps.back() - 1);
+		endJumps.pop_back();
+	}
+	for (auto jump : endJumps) patchJump(jump);
+
+	auto end = currentChunk().code.size();
+	auto& table = currentChunk().switches[index];
+	table.defaultTarget = defaultTarget.value_or(end);
+
+	// a table at least half full of integer labels is indexed directly
+	auto dense = stringCases.empty() && !numberCases.empty();
+	auto low = std::numeric_limits<double>::max();
+	auto high = std::numeric_limits<double>::lowest();
+	for (auto& [label, target] : numberCases) {
+		dense = dense && label == std::floor(label);
+		low = std::min(low, label);
+		high = std::max(high, label);
+	}
+	dense = dense && high - low < 2.0 * static_cast<double>(numberCases.size());
+
+	if (dense) {
+		currentChunk().code[instruction] = asByte(OpCode::TableSwitch);
+		table.low = low;
+		table.dense.assign(static_cast<size_t>(high - low) + 1, table.defaultTarget);
+		for (auto& [label, target] : numberCases) table.dense[static_cast<size_t>(label - low)] = target;
+	} else {
+		for (auto& [label, target] : numberCases) table.numbers[label] = target;
+		for (auto& [label, target] : stringCases) table.strings[std::make_shared<ObjString>(label)] = target;
+	}
+}
+
+void Compiler::returnStatement() {
+	if (state().type == FunctionType::Script) {
+		error("Can't return from top-level code.");
+	}
+
+	if (match(TokenType::Semicolon)) {
+		emitReturn();
+	} else {
+		if (state().type == FunctionType::Initializer) {
+			error("Can't return a value from an initializer.");
+		}
+
+		expression();
+		consume(TokenType::Semicolon, "Expected ';' after return value.");
+		emitOpCode(OpCode::Return);
+	}
+}
+
 size_t Compiler::emitJump(OpCode code) {
 	emitOpCode(code);
 	emitBytes(0xff, 0xff);
-	return currentChunk.code.size() - 2;
+	return currentChunk().code.size() - 2;
 }
 
 void Compiler::patchJump(size_t index) {
-	auto jump = currentChunk.code.size() - index - 2;
+	auto jump = currentChunk().code.size() - index - 2;
 
 	if (jump > std::numeric_limits<uint16_t>::max()) {
 		error("Too long of a jump.");
 	}
-	currentChunk.code[index] = static_cast<uint8_t>(jump >> 8);
-	currentChunk.code[index + 1] = static_cast<uint8_t>(jump);
+	currentChunk().code[index] = static_cast<uint8_t>(jump >> 8);
+	currentChunk().code[index + 1] = static_cast<uint8_t>(jump);
 }
 
-void Compiler::emitLoop(size_t start) {
-	emitOpCode(OpCode::JumpBack);
+void Compiler::emitLoop(OpCode code, size_t start) {
+	emitOpCode(code);
 
-	auto offset = currentChunk.code.size() - start + 2;
+	auto offset = currentChunk().code.size() - start + 2;
 	if (offset > std::numeric_limits<uint16_t>::max()) error("Loop body too large.");
 
 	emitBytes(static_cast<uint8_t>(offset >> 8), static_cast<uint8_t>(offset));
 }
 
+CodeFragment Compiler::copyCode(size_t start, size_t end) {
+	auto& chunk = currentChunk();
+	CodeFragment fragment{
+		{ chunk.code.begin() + start, chunk.code.begin() + end },
+		{ chunk.lines.begin() + start, chunk.lines.begin() + end },
+	};
+	for (auto& site : state().uncheckedSites) {
+		if (site.offset < start || site.offset >= end) continue;
+		fragment.sites.push_back(site);
+		fragment.sites.back().offset -= start;
+	}
+	return fragment;
+}
+
+// removes everything from start on, so only self-contained code may be cut
+CodeFragment Compiler::cutCode(size_t start) {
+	auto fragment = copyCode(start, currentChunk().code.size());
+	currentChunk().code.resize(start);
+	currentChunk().lines.resize(start);
+	std::erase_if(state().uncheckedSites, [start](const UncheckedSite& site) { return site.offset >= start; });
+	return fragment;
+}
+
+void Compiler::emitCode(const CodeFragment& fragment) {
+	auto& chunk = currentChunk();
+	auto base = chunk.code.size();
+	for (size_t i = 0; i < fragment.code.size(); i++) {
+		chunk.addByte(fragment.code[i], fragment.lines[i]);
+	}
+
+	for (auto site : fragment.sites) {
+		site.offset += base;
+		// a proof may have been invalidated since the fragment was taken
+		auto holds = std::all_of(site.dependsOn.begin(), site.dependsOn.end(), [this](size_t id) {
+			auto proof = state().proofs.find(id);
+			return proof != state().proofs.end() && proof->second.isNumber;
+		});
+		if (holds) {
+			state().uncheckedSites.push_back(site);
+		} else {
+			chunk.code[site.offset] = asByte(site.generic);
+		}
+	}
+}
+
 void Compiler::expressionStatement() {
 	expression();
 	consume(TokenType::Semicolon, "Expected ';' after expression.");
@@ -471,9 +1294,9 @@ void Compiler::block() {
 	consume(TokenType::RightBrace, "Expected '}' after block.");
 }
 
-std::optional<Chunk> Compiler::compile() {
-	Chunk chunk{};
-	currentChunk = chunk;
+std::optional<std::shared_ptr<ObjFunction>> Compiler::compile() {
+	PROBE(compile__start);
+	beginFunction(FunctionType::Script);
 
 	advance();
 
@@ -481,12 +1304,43 @@ std::optional<Chunk> Compiler::compile() {
 		declaration();
 	}
 
-	endCompilation();
+	auto script = endFunction();
+	if (wholeProgram && !parser.hadError) inlineReadOnlyGlobals(*script.function, optimizationLevel > 0);
+	PROBE1(compile__done, parser.hadError ? 0 : 1);
+
+	if (parser.hadError) {
+		return std::nullopt;
+	} else {
+		return script.function;
+	}
+}
+
+void Compiler::beginStream() {
+	advance();
+}
+
+bool Compiler::streamDone() {
+	return check(TokenType::EOF);
+}
+
+// a batch is a compilation of its own to the probes
+std::optional<std::shared_ptr<ObjFunction>> Compiler::compileBatch() {
+	PROBE(compile__start);
+	beginFunction(FunctionType::Script);
+
+	do {
+		declaration();
+	} while (!check(TokenType::EOF)
+		&& currentChunk().code.size() < streamBatchCode
+		&& currentChunk().constants.size() < streamBatchConstants);
+
+	auto batch = endFunction();
+	PROBE1(compile__done, parser.hadError ? 0 : 1);
 
 	if (parser.hadError) {
 		return std::nullopt;
 	} else {
-		return currentChunk;
+		return batch.function;
 	}
 }
 
@@ -5,6 +5,12 @@
 #include "scanner.h"
 
 struct VM;
+struct ObjFunction;
+
+// a streamed batch closes after the first declaration that takes it past either
+// limit, so that the VM gets work early and no one chunk nears the constant cap
+constexpr size_t streamBatchCode = 16 * 1024;
+constexpr size_t streamBatchConstants = 128;
 
 struct Parser {
 	Token current{ TokenType::Error, "", -1 };
@@ -50,19 +56,102 @@ struct ParseRule {
 struct Local {
 	Token name;
 	int depth;
+	bool isCaptured{ false };
+	// unique per declaration, unlike the slot index
+	size_t id{ 0 };
+};
+
+// what the compiler can prove about a value without running the code
+struct StaticType {
+	bool isNumber{ false };
+	// locals whose number proofs this one relies on
+	std::vector<size_t> dependsOn{};
+	// set when the expression compiled to a single push of this value
+	std::optional<Value> constant{};
+	// the pool entry that push added, which no earlier code refers to
+	std::optional<size_t> addedConstant{};
+};
+
+// a check-free numeric opcode, to be put back to its generic form if a local
+// it relies on later turns out not to always hold a number
+struct UncheckedSite {
+	size_t offset;
+	OpCode generic;
+	std::vector<size_t> dependsOn;
+};
+
+// bytecode taken out of the chunk to be emitted again further on, as loop rotation does
+struct CodeFragment {
+	std::vector<uint8_t> code{};
+	std::vector<int> lines{};
+	// offsets relative to the start of the fragment
+	std::vector<UncheckedSite> sites{};
+};
+
+struct Upvalue {
+	uint8_t index;
+	bool isLocal;
+};
+
+enum class FunctionType {
+	Function,
+	Initializer,
+	Method,
+	Script,
+};
+
+struct FunctionState {
+	std::shared_ptr<ObjFunction> function;
+	FunctionType type;
+	std::vector<Local> locals{};
+	std::vector<Upvalue> upvalues{};
+	int scopeDepth{ 0 };
+	// offset of the last opcode emitted, for rewriting it in place
+	size_t lastInstruction{ 0 };
+	// local id -> proof that every value stored in it is a number
+	std::unordered_map<size_t, StaticType> proofs{};
+	std::vector<UncheckedSite> uncheckedSites{};
+};
+
+// the rest of `for (var i = start; i < limit; i = i + step)` once `i` is declared
+struct NumericLoop {
+	ForCompare compare;
+	Token limit;
+	double step;
+};
+
+struct ClassState {
+	bool hasSuperclass{ false };
 };
 
 struct Compiler {
 	static ParseRule rule(TokenType type);
 
 	std::string_view source;
-	Scanner scanner{ source };
+	TokenBuffer tokens{ source };
 	Parser parser{};
-	Chunk currentChunk;
-	std::vector<Local> locals{};
-	int scopeDepth{ 0 };
-
-	std::optional<Chunk> compile();
+	// innermost function being compiled is at the back
+	std::vector<FunctionState> states{};
+	std::vector<ClassState> classes{};
+	size_t nextLocalId{ 0 };
+	// static type of the expression just compiled, and of an infix rule's left operand
+	StaticType exprType{};
+	StaticType leftType{};
+	// -O level; above 0 each finished chunk goes through optimizeChunk
+	int optimizationLevel{ 0 };
+	// set when every assignment to a global is in this source, so never-assigned ones can be inlined
+	bool wholeProgram{ false };
+	// values of the `const` globals declared so far
+	std::unordered_map<std::string, Value> constantGlobals{};
+
+	std::optional<std::shared_ptr<ObjFunction>> compile();
+
+	// streaming mode compiles the source as a series of script functions, each
+	// a run of whole top-level declarations that can execute before the next is parsed
+	void beginStream();
+	bool streamDone();
+	// nullopt once any error has been reported, though later batches still parse to report theirs
+	std::optional<std::shared_ptr<ObjFunction>> compileBatch();
 
 	private:
 	static std::unordered_map<TokenType, ParseRule> rules;
@@ -79,10 +168,19 @@ struct Compiler {
 	void emitOpCode(OpCode code);
 	void emitReturn();
 	void emitConstant(Value value);
+	void emitValue(Value value);
+	StaticType emitKnownValue(Value value);
+	void dropPush(const StaticType& operand);
+	bool foldConstant(TokenType operatorType, const StaticType& left, const StaticType& right);
+	void emitCache();
 
 	void consume(TokenType type, const std::string& message);
 
-	void endCompilation();
+	FunctionState& state();
+	Chunk& currentChunk();
+
+	void beginFunction(FunctionType type);
+	FunctionState endFunction();
 
 	uint8_t makeConstant(Value value);
 
@@ -93,13 +191,22 @@ struct Compiler {
 	void endScope();
 
 	void parsePrecedence(Precedence precedence);
+	static bool isTypedRule(ParseFn rule);
+
+	void emitNumberOp(OpCode generic, OpCode unchecked, const StaticType& left, const StaticType& right);
+	void assignProof(FunctionState& state, size_t id, const StaticType& type);
+	void invalidateProof(FunctionState& state, size_t id);
 
 	void expression();
 
 	size_t emitJump(OpCode code);
 	void patchJump(size_t jump);
 
-	void emitLoop(size_t start);
+	void emitLoop(OpCode code, size_t start);
+
+	CodeFragment copyCode(size_t start, size_t end);
+	CodeFragment cutCode(size_t start);
+	void emitCode(const CodeFragment& fragment);
 
 	void number(bool canAssign);
 	void string(bool canAssign);
@@ -107,15 +214,28 @@ struct Compiler {
 	void unary(bool canAssign);
 	void binary(bool canAssign);
 	void literal(bool canAssign);
+	void call(bool canAssign);
+	uint8_t argumentList();
+	void dot(bool canAssign);
+	void thisExpr(bool canAssign);
+	void superExpr(bool canAssign);
+	void array(bool canAssign);
+	void index(bool canAssign);
+	void map(bool canAssign);
+	void deleteExpr(bool canAssign);
+	void yieldExpr(bool canAssign);
+	void resumeExpr(bool canAssign);
 
 	void andExpr(bool canAssign);
 	void orExpr(bool canAssign);
 
 	void variable(bool canAssign);
-	void namedVariable(Token& name, bool canAssign);
+	void namedVariable(const Token& name, bool canAssign);
 	void declareVariable();
-	void addLocal(Token& name);
-	std::optional<size_t> resolveLocal(Token& name);
+	void addLocal(const Token& name);
+	std::optional<size_t> resolveLocal(FunctionState& state, const Token& name);
+	std::optional<size_t> resolveUpvalue(size_t depth, const Token& name);
+	size_t addUpvalue(FunctionState& state, uint8_t index, bool isLocal);
 
 	void printStatement();
 
@@ -124,6 +244,12 @@ struct Compiler {
 	void whileStatement();
 
 	void forStatement();
+	std::optional<NumericLoop> numericLoopHeader(const Token& variable);
+	void numericForLoop(const NumericLoop& loop);
+
+	void switchStatement();
+
+	void returnStatement();
 
 	void expressionStatement();
 	void block();
@@ -131,11 +257,18 @@ struct Compiler {
 	void statement();
 
 	void varDeclaration();
+	void constDeclaration();
 	uint8_t parseVariable(const std::string& message);
-	uint8_t identifierConstant(Token& name);
+	uint8_t identifierConstant(const Token& name);
 	void defineVariable(uint8_t global);
 	void markInitialized();
 
+	void function(FunctionType type);
+	void funDeclaration();
+
+	void method();
+	void classDeclaration();
+
 	void declaration();
 
 	void synchronize();
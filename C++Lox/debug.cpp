@@ -1,107 +1,348 @@
 #include "debug.h"
+#include "object.h"
 
-void disassembleChunk(Chunk& chunk, std::string name) {
-	std::cout << "== " << name << " ==" << std::endl;
+std::string opCodeName(OpCode code) {
+	switch (code) {
+		case OpCode::Constant:
+			return "constant";
+		case OpCode::Nil:
+			return "nil";
+		case OpCode::True:
+			return "true";
+		case OpCode::False:
+			return "false";
+		case OpCode::Not:
+			return "!";
+		case OpCode::Negate:
+			return "unary -";
+		case OpCode::Add:
+			return "+";
+		case OpCode::Subtract:
+			return "-";
+		case OpCode::Multiply:
+			return "*";
+		case OpCode::Divide:
+			return "/";
+		case OpCode::Equal:
+			return "==";
+		case OpCode::Greater:
+			return ">";
+		case OpCode::Less:
+			return "<";
+		case OpCode::Return:
+			return "return";
+		case OpCode::Drop:
+			return "drop";
+		case OpCode::Print:
+			return "print";
+		case OpCode::DefineGlobal:
+			return "define global";
+		case OpCode::DefineConstant:
+			return "define constant";
+		case OpCode::GetGlobal:
+			return "get global";
+		case OpCode::SetGlobal:
+			return "set global";
+		case OpCode::GetLocal:
+			return "get local";
+		case OpCode::SetLocal:
+			return "set local";
+		case OpCode::ConditionalJump:
+			return "jump if false";
+		case OpCode::Jump:
+			return "jump";
+		case OpCode::JumpBackIfTrue:
+			return "jump back if true";
+		case OpCode::JumpBack:
+			return "jump back";
+		case OpCode::Call:
+			return "call";
+		case OpCode::Closure:
+			return "closure";
+		case OpCode::GetUpvalue:
+			return "get upvalue";
+		case OpCode::SetUpvalue:
+			return "set upvalue";
+		case OpCode::CloseUpvalue:
+			return "close upvalue";
+		case OpCode::Class:
+			return "class";
+		case OpCode::Inherit:
+			return "inherit";
+		case OpCode::Method:
+			return "method";
+		case OpCode::GetProperty:
+			return "get property";
+		case OpCode::SetProperty:
+			return "set property";
+		case OpCode::Invoke:
+			return "invoke";
+		case OpCode::GetSuper:
+			return "get super";
+		case OpCode::SuperInvoke:
+			return "super invoke";
+		case OpCode::Array:
+			return "array";
+		case OpCode::GetIndex:
+			return "get index";
+		case OpCode::SetIndex:
+			return "set index";
+		case OpCode::Map:
+			return "map";
+		case OpCode::HasKey:
+			return "in";
+		case OpCode::DeleteKey:
+			return "delete";
+		case OpCode::TableSwitch:
+			return "table switch";
+		case OpCode::LookupSwitch:
+			return "lookup switch";
+		case OpCode::Yield:
+			return "yield";
+		case OpCode::Resume:
+			return "resume";
+		case OpCode::ForPrep:
+			return "for prep";
+		case OpCode::ForLoop:
+			return "for loop";
+		case OpCode::AddNumber:
+			return "+ (number)";
+		case OpCode::AddString:
+			return "+ (string)";
+		case OpCode::SubtractNumber:
+			return "- (number)";
+		case OpCode::MultiplyNumber:
+			return "* (number)";
+		case OpCode::DivideNumber:
+			return "/ (number)";
+		case OpCode::LessNumber:
+			return "< (number)";
+		case OpCode::GreaterNumber:
+			return "> (number)";
+		case OpCode::AddNumberUnchecked:
+			return "+ (unchecked)";
+		case OpCode::SubtractNumberUnchecked:
+			return "- (unchecked)";
+		case OpCode::MultiplyNumberUnchecked:
+			return "* (unchecked)";
+		case OpCode::DivideNumberUnchecked:
+			return "/ (unchecked)";
+		case OpCode::LessNumberUnchecked:
+			return "< (unchecked)";
+		case OpCode::GreaterNumberUnchecked:
+			return "> (unchecked)";
+		case OpCode::NegateNumberUnchecked:
+			return "unary - (unchecked)";
+		case OpCode::OPCODE_LEN:
+			break;
+	}
+	unreachable();
+	return "";
+}
+
+void disassembleChunk(Chunk& chunk, std::string name, std::ostream& out) {
+	out << "== " << name << " ==\n";
 	for (size_t index = 0; index < chunk.code.size();) {
-		index = disassembleInstruction(chunk, index);
+		index = disassembleInstruction(chunk, index, out);
 	}
+	out << std::flush;
 }
 
-static size_t simpleInstruction(std::string name, size_t index) {
-	std::cout << name << std::endl;
+// printf into a string, for the column layouts below
+static std::string format(const char* layout, ...) {
+	std::array<char, 128> buffer{};
+	va_list args;
+	va_start(args, layout);
+	vsnprintf(buffer.data(), buffer.size(), layout, args);
+	va_end(args);
+	return buffer.data();
+}
+
+static size_t simpleInstruction(const std::string& name, size_t index, std::ostream& out) {
+	out << name << "\n";
 	return index + 1;
 }
 
-static size_t constantInstruction(std::string name, Chunk& chunk, size_t index) {
+static size_t constantInstruction(const std::string& name, Chunk& chunk, size_t index, std::ostream& out) {
 	auto constant = chunk.code[index + 1];
-	printf("%-16s %4d '", name.c_str(), constant);
-	chunk.constants[constant].print();
-	std::cout << "'" << std::endl;
+	out << format("%-16s %4d '", name.c_str(), constant) << chunk.constants[constant].stringify() << "'\n";
 	return index + 2;
 }
 
-static size_t byteInstruction(std::string name, Chunk& chunk, size_t index) {
+static size_t byteInstruction(const std::string& name, Chunk& chunk, size_t index, std::ostream& out) {
 	auto slot = chunk.code[index + 1];
-	printf("%-16s %4d", name.c_str(), slot);
-	std::cout << std::endl;
+	out << format("%-16s %4d", name.c_str(), slot) << "\n";
 	return index + 2;
 }
 
-static size_t jumpInstruction(std::string name, bool backwards, Chunk& chunk, size_t index) {
+static size_t jumpInstruction(const std::string& name, bool backwards, Chunk& chunk, size_t index, std::ostream& out) {
 	auto jump = static_cast<size_t>(chunk.code[index + 1]) << 8;
 	jump |= chunk.code[index + 2];
-	printf("%-16s %4zd -> %zd", name.c_str(), index, index + 3 + (backwards ? -1 : 1) * jump);
-	std::cout << std::endl;
+	out << format("%-16s %4zd -> %zd", name.c_str(), index, index + 3 + (backwards ? -1 : 1) * jump) << "\n";
+	return index + 3;
+}
+
+static size_t closureInstruction(const std::string& name, Chunk& chunk, size_t index, std::ostream& out) {
+	auto constant = chunk.code[index + 1];
+	out << format("%-16s %4d '", name.c_str(), constant) << chunk.constants[constant].stringify() << "'\n";
+
+	auto function = std::static_pointer_cast<ObjFunction>(chunk.constants[constant].asObjUnsafe());
+	index += 2;
+	for (size_t i = 0; i < function->upvalueCount; i++) {
+		auto isLocal = chunk.code[index];
+		auto slot = chunk.code[index + 1];
+		out << format("%04d    |                     %s %d", int(index), isLocal ? "local" : "upvalue", slot) << "\n";
+		index += 2;
+	}
+	return index;
+}
+
+static size_t propertyInstruction(const std::string& name, bool hasArgs, bool hasCache, Chunk& chunk, size_t index, std::ostream& out) {
+	auto constant = chunk.code[index + 1];
+	out << format("%-16s %4d '", name.c_str(), constant) << chunk.constants[constant].stringify() << "'";
+	index += 2;
+
+	if (hasArgs) {
+		out << format(" (%d args)", chunk.code[index]);
+		index += 1;
+	}
+	if (hasCache) {
+		auto cache = static_cast<size_t>(chunk.code[index]) << 8 | chunk.code[index + 1];
+		out << format(" ic %zd", cache);
+		index += 2;
+	}
+	out << "\n";
+	return index;
+}
+
+static size_t switchInstruction(const std::string& name, Chunk& chunk, size_t index, std::ostream& out) {
+	auto table = static_cast<size_t>(chunk.code[index + 1]) << 8 | chunk.code[index + 2];
+	auto& cases = chunk.switches[table];
+	out << format("%-16s %4zd", name.c_str(), table);
+	for (auto target : cases.targets()) out << " " << *target;
+	out << "\n";
 	return index + 3;
 }
 
-size_t disassembleInstruction(Chunk& chunk, size_t index) {
-	printf("%04d ", int(index));
+static size_t forInstruction(const std::string& name, bool hasStep, Chunk& chunk, size_t index, std::ostream& out) {
+	static const std::array<const char*, 4> compares{ "<", "<=", ">", ">=" };
+	auto slot = chunk.code[index + 1];
+	auto kind = static_cast<ForLimit>(chunk.code[index + 2]);
+	auto limit = chunk.code[index + 3];
+	out << format("%-16s %4d %s ", name.c_str(), slot, compares[chunk.code[index + 4]]);
+	if (kind == ForLimit::Constant) {
+		out << chunk.constants[limit].stringify();
+	} else if (kind == ForLimit::Local) {
+		out << "local " << int(limit);
+	} else {
+		out << "global " << chunk.constants[limit].stringify();
+	}
+	if (hasStep) {
+		out << " step " << chunk.constants[chunk.code[index + 5]].stringify();
+	}
+	out << " -> " << jumpTarget(chunk, index) << "\n";
+	return index + instructionLength(chunk, index);
+}
+
+size_t disassembleInstruction(Chunk& chunk, size_t index, std::ostream& out) {
+	out << format("%04d ", int(index));
 
 	if (index > 0 && chunk.lines[index] == chunk.lines[index - 1]) {
-		std::cout << "   | ";
+		out << "   | ";
 	} else {
-		printf("%4d ", chunk.lines[index]);
+		out << format("%4d ", chunk.lines[index]);
 	}
 
 	auto instruction = chunk.code[index];
-	if (static_cast<uint8_t>(OpCode::OPCODE_LEN) <= instruction) {
+	if (!validOpCode(instruction)) {
 		fprintf(stderr, "Unknown opcode %x", instruction);
 		std::cerr << std::endl;
 		return index + 1;
-	} else {
-		switch (asOpCode(instruction)) {
-			case OpCode::Constant:
-				return constantInstruction("constant", chunk, index);
-			case OpCode::Nil:
-				return simpleInstruction("nil", index);
-			case OpCode::True:
-				return simpleInstruction("true", index);
-			case OpCode::False:
-				return simpleInstruction("false", index);
-			case OpCode::Not:
-				return simpleInstruction("!", index);
-			case OpCode::Negate:
-				return simpleInstruction("unary -", index);
-			case OpCode::Add:
-				return simpleInstruction("+", index);
-			case OpCode::Subtract:
-				return simpleInstruction("-", index);
-			case OpCode::Multiply:
-				return simpleInstruction("*", index);
-			case OpCode::Divide:
-				return simpleInstruction("/", index);
-			case OpCode::Equal:
-				return simpleInstruction("==", index);
-			case OpCode::Greater:
-				return simpleInstruction(">", index);
-			case OpCode::Less:
-				return simpleInstruction("<", index);
-			case OpCode::Return:
-				return simpleInstruction("return", index);
-			case OpCode::Drop:
-				return simpleInstruction("drop", index);
-			case OpCode::Print:
-				return simpleInstruction("print", index);
-			case OpCode::DefineGlobal:
-				return constantInstruction("define global", chunk, index);
-			case OpCode::GetGlobal:
-				return constantInstruction("get global", chunk, index);
-			case OpCode::SetGlobal:
-				return constantInstruction("set global", chunk, index);
-			case OpCode::GetLocal:
-				return byteInstruction("get local", chunk, index);
-			case OpCode::SetLocal:
-				return byteInstruction("set local", chunk, index);
-			case OpCode::ConditionalJump:
-				return jumpInstruction("jump if false", false, chunk, index);
-			case OpCode::Jump:
-				return jumpInstruction("jump", false, chunk, index);
-			case OpCode::JumpBack:
-				return jumpInstruction("jump back", true, chunk, index);
-			default:
-				unreachable();
-				return 0;
-		}
 	}
+
+	auto code = asOpCode(instruction);
+	auto name = opCodeName(code);
+	switch (code) {
+		case OpCode::Constant:
+		case OpCode::DefineGlobal:
+		case OpCode::DefineConstant:
+		case OpCode::GetGlobal:
+		case OpCode::SetGlobal:
+		case OpCode::Class:
+		case OpCode::Method:
+		case OpCode::GetSuper:
+			return constantInstruction(name, chunk, index, out);
+		case OpCode::Nil:
+		case OpCode::True:
+		case OpCode::False:
+		case OpCode::Not:
+		case OpCode::Negate:
+		case OpCode::Add:
+		case OpCode::Subtract:
+		case OpCode::Multiply:
+		case OpCode::Divide:
+		case OpCode::Equal:
+		case OpCode::Greater:
+		case OpCode::Less:
+		case OpCode::Return:
+		case OpCode::Drop:
+		case OpCode::Print:
+		case OpCode::CloseUpvalue:
+		case OpCode::Inherit:
+		case OpCode::GetIndex:
+		case OpCode::SetIndex:
+		case OpCode::HasKey:
+		case OpCode::DeleteKey:
+		case OpCode::Yield:
+		case OpCode::Resume:
+		case OpCode::AddNumber:
+		case OpCode::AddString:
+		case OpCode::SubtractNumber:
+		case OpCode::MultiplyNumber:
+		case OpCode::DivideNumber:
+		case OpCode::LessNumber:
+		case OpCode::GreaterNumber:
+		case OpCode::AddNumberUnchecked:
+		case OpCode::SubtractNumberUnchecked:
+		case OpCode::MultiplyNumberUnchecked:
+		case OpCode::DivideNumberUnchecked:
+		case OpCode::LessNumberUnchecked:
+		case OpCode::GreaterNumberUnchecked:
+		case OpCode::NegateNumberUnchecked:
+			return simpleInstruction(name, index, out);
+		case OpCode::GetLocal:
+		case OpCode::SetLocal:
+		case OpCode::Call:
+		case OpCode::GetUpvalue:
+		case OpCode::SetUpvalue:
+		case OpCode::Array:
+		case OpCode::Map:
+			return byteInstruction(name, chunk, index, out);
+		case OpCode::ConditionalJump:
+		case OpCode::Jump:
+			return jumpInstruction(name, false, chunk, index, out);
+		case OpCode::JumpBackIfTrue:
+		case OpCode::JumpBack:
+			return jumpInstruction(name, true, chunk, index, out);
+		case OpCode::Closure:
+			return closureInstruction(name, chunk, index, out);
+		case OpCode::GetProperty:
+		case OpCode::SetProperty:
+			return propertyInstruction(name, false, true, chunk, index, out);
+		case OpCode::Invoke:
+			return propertyInstruction(name, true, true, chunk, index, out);
+		case OpCode::SuperInvoke:
+			return propertyInstruction(name, true, false, chunk, index, out);
+		case OpCode::TableSwitch:
+		case OpCode::LookupSwitch:
+			return switchInstruction(name, chunk, index, out);
+		case OpCode::ForPrep:
+			return forInstruction(name, false, chunk, index, out);
+		case OpCode::ForLoop:
+			return forInstruction(name, true, chunk, index, out);
+		case OpCode::OPCODE_LEN:
+			break;
+	}
+	unreachable();
+	return 0;
 }
\ No newline at end of file
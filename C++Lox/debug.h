@@ -2,5 +2,8 @@
 
 #include "chunk.h"
 
-void disassembleChunk(Chunk& chunk, std::string name);
-size_t disassembleInstruction(Chunk& chunk, size_t index);
\ No newline at end of file
+// the name the disassembler prints for an opcode
+std::string opCodeName(OpCode code);
+
+void disassembleChunk(Chunk& chunk, std::string name, std::ostream& out);
+size_t disassembleInstruction(Chunk& chunk, size_t index, std::ostream& out);
\ No newline at end of file
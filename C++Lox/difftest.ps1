@@ -0,0 +1,50 @@
+# runs every script at -O0 and at each optimization level and reports any
+# difference in output or exit code; the optimizer must never change either
+#
+#   .\difftest.ps1 -Lox ..\x64\Release\C++Lox.exe [file.lox ...]
+#
+# with no files, every .lox next to this script is run; scripts that read clock()
+# print timings that differ from run to run, so they are skipped
+param(
+	[Parameter(Mandatory = $true)][string]$Lox,
+	[int[]]$Levels = @(1),
+	[Parameter(ValueFromRemainingArguments = $true)][string[]]$Files
+)
+
+if (-not $Files) {
+	$Files = Get-ChildItem -Path $PSScriptRoot -Filter *.lox |
+		Where-Object { -not (Select-String -Path $_.FullName -Pattern 'clock\(' -Quiet) } |
+		ForEach-Object { $_.FullName }
+}
+
+# stdout, stderr and the exit code of one run, as a single string to compare
+function Invoke-Lox([string]$file, [int]$level) {
+	$info = New-Object System.Diagnostics.ProcessStartInfo $Lox
+	$info.Arguments = "-O$level `"$file`""
+	$info.UseShellExecute = $false
+	$info.RedirectStandardOutput = $true
+	$info.RedirectStandardError = $true
+	$process = [System.Diagnostics.Process]::Start($info)
+	# stderr is drained alongside stdout so neither pipe can fill up and stall the run
+	$errors = $process.StandardError.ReadToEndAsync()
+	$output = $process.StandardOutput.ReadToEnd()
+	$process.WaitForExit()
+	"$output$($errors.Result)exit $($process.ExitCode)"
+}
+
+$failed = 0
+foreach ($file in $Files) {
+	$expected = Invoke-Lox $file 0
+	foreach ($level in $Levels) {
+		$actual = Invoke-Lox $file $level
+		if ($actual -ceq $expected) { continue }
+		$failed++
+		Write-Host "DIFF $file -O$level"
+		Compare-Object ($expected -split "`r?`n") ($actual -split "`r?`n") -SyncWindow 0 |
+			Select-Object -First 10 |
+			ForEach-Object { Write-Host "  $($_.SideIndicator) $($_.InputObject)" }
+	}
+}
+
+Write-Host "$($Files.Count) scripts, $failed differences"
+exit [int]($failed -ne 0)
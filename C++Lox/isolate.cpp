@@ -0,0 +1,463 @@
+#include "isolate.h"
+#include "object.h"
+
+// `enclosing` holds the maps being copied around this value, so one that contains itself is caught
+static std::optional<Message> toMessage(VM& vm, Value value, bool transfer, std::vector<ObjMap*>& enclosing) {
+	Message message{};
+	switch (value.type) {
+		case ValueType::Nil:
+			return message;
+		case ValueType::Bool:
+			message.kind = Message::Kind::Bool;
+			message.boolean = value.asBoolUnsafe();
+			return message;
+		case ValueType::Number:
+			message.kind = Message::Kind::Number;
+			message.number = value.asNumberUnsafe();
+			return message;
+		case ValueType::Obj:
+			break;
+	}
+
+	auto obj = value.asObjRawUnsafe();
+	switch (obj->type) {
+		case ObjType::String:
+			message.kind = Message::Kind::String;
+			message.text = static_cast<ObjString*>(obj)->str;
+			return message;
+		case ObjType::Array:
+		{
+			message.kind = Message::Kind::Array;
+			auto& values = static_cast<ObjArray*>(obj)->values;
+			message.values = transfer ? std::move(values) : values;
+			if (transfer) values.clear();
+			return message;
+		}
+		case ObjType::Map:
+		{
+			auto map = static_cast<ObjMap*>(obj);
+			if (std::find(enclosing.begin(), enclosing.end(), map) != enclosing.end()) {
+				vm.runtimeError("Can't send a cyclic value to another isolate.");
+				return std::nullopt;
+			}
+			message.kind = Message::Kind::Map;
+			enclosing.push_back(map);
+			for (auto& entry : map->entries) {
+				if (entry.key.isNil()) continue;
+				auto key = toMessage(vm, entry.key, false, enclosing);
+				auto item = toMessage(vm, entry.value, false, enclosing);
+				if (!key || !item) return std::nullopt;
+				message.entries.push_back(std::move(key.value()));
+				message.entries.push_back(std::move(item.value()));
+			}
+			enclosing.pop_back();
+			return message;
+		}
+		case ObjType::Channel:
+			message.kind = Message::Kind::Channel;
+			message.channel = static_cast<ObjChannel*>(obj)->channel;
+			return message;
+		default:
+			vm.runtimeError("Can't send a %s to another isolate.", objTypeName(obj->type));
+			return std::nullopt;
+	}
+}
+
+std::optional<Message> toMessage(VM& vm, Value value, bool transfer) {
+	std::vector<ObjMap*> enclosing{};
+	return toMessage(vm, value, transfer, enclosing);
+}
+
+std::optional<Value> fromMessage(VM& vm, Message& message) {
+	switch (message.kind) {
+		case Message::Kind::Nil:
+			return Value{};
+		case Message::Kind::Bool:
+			return Value{ message.boolean };
+		case Message::Kind::Number:
+			return Value{ message.number };
+		case Message::Kind::String:
+		{
+			auto string = vm.string(std::move(message.text));
+			if (!string) return std::nullopt;
+			return Value{ string };
+		}
+		case Message::Kind::Array:
+		{
+			auto array = vm.allocate<ObjArray>(ObjType::Array, message.values.size() * sizeof(double), std::move(message.values));
+			if (!array) return std::nullopt;
+			return Value{ array };
+		}
+		case Message::Kind::Map:
+		{
+			auto map = vm.allocate<ObjMap>(ObjType::Map, 0);
+			if (!map) return std::nullopt;
+			for (size_t i = 0; i < message.entries.size(); i += 2) {
+				auto key = fromMessage(vm, message.entries[i]);
+				if (!key) return std::nullopt;
+				auto value = fromMessage(vm, message.entries[i + 1]);
+				if (!value) return std::nullopt;
+				map->set(key.value(), value.value());
+			}
+			if (!vm.charge(ObjType::Map, map->entries.capacity() * sizeof(MapEntry))) return std::nullopt;
+			return Value{ map };
+		}
+		case Message::Kind::Channel:
+		{
+			auto channel = vm.allocate<ObjChannel>(ObjType::Channel, 0, message.channel);
+			if (!channel) return std::nullopt;
+			return Value{ channel };
+		}
+	}
+	unreachable();
+	return std::nullopt;
+}
+
+Channel::Channel(size_t capacity) {
+	auto size = std::bit_ceil(std::max<size_t>(capacity, 2));
+	cells = std::make_unique<Cell[]>(size);
+	mask = size - 1;
+	for (size_t i = 0; i < size; i++) cells[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+// a cell is free for the sender at position p when its sequence is p, and
+// holds a message for the receiver at p when it is p + 1
+bool Channel::trySend(Message& message) {
+	auto position = sendPosition.load(std::memory_order_relaxed);
+	while (true) {
+		auto& cell = cells[position & mask];
+		auto lag = static_cast<intptr_t>(cell.sequence.load(std::memory_order_acquire) - position);
+		if (lag < 0) return false;
+		if (lag > 0) {
+			position = sendPosition.load(std::memory_order_relaxed);
+		} else if (sendPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+			cell.message = std::move(message);
+			cell.sequence.store(position + 1, std::memory_order_release);
+			break;
+		}
+	}
+
+	// pairs with the fence in IsolatePool::runSlice, so that either this sees the
+	// parked isolate or the isolate sees the message
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (parkedCount.load(std::memory_order_relaxed) > 0) wakeParked();
+	return true;
+}
+
+std::optional<Message> Channel::tryReceive() {
+	auto position = receivePosition.load(std::memory_order_relaxed);
+	std::optional<Message> message{};
+	while (true) {
+		auto& cell = cells[position & mask];
+		auto lag = static_cast<intptr_t>(cell.sequence.load(std::memory_order_acquire) - (position + 1));
+		if (lag < 0) return std::nullopt;
+		if (lag > 0) {
+			position = receivePosition.load(std::memory_order_relaxed);
+		} else if (receivePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+			message = std::move(cell.message);
+			cell.message = Message{};
+			cell.sequence.store(position + mask + 1, std::memory_order_release);
+			break;
+		}
+	}
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (parkedCount.load(std::memory_order_relaxed) > 0) wakeParked();
+	return message;
+}
+
+bool Channel::canSend() {
+	auto position = sendPosition.load(std::memory_order_relaxed);
+	return static_cast<intptr_t>(cells[position & mask].sequence.load(std::memory_order_acquire) - position) >= 0;
+}
+
+bool Channel::canReceive() {
+	auto position = receivePosition.load(std::memory_order_relaxed);
+	return static_cast<intptr_t>(cells[position & mask].sequence.load(std::memory_order_acquire) - (position + 1)) >= 0;
+}
+
+void Channel::park(Isolate* isolate) {
+	std::lock_guard lock{ parkedMutex };
+	parked.push_back(isolate);
+	parkedCount.store(parked.size());
+}
+
+void Channel::wakeParked() {
+	std::vector<Isolate*> woken{};
+	{
+		std::lock_guard lock{ parkedMutex };
+		woken.swap(parked);
+		parkedCount.store(0);
+	}
+	for (auto isolate : woken) isolatePool().wake(isolate);
+}
+
+// the worker a pool thread runs as, so that it requeues onto its own queue
+static thread_local std::optional<size_t> currentWorker{};
+
+IsolatePool::IsolatePool(size_t threadCount) {
+	for (size_t i = 0; i < threadCount; i++) workers.push_back(std::make_unique<Worker>());
+	for (size_t i = 0; i < threadCount; i++) threads.emplace_back([this, i] { work(i); });
+}
+
+IsolatePool::~IsolatePool() {
+	{
+		std::lock_guard lock{ idleMutex };
+		stopping = true;
+	}
+	idle.notify_all();
+	for (auto& thread : threads) thread.join();
+}
+
+void IsolatePool::start(std::unique_ptr<Isolate> isolate) {
+	auto running = isolate.get();
+	{
+		std::lock_guard lock{ isolatesMutex };
+		isolates.push_back(std::move(isolate));
+	}
+	activeCount++;
+	push(running);
+}
+
+void IsolatePool::wake(Isolate* isolate) {
+	auto parked = IsolateState::Parked;
+	if (!isolate->state.compare_exchange_strong(parked, IsolateState::Queued)) return;
+	activeCount++;
+	push(isolate);
+}
+
+void IsolatePool::drain() {
+	std::unique_lock lock{ idleMutex };
+	drained.wait(lock, [this] { return activeCount == 0; });
+}
+
+size_t IsolatePool::active() {
+	return activeCount;
+}
+
+void IsolatePool::push(Isolate* isolate) {
+	auto index = currentWorker.value_or(nextWorker++ % workers.size());
+	{
+		std::lock_guard lock{ workers[index]->mutex };
+		workers[index]->queue.push_back(isolate);
+	}
+	queuedCount++;
+	// taking the lock orders this with a worker deciding to sleep
+	{ std::lock_guard lock{ idleMutex }; }
+	idle.notify_one();
+}
+
+Isolate* IsolatePool::take(size_t worker) {
+	for (size_t i = 0; i < workers.size(); i++) {
+		auto& victim = *workers[(worker + i) % workers.size()];
+		std::lock_guard lock{ victim.mutex };
+		if (victim.queue.empty()) continue;
+
+		Isolate* isolate{};
+		if (i == 0) {
+			isolate = victim.queue.front();
+			victim.queue.pop_front();
+		} else {
+			isolate = victim.queue.back();
+			victim.queue.pop_back();
+		}
+		queuedCount--;
+		return isolate;
+	}
+	return nullptr;
+}
+
+void IsolatePool::runSlice(Isolate& isolate) {
+	isolate.state = IsolateState::Running;
+	auto result = isolate.started ? isolate.vm.resume() : isolate.vm.interpret(isolate.source);
+	isolate.started = true;
+
+	switch (result) {
+		case InterpretResult::Suspended:
+			isolate.state = IsolateState::Queued;
+			push(&isolate);
+			return;
+		case InterpretResult::Blocked:
+		{
+			// once parked, another worker may pick the isolate up at any moment
+			auto channel = std::exchange(isolate.waitingOn, nullptr);
+			auto sending = isolate.waitingToSend;
+			isolate.state = IsolateState::Parked;
+			channel->park(&isolate);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (sending ? channel->canSend() : channel->canReceive()) wake(&isolate);
+			finish();
+			return;
+		}
+		default:
+			isolate.state = IsolateState::Done;
+			isolate.vm.free();
+			finish();
+			return;
+	}
+}
+
+void IsolatePool::finish() {
+	if (activeCount.fetch_sub(1) != 1) return;
+	{ std::lock_guard lock{ idleMutex }; }
+	drained.notify_all();
+}
+
+void IsolatePool::work(size_t worker) {
+	currentWorker = worker;
+	while (true) {
+		if (auto isolate = take(worker)) {
+			runSlice(*isolate);
+			continue;
+		}
+
+		std::unique_lock lock{ idleMutex };
+		idle.wait(lock, [this] { return queuedCount > 0 || stopping; });
+		if (stopping) return;
+	}
+}
+
+static size_t isolateThreads = 0;
+static std::once_flag poolStart{};
+static std::unique_ptr<IsolatePool> pool{};
+static std::atomic<bool> poolStarted{ false };
+
+IsolatePool& isolatePool() {
+	std::call_once(poolStart, [] {
+		auto threads = isolateThreads ? isolateThreads : std::max(1u, std::thread::hardware_concurrency());
+		pool = std::make_unique<IsolatePool>(threads);
+		poolStarted = true;
+	});
+	return *pool;
+}
+
+bool isolatePoolStarted() {
+	return poolStarted;
+}
+
+void setIsolateThreads(size_t threads) {
+	isolateThreads = threads;
+}
+
+static std::shared_ptr<Channel> channelArg(VM& vm, Value value, const std::string& native) {
+	if (value.isObj() && value.asObjRawUnsafe()->type == ObjType::Channel) {
+		return static_cast<ObjChannel*>(value.asObjRawUnsafe())->channel;
+	}
+	vm.runtimeError("%s expects a channel.", native.c_str());
+	return nullptr;
+}
+
+// true once the channel may be ready again. an isolate can't wait on its worker's
+// thread, so it blocks instead and the pool parks it; anything else waits in
+// place, as long as some isolate is still around to make progress
+static bool waitUntilReady(VM& vm, const std::shared_ptr<Channel>& channel, bool sending) {
+	if (vm.isolate) {
+		vm.isolate->waitingOn = channel;
+		vm.isolate->waitingToSend = sending;
+		vm.block();
+		return false;
+	}
+
+	auto ready = [&] { return sending ? channel->canSend() : channel->canReceive(); };
+	for (size_t spins = 0; !ready(); spins++) {
+		// an isolate's last message is sent before it stops counting as active
+		if ((!isolatePoolStarted() || isolatePool().active() == 0) && !ready()) {
+			vm.runtimeError(sending ? "send would wait forever on a full channel." : "receive would wait forever on an empty channel.");
+			return false;
+		}
+		if (spins < 64) {
+			std::this_thread::yield();
+		} else {
+			std::this_thread::sleep_for(100us);
+		}
+	}
+	return true;
+}
+
+static std::optional<Value> sendValue(VM& vm, std::span<Value> args, bool transfer, const std::string& native) {
+	auto channel = channelArg(vm, args[0], native);
+	if (!channel) return std::nullopt;
+	if (transfer && (!args[1].isObj() || !args[1].asObjRawUnsafe()->isArray())) {
+		vm.runtimeError("transfer expects an array.");
+		return std::nullopt;
+	}
+
+	while (true) {
+		auto message = toMessage(vm, args[1], transfer);
+		if (!message) return std::nullopt;
+		if (channel->trySend(message.value())) return Value{};
+		// a transfer that didn't happen leaves the array as it was
+		if (transfer) static_cast<ObjArray*>(args[1].asObjRawUnsafe())->values = std::move(message->values);
+		if (!waitUntilReady(vm, channel, true)) return std::nullopt;
+	}
+}
+
+void defineIsolateNatives(VM& vm) {
+	// holds up to `capacity` messages; sends to a full channel wait
+	vm.defineNative("channel", 1, [] (VM& vm, std::span<Value> args) -> std::optional<Value> {
+		auto capacity = args[0].asNumber();
+		if (!capacity || capacity.value() < 1 || capacity.value() > 1 << 24 || capacity.value() != std::floor(capacity.value())) {
+			vm.runtimeError("channel expects a whole number capacity from 1 to 16777216.");
+			return std::nullopt;
+		}
+		auto cells = std::bit_ceil(std::max<size_t>(static_cast<size_t>(capacity.value()), 2));
+		auto channel = vm.allocate<ObjChannel>(ObjType::Channel, cells * sizeof(Message), std::make_shared<Channel>(cells));
+		if (!channel) return std::nullopt;
+		return Value{ channel };
+	});
+
+	// copies the value into the channel
+	vm.defineNative("send", 2, [] (VM& vm, std::span<Value> args) -> std::optional<Value> {
+		return sendValue(vm, args, false, "send");
+	});
+
+	// moves an array's numbers into the channel, leaving the array empty
+	vm.defineNative("transfer", 2, [] (VM& vm, std::span<Value> args) -> std::optional<Value> {
+		return sendValue(vm, args, true, "transfer");
+	});
+
+	vm.defineNative("receive", 1, [] (VM& vm, std::span<Value> args) -> std::optional<Value> {
+		auto channel = channelArg(vm, args[0], "receive");
+		if (!channel) return std::nullopt;
+
+		while (true) {
+			if (auto message = channel->tryReceive()) return fromMessage(vm, message.value());
+			if (!waitUntilReady(vm, channel, false)) return std::nullopt;
+		}
+	});
+
+	// runs the script at path in a new isolate, with a copy of argument as its global isolateArg
+	vm.defineNative("isolate", 2, [] (VM& vm, std::span<Value> args) -> std::optional<Value> {
+		if (!args[0].isObj() || !args[0].asObjRawUnsafe()->isString()) {
+			vm.runtimeError("isolate expects a file path.");
+			return std::nullopt;
+		}
+		auto& path = static_cast<ObjString*>(args[0].asObjRawUnsafe())->str;
+		std::ifstream file{ path };
+		if (!file.is_open()) {
+			vm.runtimeError("isolate could not open file %s.", path.c_str());
+			return std::nullopt;
+		}
+		auto message = toMessage(vm, args[1], false);
+		if (!message) return std::nullopt;
+
+		auto isolate = std::make_unique<Isolate>(std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()));
+		auto& child = isolate->vm;
+		child.isolate = isolate.get();
+		child.optimizationLevel = vm.optimizationLevel;
+		child.wholeProgram = true;
+		child.heapLimit = vm.heapLimit;
+		child.budget = Budget{ isolateSlice, std::nullopt, true };
+
+		auto argument = fromMessage(child, message.value());
+		auto name = child.string("isolateArg");
+		if (!argument || !name) {
+			vm.runtimeError("isolate's heap can't hold its argument.");
+			return std::nullopt;
+		}
+		child.globals[name] = argument.value();
+
+		isolatePool().start(std::move(isolate));
+		return Value{};
+	});
+}
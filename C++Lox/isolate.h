@@ -0,0 +1,141 @@
+#pragma once
+
+#include "common.h"
+#include "value.h"
+#include "vm.h"
+
+struct Channel;
+
+// a value copied out of one VM's heap, so that another VM can rebuild it in its
+// own; channels are the one thing shared rather than copied
+struct Message {
+	enum class Kind { Nil, Bool, Number, String, Array, Map, Channel };
+
+	Kind kind{ Kind::Nil };
+	bool boolean{ false };
+	double number{ 0 };
+	std::string text{};
+	std::vector<double> values{};
+	// keys and values alternating
+	std::vector<Message> entries{};
+	std::shared_ptr<Channel> channel{};
+};
+
+// null after reporting a runtime error for a value that can't leave its VM;
+// `transfer` moves an array's numbers out instead of copying them
+std::optional<Message> toMessage(VM& vm, Value value, bool transfer);
+// null after reporting a runtime error when the heap can't hold the copy
+std::optional<Value> fromMessage(VM& vm, Message& message);
+
+struct Isolate;
+
+// bounded multi-producer multi-consumer queue: each cell's sequence number says
+// whose turn it is, so senders and receivers only ever contend on one atomic
+struct Channel {
+	explicit Channel(size_t capacity);
+
+	Channel(const Channel&) = delete;
+	Channel& operator=(const Channel&) = delete;
+
+	// moves from message only when it was queued
+	bool trySend(Message& message);
+	std::optional<Message> tryReceive();
+
+	bool canSend();
+	bool canReceive();
+
+	// isolates parked until the channel changes; woken all at once, since a
+	// wakeup that finds nothing to do just parks again
+	void park(Isolate* isolate);
+	void wakeParked();
+
+	private:
+	struct Cell {
+		std::atomic<size_t> sequence{ 0 };
+		Message message{};
+	};
+
+	std::unique_ptr<Cell[]> cells;
+	size_t mask;
+	alignas(64) std::atomic<size_t> sendPosition{ 0 };
+	alignas(64) std::atomic<size_t> receivePosition{ 0 };
+
+	std::mutex parkedMutex{};
+	std::vector<Isolate*> parked{};
+	std::atomic<size_t> parkedCount{ 0 };
+};
+
+enum class IsolateState {
+	Queued,
+	Running,
+	// waiting on a channel, in no run queue
+	Parked,
+	Done,
+};
+
+// a script running in its own VM, so it shares no strings, objects or globals
+// with any other; it only talks to the rest of the process through channels
+struct Isolate {
+	VM vm{};
+	std::string source;
+	bool started{ false };
+	std::atomic<IsolateState> state{ IsolateState::Queued };
+	// what the last Blocked result was waiting for
+	std::shared_ptr<Channel> waitingOn{};
+	bool waitingToSend{ false };
+
+	Isolate(std::string s) : source{ std::move(s) } {}
+};
+
+// steps an isolate runs before it goes to the back of its worker's queue
+constexpr uint64_t isolateSlice = 10000;
+
+// runs isolates on a fixed set of threads in budget slices. each worker takes
+// from the front of its own queue and, when that is empty, steals from the
+// back of another's, so a worker that spawns many isolates shares them out
+struct IsolatePool {
+	explicit IsolatePool(size_t threads);
+	~IsolatePool();
+
+	void start(std::unique_ptr<Isolate> isolate);
+	// queues a parked isolate again, unless something else already has
+	void wake(Isolate* isolate);
+	// returns once no isolate is queued or running; any still parked then
+	// wait on channels nothing will ever use again
+	void drain();
+	// isolates queued or running
+	size_t active();
+
+	private:
+	struct Worker {
+		std::mutex mutex{};
+		std::deque<Isolate*> queue{};
+	};
+
+	std::vector<std::unique_ptr<Worker>> workers{};
+	std::vector<std::thread> threads{};
+	std::mutex isolatesMutex{};
+	std::vector<std::unique_ptr<Isolate>> isolates{};
+
+	std::atomic<size_t> activeCount{ 0 };
+	std::atomic<size_t> queuedCount{ 0 };
+	std::atomic<size_t> nextWorker{ 0 };
+	std::atomic<bool> stopping{ false };
+	std::mutex idleMutex{};
+	std::condition_variable idle{};
+	std::condition_variable drained{};
+
+	void push(Isolate* isolate);
+	Isolate* take(size_t worker);
+	void runSlice(Isolate& isolate);
+	void finish();
+	void work(size_t worker);
+};
+
+// the process-wide pool, started on first use
+IsolatePool& isolatePool();
+bool isolatePoolStarted();
+// worker threads for the pool; 0 means one per core. only takes effect before the pool starts
+void setIsolateThreads(size_t threads);
+
+void defineIsolateNatives(VM& vm);
\ No newline at end of file
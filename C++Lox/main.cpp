@@ -3,28 +3,230 @@
 #include "chunk.h"
 #include "debug.h"
 #include "vm.h"
+#include "optimizer.h"
+#include "isolate.h"
+#include "recorder.h"
+#include "perf.h"
 
-static void repl();
-static void runFile(std::string path);
+struct Options {
+	int optimizationLevel{ 0 };
+	// compile on a second thread and run each batch of statements as soon as it is ready
+	bool stream{ false };
+	Budget budget{};
+	std::optional<size_t> heapLimit{};
+	// threads running isolates; 0 means one per core
+	size_t isolateThreads{ 0 };
+	// report what the VM compiled, allocated and ran on stderr at exit
+	bool stats{ false };
+	// skip the load-time verifier and check each instruction as it runs
+	bool verify{ true };
+	// print instructions as they run, to stderr
+	std::optional<TraceFilter> trace{};
+	// record instructions into a ring and save it here at exit
+	std::optional<std::string> recordPath{};
+	size_t recordBytes{ recorderDefaultBytes };
+	// print what a recorded trace of the script shows instead of running it
+	std::optional<std::string> reportPath{};
+	// count hardware events around compiling and running, for the stats report
+	bool perfCounters{ false };
+};
+
+static void repl(const Options& options);
+static void runFile(std::string path, const Options& options);
+
+// -O alone means -O1
+static std::optional<int> parseOptimizationLevel(const std::string& arg) {
+	if (arg == "-O") return 1;
+	if (arg.size() != 3 || !arg.starts_with("-O") || !isDigit(arg[2])) return std::nullopt;
+	auto level = arg[2] - '0';
+	if (level > maxOptimizationLevel) return std::nullopt;
+	return level;
+}
+
+// the N of `--name=N`
+static std::optional<uint64_t> parseCount(const std::string& arg, const std::string& name) {
+	auto prefix = name + "=";
+	if (!arg.starts_with(prefix) || arg.size() == prefix.size()) return std::nullopt;
+	auto digits = arg.substr(prefix.size());
+	if (!std::all_of(digits.begin(), digits.end(), isDigit)) return std::nullopt;
+	return read_cast<uint64_t>(digits);
+}
+
+// the TEXT of `--name=TEXT`
+static std::optional<std::string> parseText(const std::string& arg, const std::string& name) {
+	auto prefix = name + "=";
+	if (!arg.starts_with(prefix) || arg.size() == prefix.size()) return std::nullopt;
+	return arg.substr(prefix.size());
+}
+
+// --trace-lines=N or --trace-lines=FIRST-LAST
+static std::optional<std::pair<int, int>> parseTraceLines(const std::string& arg) {
+	const auto prefix = "--trace-lines="s;
+	if (!arg.starts_with(prefix)) return std::nullopt;
+	auto range = arg.substr(prefix.size());
+	auto dash = range.find('-');
+	auto first = range.substr(0, dash);
+	auto last = dash == std::string::npos ? first : range.substr(dash + 1);
+	for (auto& number : { first, last }) {
+		if (number.empty() || !std::all_of(number.begin(), number.end(), isDigit)) return std::nullopt;
+	}
+	return std::pair{ read_cast<int>(first), read_cast<int>(last) };
+}
+
+// --trace-ops=NAME,NAME,... with the disassembler's names, `_` standing for a space.
+// a generic name also takes in the quickened and unchecked forms written over it
+static std::optional<std::vector<bool>> parseTraceOps(const std::string& arg) {
+	const auto prefix = "--trace-ops="s;
+	if (!arg.starts_with(prefix) || arg.size() == prefix.size()) return std::nullopt;
+	auto names = arg.substr(prefix.size());
+	std::replace(names.begin(), names.end(), '_', ' ');
+
+	std::vector<bool> opcodes(asByte(OpCode::OPCODE_LEN));
+	std::stringstream stream{ names };
+	for (std::string name; std::getline(stream, name, ',');) {
+		auto found = false;
+		for (uint8_t byte = 0; validOpCode(byte); byte++) {
+			auto code = asOpCode(byte);
+			if (opCodeName(code) != name && opCodeName(genericOpCode(code)) != name) continue;
+			opcodes[byte] = true;
+			found = true;
+		}
+		if (!found) return std::nullopt;
+	}
+	return opcodes;
+}
+
+static bool parseOption(const std::string& arg, Options& options) {
+	if (arg == "--stream") {
+		options.stream = true;
+		return true;
+	}
+	if (arg == "--stats") {
+		options.stats = true;
+		return true;
+	}
+	// --perf-counters implies --stats, where they are reported
+	if (arg == "--perf-counters") {
+		options.perfCounters = true;
+		options.stats = true;
+		return true;
+	}
+	if (arg == "--no-verify") {
+		options.verify = false;
+		return true;
+	}
+	// the filters imply --trace
+	if (arg == "--trace") {
+		if (!options.trace) options.trace = TraceFilter{};
+		return true;
+	}
+	if (auto lines = parseTraceLines(arg)) {
+		if (!options.trace) options.trace = TraceFilter{};
+		options.trace->lines = lines;
+		return true;
+	}
+	if (auto opcodes = parseTraceOps(arg)) {
+		if (!options.trace) options.trace = TraceFilter{};
+		options.trace->opcodes = opcodes.value();
+		return true;
+	}
+	if (auto steps = parseCount(arg, "--max-steps")) {
+		options.budget.steps = steps;
+		return true;
+	}
+	if (auto milliseconds = parseCount(arg, "--time-limit")) {
+		options.budget.time = std::chrono::milliseconds{ milliseconds.value() };
+		return true;
+	}
+	if (auto megabytes = parseCount(arg, "--max-heap")) {
+		options.heapLimit = megabytes.value() * 1024 * 1024;
+		return true;
+	}
+	if (auto threads = parseCount(arg, "--threads")) {
+		options.isolateThreads = threads.value();
+		return true;
+	}
+	if (auto path = parseText(arg, "--record-trace")) {
+		options.recordPath = path;
+		return true;
+	}
+	if (auto megabytes = parseCount(arg, "--record-size")) {
+		options.recordBytes = megabytes.value() * 1024 * 1024;
+		return true;
+	}
+	if (auto path = parseText(arg, "--trace-report")) {
+		options.reportPath = path;
+		return true;
+	}
+
+	auto level = parseOptimizationLevel(arg);
+	if (!level) return false;
+	options.optimizationLevel = level.value();
+	return true;
+}
 
 int main(int argc, const char* argv[]) {
 	auto args = parseArgs(argc, argv);
 
-	if (args.empty()) {
-		repl();
+	Options options{};
+	std::vector<std::string> paths{};
+	for (auto& arg : args) {
+		if (!arg.starts_with("-")) {
+			paths.push_back(arg);
+		} else if (!parseOption(arg, options)) {
+			std::cerr << "Unknown option " << arg << std::endl;
+			exit(64);
+		}
 	}
-	else if (args.size() == 1) {
-		runFile(args[0]);
+
+	setIsolateThreads(options.isolateThreads);
+
+	if ((options.recordPath || options.reportPath) && paths.size() != 1) {
+		std::cerr << "Recording a trace and reporting on one both need a script." << std::endl;
+		exit(64);
+	}
+	if (options.recordPath && (options.stream || options.trace)) {
+		std::cerr << "--record-trace can't be used with --stream or --trace." << std::endl;
+		exit(64);
+	}
+
+	if (paths.empty()) {
+		repl(options);
+	}
+	else if (paths.size() == 1) {
+		runFile(paths[0], options);
 	}
 	else {
-		std::cerr << "Usage: clox (runs REPL) or clox [filepath]" << std::endl;
+		std::cerr << "Usage: clox [options] (runs REPL) or clox [options] [filepath]" << std::endl;
+		std::cerr << "Options: -O0|-O1, --stream, --max-steps=N, --time-limit=MS, --max-heap=MB, --threads=N, --stats, --no-verify," << std::endl;
+		std::cerr << "         --trace, --trace-lines=N[-M], --trace-ops=NAME[,NAME...]," << std::endl;
+		std::cerr << "         --record-trace=FILE, --record-size=MB, --trace-report=FILE, --perf-counters" << std::endl;
+		std::cerr << "         --trace-ops takes the disassembler's names with _ for a space, and a generic one such as +" << std::endl;
+		std::cerr << "         also matches its quickened and unchecked forms, such as + (number) and + (string)" << std::endl;
 	}
 
 	return 0;
 }
 
-static void repl() {
+// null without --perf-counters, or after saying none could be opened
+static std::unique_ptr<PerfCounters> openPerfCounters(const Options& options) {
+	if (!options.perfCounters) return nullptr;
+	auto counters = std::make_unique<PerfCounters>();
+	if (counters->anyOpen()) return counters;
+	std::cerr << "No hardware performance counters could be opened here." << std::endl;
+	return nullptr;
+}
+
+static void repl(const Options& options) {
 	VM vm{};
+	vm.optimizationLevel = options.optimizationLevel;
+	vm.budget = options.budget;
+	vm.heapLimit = options.heapLimit;
+	vm.collectStats = options.stats;
+	vm.verifyBytecode = options.verify;
+	vm.trace = options.trace;
+	auto counters = openPerfCounters(options);
+	vm.perfCounters = counters.get();
 
 	char line[1024];
 	while (true) {
@@ -38,16 +240,47 @@ static void repl() {
 
 		vm.interpret(str);
 	}
+
+	if (options.stats) printStats(std::cerr, vm.stats());
 }
 
-static void runFile(std::string path) {
+static void runFile(std::string path, const Options& options) {
 	VM vm{};
+	vm.optimizationLevel = options.optimizationLevel;
+	vm.wholeProgram = true;
+	vm.budget = options.budget;
+	vm.heapLimit = options.heapLimit;
+	vm.collectStats = options.stats;
+	vm.verifyBytecode = options.verify;
+	vm.trace = options.trace;
+	auto counters = openPerfCounters(options);
+	vm.perfCounters = counters.get();
+
+	MappedFile source{ path };
+	if (options.reportPath) {
+		if (!reportTrace(options.reportPath.value(), source.view(), std::cout)) exit(65);
+		return;
+	}
+
+	// the decoder numbers functions by compiling the source again, so the
+	// recorder only runs the whole-file compile that it can reproduce
+	std::unique_ptr<TraceRecorder> recorder{};
+	if (options.recordPath) {
+		recorder = std::make_unique<TraceRecorder>(options.recordPath.value(), options.recordBytes, options.optimizationLevel, source.view());
+		vm.recorder = recorder.get();
+		installRecorderSignal();
+	}
 
-	auto source = readFile(path);
-	auto result = vm.interpret(source);
+	auto result = options.stream ? vm.interpretStream(source.view()) : vm.interpret(source.view());
+	// the program lasts as long as any isolate it started can still run
+	if (isolatePoolStarted()) isolatePool().drain();
+	if (recorder) recorder->save();
 
+	if (options.stats) printStats(std::cerr, vm.stats());
 	vm.free();
 
 	if (result == InterpretResult::CompileTimeError) exit(65);
 	if (result == InterpretResult::RuntimeError) exit(70);
+	if (result == InterpretResult::BudgetExhausted) exit(75);
+	if (result == InterpretResult::OutOfMemory) exit(71);
 }
\ No newline at end of file
@@ -0,0 +1,167 @@
+#include "natives.h"
+#include "vm.h"
+#include "object.h"
+#include "simd.h"
+
+static ObjArray* arrayArg(VM& vm, Value value, const std::string& native) {
+	if (value.isObj() && value.asObjUnsafe()->isArray()) {
+		return static_cast<ObjArray*>(value.asObjUnsafe().get());
+	}
+	vm.runtimeError("%s expects an array.", native.c_str());
+	return nullptr;
+}
+
+static bool sameLength(VM& vm, std::initializer_list<ObjArray*> arrays, const std::string& native) {
+	auto size = (*arrays.begin())->values.size();
+	for (auto array : arrays) {
+		if (array->values.size() != size) {
+			vm.runtimeError("%s expects arrays of the same length.", native.c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+using MapKernel = void (*)(double* out, const double* a, const double* b, size_t count);
+
+// out, a, b: writes the element-wise result into out without allocating
+static void defineMap(VM& vm, const std::string& name, MapKernel ArrayKernels::* kernel) {
+	vm.defineNative(name, 3, [name, kernel] (VM& vm, std::span<Value> args) -> std::optional<Value> {
+		auto out = arrayArg(vm, args[0], name);
+		if (!out) return std::nullopt;
+		auto a = arrayArg(vm, args[1], name);
+		if (!a) return std::nullopt;
+		auto b = arrayArg(vm, args[2], name);
+		if (!b) return std::nullopt;
+		if (!sameLength(vm, { out, a, b }, name)) return std::nullopt;
+
+		(arrayKernels().*kernel)(out->values.data(), a->values.data(), b->values.data(), out->values.size());
+		return args[0];
+	});
+}
+
+void defineArrayNatives(VM& vm) {
+	vm.defineNative("array", 1, [] (VM& vm, std::span<Value> args) -> std::optional<Value> {
+		auto size = args[0].asNumber();
+		if (!size || size.value() < 0 || size.value() != std::floor(size.value())) {
+			vm.runtimeError("array expects a non-negative whole number.");
+			return std::nullopt;
+		}
+		auto count = static_cast<size_t>(size.value());
+		// saturates so that a count too large to ever fit fails the limit check rather than wrapping
+		auto bytes = count > std::numeric_limits<size_t>::max() / sizeof(double) ? std::numeric_limits<size_t>::max() : count * sizeof(double);
+		auto array = vm.allocate<ObjArray>(ObjType::Array, bytes, count);
+		if (!array) return std::nullopt;
+		return Value{ array };
+	});
+
+	vm.defineNative("arrayLength", 1, [] (VM& vm, std::span<Value> args) -> std::optional<Value> {
+		auto array = arrayArg(vm, args[0], "arrayLength");
+		if (!array) return std::nullopt;
+		return Value{ static_cast<double>(array->values.size()) };
+	});
+
+	defineMap(vm, "arrayAdd", &ArrayKernels::add);
+	defineMap(vm, "arraySubtract", &ArrayKernels::subtract);
+	defineMap(vm, "arrayMultiply", &ArrayKernels::multiply);
+	defineMap(vm, "arrayDivide", &ArrayKernels::divide);
+
+	vm.defineNative("arraySum", 1, [] (VM& vm, std::span<Value> args) -> std::optional<Value> {
+		auto array = arrayArg(vm, args[0], "arraySum");
+		if (!array) return std::nullopt;
+		return Value{ arrayKernels().sum(array->values.data(), array->values.size()) };
+	});
+
+	vm.defineNative("arrayMin", 1, [] (VM& vm, std::span<Value> args) -> std::optional<Value> {
+		auto array = arrayArg(vm, args[0], "arrayMin");
+		if (!array) return std::nullopt;
+		if (array->values.empty()) return Value{};
+		return Value{ arrayKernels().min(array->values.data(), array->values.size()) };
+	});
+
+	vm.defineNative("arrayMax", 1, [] (VM& vm, std::span<Value> args) -> std::optional<Value> {
+		auto array = arrayArg(vm, args[0], "arrayMax");
+		if (!array) return std::nullopt;
+		if (array->values.empty()) return Value{};
+		return Value{ arrayKernels().max(array->values.data(), array->values.size()) };
+	});
+
+	vm.defineNative("arrayDot", 2, [] (VM& vm, std::span<Value> args) -> std::optional<Value> {
+		auto a = arrayArg(vm, args[0], "arrayDot");
+		if (!a) return std::nullopt;
+		auto b = arrayArg(vm, args[1], "arrayDot");
+		if (!b) return std::nullopt;
+		if (!sameLength(vm, { a, b }, "arrayDot")) return std::nullopt;
+		return Value{ arrayKernels().dot(a->values.data(), b->values.data(), a->values.size()) };
+	});
+
+	vm.defineNative("arrayFill", 2, [] (VM& vm, std::span<Value> args) -> std::optional<Value> {
+		auto array = arrayArg(vm, args[0], "arrayFill");
+		if (!array) return std::nullopt;
+		auto value = args[1].asNumber();
+		if (!value) {
+			vm.runtimeError("arrayFill expects a number.");
+			return std::nullopt;
+		}
+		arrayKernels().fill(array->values.data(), value.value(), array->values.size());
+		return args[0];
+	});
+
+	vm.defineNative("arrayCopy", 2, [] (VM& vm, std::span<Value> args) -> std::optional<Value> {
+		auto out = arrayArg(vm, args[0], "arrayCopy");
+		if (!out) return std::nullopt;
+		auto in = arrayArg(vm, args[1], "arrayCopy");
+		if (!in) return std::nullopt;
+		if (!sameLength(vm, { out, in }, "arrayCopy")) return std::nullopt;
+		// memmove is already a vectorised, bandwidth-bound loop
+		std::memmove(out->values.data(), in->values.data(), in->values.size() * sizeof(double));
+		return args[0];
+	});
+}
+
+// a fiber runs a function or closure that takes the first value it is resumed with, or nothing
+static std::optional<Value> fiberBody(VM& vm, Value callee, const std::string& native) {
+	if (callee.isObj()) {
+		auto obj = callee.asObjRawUnsafe();
+		std::optional<int> arity{};
+		if (obj->isClosure()) arity = static_cast<ObjClosure*>(obj)->function->arity;
+		if (obj->isFunction()) arity = static_cast<ObjFunction*>(obj)->arity;
+		if (arity && arity.value() <= 1) return callee;
+	}
+	vm.runtimeError("%s expects a function taking at most one argument.", native.c_str());
+	return std::nullopt;
+}
+
+void defineFiberNatives(VM& vm) {
+	// a coroutine, run by resume(fiber, value)
+	vm.defineNative("fiber", 1, [] (VM& vm, std::span<Value> args) -> std::optional<Value> {
+		auto body = fiberBody(vm, args[0], "fiber");
+		if (!body) return std::nullopt;
+		auto fiber = vm.allocate<ObjFiber>(ObjType::Fiber, 0, body.value());
+		if (!fiber) return std::nullopt;
+		return Value{ fiber };
+	});
+
+	// a fiber for the scheduler, which runs it once the running one yields or finishes
+	vm.defineNative("spawn", 2, [] (VM& vm, std::span<Value> args) -> std::optional<Value> {
+		auto body = fiberBody(vm, args[0], "spawn");
+		if (!body) return std::nullopt;
+		auto priority = args[1].asNumber();
+		if (!priority || priority.value() != std::floor(priority.value()) || std::abs(priority.value()) > std::numeric_limits<int>::max()) {
+			vm.runtimeError("spawn expects a whole number priority.");
+			return std::nullopt;
+		}
+		auto fiber = vm.allocate<ObjFiber>(ObjType::Fiber, 0, body.value());
+		if (!fiber) return std::nullopt;
+		vm.schedule(fiber.get(), static_cast<int>(priority.value()));
+		return Value{ fiber };
+	});
+
+	vm.defineNative("fiberDone", 1, [] (VM& vm, std::span<Value> args) -> std::optional<Value> {
+		if (!args[0].isObj() || !args[0].asObjRawUnsafe()->isFiber()) {
+			vm.runtimeError("fiberDone expects a fiber.");
+			return std::nullopt;
+		}
+		return Value{ static_cast<ObjFiber*>(args[0].asObjRawUnsafe())->state == FiberState::Done };
+	});
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "common.h"
+
+struct VM;
+
+void defineArrayNatives(VM& vm);
+
+void defineFiberNatives(VM& vm);
\ No newline at end of file
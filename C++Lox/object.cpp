@@ -1,9 +1,60 @@
 #include "object.h"
 
+const char* objTypeName(ObjType type) {
+	switch (type) {
+		case ObjType::String: return "string";
+		case ObjType::Function: return "function";
+		case ObjType::Native: return "native";
+		case ObjType::Closure: return "closure";
+		case ObjType::Upvalue: return "upvalue";
+		case ObjType::Class: return "class";
+		case ObjType::Instance: return "instance";
+		case ObjType::BoundMethod: return "bound method";
+		case ObjType::Array: return "array";
+		case ObjType::Map: return "map";
+		case ObjType::Fiber: return "fiber";
+		case ObjType::Channel: return "channel";
+	}
+	unreachable();
+	return "";
+}
+
 bool Obj::isString() {
 	return type == ObjType::String;
 }
 
+bool Obj::isFunction() {
+	return type == ObjType::Function;
+}
+
+bool Obj::isNative() {
+	return type == ObjType::Native;
+}
+
+bool Obj::isClosure() {
+	return type == ObjType::Closure;
+}
+
+bool Obj::isClass() {
+	return type == ObjType::Class;
+}
+
+bool Obj::isInstance() {
+	return type == ObjType::Instance;
+}
+
+bool Obj::isArray() {
+	return type == ObjType::Array;
+}
+
+bool Obj::isMap() {
+	return type == ObjType::Map;
+}
+
+bool Obj::isFiber() {
+	return type == ObjType::Fiber;
+}
+
 std::string Obj::asStringUnsafe() {
 	throw std::runtime_error("Called asStringUnsafe on a non-string Obj");
 }
@@ -13,10 +64,55 @@ std::optional<std::string> Obj::asString() {
 	return std::nullopt;
 }
 
+static std::string stringifyFunction(ObjFunction& function) {
+	if (function.name.empty()) return "<script>";
+	return "<fn " + function.name + ">";
+}
+
 std::string Obj::stringify() {
 	switch (type) {
 		case ObjType::String:
 			return asStringUnsafe();
+		case ObjType::Function:
+			return stringifyFunction(*static_cast<ObjFunction*>(this));
+		case ObjType::Native:
+			return "<native fn " + static_cast<ObjNative*>(this)->name + ">";
+		case ObjType::Closure:
+			return stringifyFunction(*static_cast<ObjClosure*>(this)->function);
+		case ObjType::Upvalue:
+			return "upvalue";
+		case ObjType::Class:
+			return static_cast<ObjClass*>(this)->name;
+		case ObjType::Instance:
+			return static_cast<ObjInstance*>(this)->klass->name + " instance";
+		case ObjType::BoundMethod:
+			return static_cast<ObjBoundMethod*>(this)->method.stringify();
+		case ObjType::Array:
+		{
+			std::string out{ "[" };
+			auto& values = static_cast<ObjArray*>(this)->values;
+			for (size_t i = 0; i < values.size(); i++) {
+				if (i > 0) out += ", ";
+				out += Value{ values[i] }.stringify();
+			}
+			return out + "]";
+		}
+		case ObjType::Map:
+		{
+			std::string out{ "{" };
+			auto first = true;
+			for (auto& entry : static_cast<ObjMap*>(this)->entries) {
+				if (entry.key.isNil()) continue;
+				if (!first) out += ", ";
+				first = false;
+				out += entry.key.stringify() + ": " + entry.value.stringify();
+			}
+			return out + "}";
+		}
+		case ObjType::Fiber:
+			return "<fiber>";
+		case ObjType::Channel:
+			return "<channel>";
 		default:
 			assert(false, "Cannot stringify unknown object type");
 			return "";
@@ -26,3 +122,116 @@ std::string Obj::stringify() {
 std::string ObjString::asStringUnsafe() {
 	return str;
 }
+
+std::optional<size_t> Shape::lookup(const std::shared_ptr<ObjString>& name) {
+	auto slot = slots.find(name);
+	if (slot == slots.end()) return std::nullopt;
+	return slot->second;
+}
+
+std::shared_ptr<Shape> Shape::withField(const std::shared_ptr<ObjString>& name) {
+	auto& next = transitions[name];
+	if (!next) {
+		next = std::make_shared<Shape>();
+		next->slots = slots;
+		next->slots[name] = slots.size();
+	}
+	return next;
+}
+
+size_t hashString(const std::string& str) {
+	// 64-bit FNV-1a
+	uint64_t hash = 14695981039346656037ull;
+	for (auto c : str) {
+		hash ^= static_cast<uint8_t>(c);
+		hash *= 1099511628211ull;
+	}
+	return static_cast<size_t>(hash);
+}
+
+bool isHashable(Value key) {
+	return key.isNumber() || (key.isObj() && key.asObjRawUnsafe()->isString());
+}
+
+static size_t hashKey(Value& key) {
+	if (key.isObj()) return static_cast<ObjString*>(key.asObjRawUnsafe())->hash;
+
+	// finaliser from splitmix64, so nearby integers spread across the table
+	auto bits = std::bit_cast<uint64_t>(key.asNumberUnsafe());
+	bits = (bits ^ (bits >> 30)) * 0xbf58476d1ce4e5b9ull;
+	bits = (bits ^ (bits >> 27)) * 0x94d049bb133111ebull;
+	return static_cast<size_t>(bits ^ (bits >> 31));
+}
+
+static bool keysEqual(Value& a, Value& b) {
+	if (a.type != b.type) return false;
+	// strings are interned, and numbers compare by bits so NaN finds itself
+	if (a.isObj()) return a.asObjRawUnsafe() == b.asObjRawUnsafe();
+	return std::bit_cast<uint64_t>(a.asNumberUnsafe()) == std::bit_cast<uint64_t>(b.asNumberUnsafe());
+}
+
+MapEntry* ObjMap::find(Value& key) {
+	auto mask = entries.size() - 1;
+	auto index = hashKey(key) & mask;
+	MapEntry* tombstone = nullptr;
+
+	while (true) {
+		auto& entry = entries[index];
+		if (entry.key.isNil()) {
+			if (entry.value.isNil()) return tombstone ? tombstone : &entry;
+			if (!tombstone) tombstone = &entry;
+		} else if (keysEqual(entry.key, key)) {
+			return &entry;
+		}
+		index = (index + 1) & mask;
+	}
+}
+
+void ObjMap::resize(size_t capacity) {
+	auto old = std::exchange(entries, std::vector<MapEntry>(capacity));
+	tombstones = 0;
+	for (auto& entry : old) {
+		if (entry.key.isNil()) continue;
+		*find(entry.key) = std::move(entry);
+	}
+}
+
+std::optional<Value> ObjMap::get(Value key) {
+	if (count == 0) return std::nullopt;
+
+	auto entry = find(key);
+	if (entry->key.isNil()) return std::nullopt;
+	return entry->value;
+}
+
+bool ObjMap::set(Value key, Value value) {
+	// keep live entries and tombstones under 3/4 of the table so probes stay short
+	if ((count + tombstones + 1) * 4 > entries.size() * 3) {
+		// a table clogged with tombstones is rebuilt in place rather than grown
+		auto capacity = entries.empty() ? 8 : (count + 1) * 2 > entries.size() ? entries.size() * 2 : entries.size();
+		resize(capacity);
+	}
+
+	auto entry = find(key);
+	auto isNew = entry->key.isNil();
+	if (isNew) {
+		count++;
+		if (!entry->value.isNil()) tombstones--;
+	}
+	entry->key = key;
+	entry->value = value;
+	return isNew;
+}
+
+bool ObjMap::remove(Value key) {
+	if (count == 0) return false;
+
+	auto entry = find(key);
+	if (entry->key.isNil()) return false;
+
+	entry->key = Value{};
+	entry->value = Value{ true };
+	count--;
+	tombstones++;
+	return true;
+}
@@ -2,15 +2,41 @@
 
 #include "common.h"
 #include "value.h"
+#include "chunk.h"
+
+struct VM;
 
 enum class ObjType {
 	String,
+	Function,
+	Native,
+	Closure,
+	Upvalue,
+	Class,
+	Instance,
+	BoundMethod,
+	Array,
+	Map,
+	Fiber,
+	Channel,
 };
 
+constexpr size_t objTypeCount = size_t(ObjType::Channel) + 1;
+
+const char* objTypeName(ObjType type);
+
 struct Obj {
 	ObjType type;
 
 	bool isString();
+	bool isFunction();
+	bool isNative();
+	bool isClosure();
+	bool isClass();
+	bool isInstance();
+	bool isArray();
+	bool isMap();
+	bool isFiber();
 
 	virtual std::string asStringUnsafe();
 	std::optional<std::string> asString();
@@ -22,10 +48,172 @@ struct Obj {
 
 bool operator==(Obj& a, Obj& b);
 
+size_t hashString(const std::string& str);
+
 struct ObjString : Obj {
 	std::string str;
+	size_t hash;
 
 	std::string asStringUnsafe() override;
 
-	ObjString(std::string string) : Obj{ ObjType::String }, str{ string } {}
+	ObjString(std::string string) : Obj{ ObjType::String }, str{ string }, hash{ hashString(str) } {}
+};
+
+struct ObjFunction : Obj {
+	int arity{ 0 };
+	size_t upvalueCount{ 0 };
+	Chunk chunk{};
+	std::string name;
+	// numbered by VM::load, parents before the functions they declare
+	size_t loadIndex{ 0 };
+	// inlined globals can put one function in several constant pools, and it loads only once
+	bool loaded{ false };
+
+	ObjFunction(std::string n) : Obj{ ObjType::Function }, name{ n } {}
+};
+
+// returns nullopt after reporting a runtime error through the VM
+using NativeFn = std::function<std::optional<Value>(VM& vm, std::span<Value> args)>;
+
+struct ObjNative : Obj {
+	std::string name;
+	int arity;
+	NativeFn function;
+
+	ObjNative(std::string n, int a, NativeFn f) : Obj{ ObjType::Native }, name{ n }, arity{ a }, function{ f } {}
+};
+
+struct ObjFiber;
+
+// while open, the captured variable still lives at `slot` in the stack of the fiber that captured it
+struct ObjUpvalue : Obj {
+	size_t slot;
+	ObjFiber* fiber;
+	bool isOpen{ true };
+	Value closed{};
+
+	ObjUpvalue(size_t s, ObjFiber* f) : Obj{ ObjType::Upvalue }, slot{ s }, fiber{ f } {}
+};
+
+struct ObjClosure : Obj {
+	std::shared_ptr<ObjFunction> function;
+	std::vector<std::shared_ptr<ObjUpvalue>> upvalues{};
+
+	ObjClosure(std::shared_ptr<ObjFunction> f) : Obj{ ObjType::Closure }, function{ f } {}
+};
+
+// hidden class: instances that gained the same fields in the same order share one
+struct Shape {
+	std::unordered_map<std::shared_ptr<ObjString>, size_t> slots{};
+	std::unordered_map<std::shared_ptr<ObjString>, std::shared_ptr<Shape>> transitions{};
+
+	std::optional<size_t> lookup(const std::shared_ptr<ObjString>& name);
+	std::shared_ptr<Shape> withField(const std::shared_ptr<ObjString>& name);
+};
+
+struct ObjClass : Obj {
+	std::string name;
+	std::unordered_map<std::shared_ptr<ObjString>, Value> methods{};
+	std::shared_ptr<Shape> rootShape{ std::make_shared<Shape>() };
+
+	ObjClass(std::string n) : Obj{ ObjType::Class }, name{ n } {}
+};
+
+struct ObjInstance : Obj {
+	std::shared_ptr<ObjClass> klass;
+	std::shared_ptr<Shape> shape;
+	std::vector<Value> fields{};
+
+	ObjInstance(std::shared_ptr<ObjClass> k) : Obj{ ObjType::Instance }, klass{ k }, shape{ k->rootShape } {}
+};
+
+struct ObjBoundMethod : Obj {
+	Value receiver;
+	Value method;
+
+	ObjBoundMethod(Value r, Value m) : Obj{ ObjType::BoundMethod }, receiver{ r }, method{ m } {}
+};
+
+// numbers stored unboxed and contiguous so bulk natives can run SIMD kernels over them
+struct ObjArray : Obj {
+	std::vector<double> values;
+
+	ObjArray(std::vector<double> v) : Obj{ ObjType::Array }, values{ std::move(v) } {}
+	// zero-filled
+	ObjArray(size_t count) : Obj{ ObjType::Array }, values(count) {}
+};
+
+// only interned strings and numbers are valid keys
+bool isHashable(Value key);
+
+// an empty slot has a nil key and nil value, a tombstone a nil key and true
+struct MapEntry {
+	Value key{};
+	Value value{};
+};
+
+// open addressing with linear probing over a power-of-two table
+struct ObjMap : Obj {
+	std::vector<MapEntry> entries{};
+	size_t count{ 0 };
+	size_t tombstones{ 0 };
+
+	std::optional<Value> get(Value key);
+	// returns whether the key was new
+	bool set(Value key, Value value);
+	// returns whether the key was present
+	bool remove(Value key);
+
+	ObjMap() : Obj{ ObjType::Map } {}
+
+	private:
+	MapEntry* find(Value& key);
+	void resize(size_t capacity);
+};
+
+struct CallFrame {
+	std::shared_ptr<ObjFunction> function;
+	// null when the function captures nothing
+	std::shared_ptr<ObjClosure> closure;
+	size_t ip{ 0 };
+	size_t slots{ 0 };
+};
+
+enum class FiberState {
+	// created by fiber() and not resumed yet
+	New,
+	// stopped at a yield until something resumes it
+	Suspended,
+	// in the VM's run queue
+	Ready,
+	Running,
+	// resumed another fiber and waits for it to yield or finish
+	Waiting,
+	Done,
+};
+
+// a coroutine with its own value, frame and upvalue stacks. while the fiber runs
+// they live in the VM and these hold nothing, so a switch swaps vectors rather than
+// copying values; each starts with just the callee and grows as the fiber needs
+struct ObjFiber : Obj {
+	std::vector<Value> stack{};
+	std::vector<CallFrame> frames{};
+	std::vector<std::shared_ptr<ObjUpvalue>> openUpvalues{};
+	FiberState state{ FiberState::New };
+	// what the fiber's next yield returns to; null for scheduled fibers, whose yields go to the scheduler
+	ObjFiber* caller{ nullptr };
+	int priority{ 0 };
+
+	// the VM's root fiber, which runs the script
+	ObjFiber() : Obj{ ObjType::Fiber }, state{ FiberState::Running } {}
+	ObjFiber(Value callee) : Obj{ ObjType::Fiber }, stack{ callee } {}
+};
+
+struct Channel;
+
+// a handle on a channel, which every isolate holding one shares
+struct ObjChannel : Obj {
+	std::shared_ptr<Channel> channel;
+
+	ObjChannel(std::shared_ptr<Channel> c) : Obj{ ObjType::Channel }, channel{ std::move(c) } {}
 };
\ No newline at end of file
@@ -0,0 +1,493 @@
+#include "optimizer.h"
+#include "object.h"
+
+namespace {
+	struct Instruction {
+		OpCode op;
+		int line;
+		// operand bytes; a jump's trailing distance is kept as `target` instead
+		std::vector<uint8_t> operands{};
+		// index of the instruction a jump lands on
+		size_t target{ 0 };
+		// a switch's destinations, in SwitchTable::targets order
+		std::vector<size_t> cases{};
+		bool removed{ false };
+	};
+
+	// plain branches, which threading and jump removal may rewrite
+	bool isBranch(OpCode op) {
+		return op == OpCode::ConditionalJump || op == OpCode::Jump || op == OpCode::JumpBack;
+	}
+
+	bool isUnconditionalJump(OpCode op) {
+		return op == OpCode::Jump || op == OpCode::JumpBack;
+	}
+
+	SwitchTable& switchTable(Chunk& chunk, const Instruction& instruction) {
+		return chunk.switches[static_cast<size_t>(instruction.operands[0]) << 8 | instruction.operands[1]];
+	}
+
+	// control never falls through to the next instruction
+	bool endsBlock(OpCode op) {
+		return op == OpCode::Return || isUnconditionalJump(op) || isSwitch(op);
+	}
+
+	// pushes one value with no side effect and no way to fail
+	bool isPurePush(OpCode op) {
+		switch (op) {
+			case OpCode::Constant:
+			case OpCode::Nil:
+			case OpCode::True:
+			case OpCode::False:
+			case OpCode::GetLocal:
+			case OpCode::GetUpvalue:
+				return true;
+			default:
+				return false;
+		}
+	}
+
+	// the load matching a store, for forwarding a stored value instead of reloading it
+	std::optional<OpCode> loadFor(OpCode store) {
+		switch (store) {
+			case OpCode::SetLocal: return OpCode::GetLocal;
+			case OpCode::SetUpvalue: return OpCode::GetUpvalue;
+			case OpCode::SetGlobal: return OpCode::GetGlobal;
+			default: return std::nullopt;
+		}
+	}
+
+	std::vector<Instruction> lift(Chunk& chunk) {
+		std::vector<Instruction> code{};
+		std::unordered_map<size_t, size_t> indexAt{};
+
+		for (size_t offset = 0; offset < chunk.code.size();) {
+			auto length = instructionLength(chunk, offset);
+			Instruction instruction{ asOpCode(chunk.code[offset]), chunk.lines[offset] };
+			auto operandsEnd = offset + length;
+			if (isJump(instruction.op)) {
+				instruction.target = jumpTarget(chunk, offset);
+				operandsEnd -= 2;
+			}
+			instruction.operands.assign(chunk.code.begin() + offset + 1, chunk.code.begin() + operandsEnd);
+			if (isSwitch(instruction.op)) {
+				for (auto target : switchTable(chunk, instruction).targets()) instruction.cases.push_back(*target);
+			}
+
+			indexAt[offset] = code.size();
+			code.push_back(std::move(instruction));
+			offset += length;
+		}
+		indexAt[chunk.code.size()] = code.size();
+
+		for (auto& instruction : code) {
+			if (isJump(instruction.op)) instruction.target = indexAt.at(instruction.target);
+			for (auto& target : instruction.cases) target = indexAt.at(target);
+		}
+		return code;
+	}
+
+	// drops removed instructions; jumps to one land on whatever followed it
+	void compact(std::vector<Instruction>& code) {
+		std::vector<size_t> remap(code.size() + 1);
+		size_t next = 0;
+		for (size_t i = 0; i < code.size(); i++) {
+			remap[i] = next;
+			if (!code[i].removed) next++;
+		}
+		remap[code.size()] = next;
+
+		std::erase_if(code, [](const Instruction& instruction) { return instruction.removed; });
+		for (auto& instruction : code) {
+			if (isJump(instruction.op)) instruction.target = remap[instruction.target];
+			for (auto& target : instruction.cases) target = remap[target];
+		}
+	}
+
+	// an instruction some jump lands on starts a block, so a pattern must not span it
+	std::vector<bool> jumpTargets(const std::vector<Instruction>& code) {
+		std::vector<bool> targeted(code.size() + 1, false);
+		for (auto& instruction : code) {
+			if (isJump(instruction.op)) targeted[instruction.target] = true;
+			for (auto target : instruction.cases) targeted[target] = true;
+		}
+		return targeted;
+	}
+
+	std::optional<double> constantNumber(const Chunk& chunk, const Instruction& instruction) {
+		if (instruction.op != OpCode::Constant) return std::nullopt;
+		auto value = chunk.constants[instruction.operands[0]];
+		return value.asNumber();
+	}
+
+	std::optional<Value> fold(OpCode op, double a, double b) {
+		switch (op) {
+			case OpCode::Add:
+			case OpCode::AddNumber:
+			case OpCode::AddNumberUnchecked:
+				return Value{ a + b };
+			case OpCode::Subtract:
+			case OpCode::SubtractNumber:
+			case OpCode::SubtractNumberUnchecked:
+				return Value{ a - b };
+			case OpCode::Multiply:
+			case OpCode::MultiplyNumber:
+			case OpCode::MultiplyNumberUnchecked:
+				return Value{ a * b };
+			case OpCode::Divide:
+			case OpCode::DivideNumber:
+			case OpCode::DivideNumberUnchecked:
+				return Value{ a / b };
+			case OpCode::Less:
+			case OpCode::LessNumber:
+			case OpCode::LessNumberUnchecked:
+				return Value{ a < b };
+			case OpCode::Greater:
+			case OpCode::GreaterNumber:
+			case OpCode::GreaterNumberUnchecked:
+				return Value{ a > b };
+			case OpCode::Equal:
+				return Value{ a == b };
+			default:
+				return std::nullopt;
+		}
+	}
+
+	// turns the instruction into a push of value; false if the constant table is full
+	bool pushValue(Chunk& chunk, Instruction& instruction, Value value) {
+		instruction.operands.clear();
+		if (value.isBool()) {
+			instruction.op = value.asBoolUnsafe() ? OpCode::True : OpCode::False;
+			return true;
+		}
+
+		auto number = value.asNumberUnsafe();
+		auto existing = std::find_if(chunk.constants.begin(), chunk.constants.end(), [number](Value constant) {
+			return constant.isNumber() && std::bit_cast<uint64_t>(constant.asNumberUnsafe()) == std::bit_cast<uint64_t>(number);
+		});
+		auto index = static_cast<size_t>(existing - chunk.constants.begin());
+		if (existing == chunk.constants.end()) {
+			if (chunk.constants.size() > std::numeric_limits<uint8_t>::max()) return false;
+			index = chunk.addConstant(Value::number(number));
+		}
+
+		instruction.op = OpCode::Constant;
+		instruction.operands.push_back(static_cast<uint8_t>(index));
+		return true;
+	}
+
+	// constant numeric operands computed at compile time
+	bool foldConstants(Chunk& chunk, std::vector<Instruction>& code) {
+		auto targeted = jumpTargets(code);
+		auto changed = false;
+
+		for (size_t i = 0; i < code.size(); i++) {
+			auto a = constantNumber(chunk, code[i]);
+			if (!a) continue;
+
+			if (i + 1 < code.size() && !targeted[i + 1]
+				&& (code[i + 1].op == OpCode::Negate || code[i + 1].op == OpCode::NegateNumberUnchecked)) {
+				auto line = code[i + 1].line;
+				if (!pushValue(chunk, code[i], Value{ -a.value() })) continue;
+				code[i].line = line;
+				code[i + 1].removed = true;
+				changed = true;
+				i++;
+				continue;
+			}
+
+			if (i + 2 >= code.size() || targeted[i + 1] || targeted[i + 2]) continue;
+			auto b = constantNumber(chunk, code[i + 1]);
+			if (!b) continue;
+			auto result = fold(code[i + 2].op, a.value(), b.value());
+			if (!result) continue;
+
+			auto line = code[i + 2].line;
+			if (!pushValue(chunk, code[i], result.value())) continue;
+			code[i].line = line;
+			code[i + 1].removed = true;
+			code[i + 2].removed = true;
+			changed = true;
+			i += 2;
+		}
+		return changed;
+	}
+
+	// values pushed only to be dropped, e.g. expression statements without effects
+	bool removeDeadPushes(Chunk&, std::vector<Instruction>& code) {
+		auto targeted = jumpTargets(code);
+		auto changed = false;
+
+		for (size_t i = 0; i + 1 < code.size(); i++) {
+			if (!isPurePush(code[i].op) || code[i + 1].op != OpCode::Drop || targeted[i + 1]) continue;
+			code[i].removed = true;
+			code[i + 1].removed = true;
+			changed = true;
+			i++;
+		}
+		return changed;
+	}
+
+	// a store leaves its value on the stack, so dropping it and loading it back is a copy
+	bool forwardStores(Chunk&, std::vector<Instruction>& code) {
+		auto targeted = jumpTargets(code);
+		auto changed = false;
+
+		for (size_t i = 0; i + 2 < code.size(); i++) {
+			auto load = loadFor(code[i].op);
+			if (!load || targeted[i + 1] || targeted[i + 2]) continue;
+			if (code[i + 1].op != OpCode::Drop || code[i + 2].op != load.value()) continue;
+			if (code[i + 2].operands != code[i].operands) continue;
+			code[i + 1].removed = true;
+			code[i + 2].removed = true;
+			changed = true;
+			i += 2;
+		}
+		return changed;
+	}
+
+	// jumps onto jumps go straight to the final destination
+	bool threadJumps(Chunk&, std::vector<Instruction>& code) {
+		auto changed = false;
+
+		for (size_t i = 0; i < code.size(); i++) {
+			auto& jump = code[i];
+			if (!isBranch(jump.op)) continue;
+
+			auto target = jump.target;
+			for (size_t hops = 0; hops < code.size() && target < code.size(); hops++) {
+				auto& next = code[target];
+				// the condition is peeked, not popped, so a second test of it takes the same branch
+				auto follows = isUnconditionalJump(next.op)
+					|| (jump.op == OpCode::ConditionalJump && next.op == OpCode::ConditionalJump);
+				if (!follows || next.target == target) break;
+				target = next.target;
+			}
+
+			// there is no backward conditional jump
+			if (jump.op == OpCode::ConditionalJump && target <= i) continue;
+			if (target != jump.target) {
+				jump.target = target;
+				changed = true;
+			}
+		}
+		return changed;
+	}
+
+	bool removeJumpsToNext(Chunk&, std::vector<Instruction>& code) {
+		auto changed = false;
+		for (size_t i = 0; i < code.size(); i++) {
+			if (isBranch(code[i].op) && code[i].target == i + 1) {
+				code[i].removed = true;
+				changed = true;
+			}
+		}
+		return changed;
+	}
+
+	bool removeUnreachable(Chunk&, std::vector<Instruction>& code) {
+		auto targeted = jumpTargets(code);
+		auto changed = false;
+		auto reachable = true;
+
+		for (size_t i = 0; i < code.size(); i++) {
+			if (targeted[i]) reachable = true;
+			if (!reachable) {
+				code[i].removed = true;
+				changed = true;
+				continue;
+			}
+			if (endsBlock(code[i].op)) reachable = false;
+		}
+		return changed;
+	}
+
+	// false if a jump no longer fits its 16 bit offset, leaving the chunk untouched
+	bool lower(const std::vector<Instruction>& code, Chunk& chunk) {
+		std::vector<size_t> offsets(code.size() + 1);
+		size_t offset = 0;
+		for (size_t i = 0; i < code.size(); i++) {
+			offsets[i] = offset;
+			offset += 1 + code[i].operands.size() + (isJump(code[i].op) ? 2 : 0);
+		}
+		offsets[code.size()] = offset;
+
+		std::vector<uint8_t> bytes{};
+		std::vector<int> lines{};
+		// switch tables are only written once the whole chunk is known to fit
+		std::vector<std::pair<size_t*, size_t>> caseTargets{};
+		auto emit = [&](uint8_t byte, int line) {
+			bytes.push_back(byte);
+			lines.push_back(line);
+		};
+
+		for (size_t i = 0; i < code.size(); i++) {
+			auto& instruction = code[i];
+			auto op = instruction.op;
+			auto from = offsets[i + 1];
+			auto to = offsets[instruction.target];
+			// threading can turn a forward jump into a loop edge
+			if (isUnconditionalJump(op)) op = to < from ? OpCode::JumpBack : OpCode::Jump;
+
+			emit(asByte(op), instruction.line);
+			for (auto byte : instruction.operands) emit(byte, instruction.line);
+			if (isSwitch(op)) {
+				auto targets = switchTable(chunk, instruction).targets();
+				for (size_t c = 0; c < targets.size(); c++) caseTargets.emplace_back(targets[c], offsets[instruction.cases[c]]);
+			}
+			if (!isJump(op)) continue;
+
+			auto backward = isBackwardJump(op);
+			if (backward != (to < from) && to != from) return false;
+			auto distance = backward ? from - to : to - from;
+			if (distance > std::numeric_limits<uint16_t>::max()) return false;
+
+			emit(static_cast<uint8_t>(distance >> 8), instruction.line);
+			emit(static_cast<uint8_t>(distance), instruction.line);
+		}
+
+		chunk.code = std::move(bytes);
+		chunk.lines = std::move(lines);
+		for (auto [target, offset] : caseTargets) *target = offset;
+		return true;
+	}
+}
+
+void optimizeChunk(Chunk& chunk) {
+	auto code = lift(chunk);
+	auto constantCount = chunk.constants.size();
+
+	using Pass = bool (*)(Chunk&, std::vector<Instruction>&);
+	static const std::array<Pass, 6> passes{
+		foldConstants, removeDeadPushes, forwardStores, threadJumps, removeJumpsToNext, removeUnreachable,
+	};
+
+	// passes only shrink the code or shorten jumps, so a few rounds settle it
+	constexpr size_t maxRounds = 16;
+	auto changed = true;
+	for (size_t round = 0; changed && round < maxRounds; round++) {
+		changed = false;
+		for (auto pass : passes) {
+			if (pass(chunk, code)) {
+				changed = true;
+				compact(code);
+			}
+		}
+	}
+
+	// a threaded jump can outgrow its offset; the chunk then keeps its unoptimized code,
+	// and folded constants only that code used would just crowd the pool
+	if (!lower(code, chunk)) chunk.constants.resize(constantCount);
+}
+
+namespace {
+	std::string globalName(const Chunk& chunk, uint8_t index) {
+		auto name = chunk.constants[index];
+		return name.asObjRawUnsafe()->asStringUnsafe();
+	}
+
+	// the function a Constant or Closure instruction creates, if it creates one
+	ObjFunction* createdFunction(const Chunk& chunk, size_t offset) {
+		auto op = asOpCode(chunk.code[offset]);
+		if (op != OpCode::Constant && op != OpCode::Closure) return nullptr;
+		auto constant = chunk.constants[chunk.code[offset + 1]];
+		if (!constant.isObj() || !constant.asObjRawUnsafe()->isFunction()) return nullptr;
+		return static_cast<ObjFunction*>(constant.asObjRawUnsafe());
+	}
+
+	void collectAssignedGlobals(const Chunk& chunk, std::unordered_set<std::string>& assigned) {
+		for (size_t offset = 0; offset < chunk.code.size(); offset += instructionLength(chunk, offset)) {
+			if (asOpCode(chunk.code[offset]) == OpCode::SetGlobal) assigned.insert(globalName(chunk, chunk.code[offset + 1]));
+			if (auto function = createdFunction(chunk, offset)) collectAssignedGlobals(function->chunk, assigned);
+		}
+	}
+
+	// the value pushed by the instruction at offset, if it is a literal push
+	std::optional<Value> pushedValue(const Chunk& chunk, size_t offset) {
+		switch (asOpCode(chunk.code[offset])) {
+			case OpCode::Nil: return Value{};
+			case OpCode::True: return Value{ true };
+			case OpCode::False: return Value{ false };
+			case OpCode::Constant: return chunk.constants[chunk.code[offset + 1]];
+			default: return std::nullopt;
+		}
+	}
+
+	struct GlobalInliner {
+		std::unordered_map<std::string, Value> values{};
+		// constant index each global already got in a chunk
+		std::unordered_map<Chunk*, std::unordered_map<std::string, uint8_t>> indices{};
+		std::unordered_set<Chunk*> changed{};
+
+		std::optional<uint8_t> constantFor(Chunk& chunk, const std::string& name) {
+			auto& known = indices[&chunk];
+			auto index = known.find(name);
+			if (index != known.end()) return index->second;
+			if (chunk.constants.size() > std::numeric_limits<uint8_t>::max()) return std::nullopt;
+			return known[name] = static_cast<uint8_t>(chunk.addConstant(values.at(name)));
+		}
+
+		// rewrites the instruction at offset and everything in the functions it creates
+		void rewrite(Chunk& chunk, size_t offset) {
+			auto op = asOpCode(chunk.code[offset]);
+			if (op == OpCode::GetGlobal) {
+				auto name = globalName(chunk, chunk.code[offset + 1]);
+				auto index = values.contains(name) ? constantFor(chunk, name) : std::nullopt;
+				if (index) {
+					chunk.code[offset] = asByte(OpCode::Constant);
+					chunk.code[offset + 1] = index.value();
+					changed.insert(&chunk);
+				}
+			} else if ((op == OpCode::ForPrep || op == OpCode::ForLoop) && static_cast<ForLimit>(chunk.code[offset + 2]) == ForLimit::Global) {
+				auto name = globalName(chunk, chunk.code[offset + 3]);
+				auto index = values.contains(name) ? constantFor(chunk, name) : std::nullopt;
+				if (index) {
+					chunk.code[offset + 2] = static_cast<uint8_t>(ForLimit::Constant);
+					chunk.code[offset + 3] = index.value();
+					changed.insert(&chunk);
+				}
+			} else if (auto function = createdFunction(chunk, offset)) {
+				auto& inner = function->chunk;
+				for (size_t i = 0; i < inner.code.size(); i += instructionLength(inner, i)) rewrite(inner, i);
+			}
+		}
+	};
+}
+
+void inlineReadOnlyGlobals(ObjFunction& script, bool optimize) {
+	auto& chunk = script.chunk;
+
+	std::unordered_set<std::string> assigned{};
+	collectAssignedGlobals(chunk, assigned);
+
+	std::unordered_map<std::string, size_t> definitions{};
+	std::vector<bool> targeted(chunk.code.size() + 1, false);
+	for (size_t offset = 0; offset < chunk.code.size(); offset += instructionLength(chunk, offset)) {
+		auto op = asOpCode(chunk.code[offset]);
+		if (op == OpCode::DefineGlobal || op == OpCode::DefineConstant) definitions[globalName(chunk, chunk.code[offset + 1])]++;
+		if (isJump(op)) targeted[jumpTarget(chunk, offset)] = true;
+		if (isSwitch(op)) {
+			auto& table = chunk.switches[static_cast<size_t>(chunk.code[offset + 1]) << 8 | chunk.code[offset + 2]];
+			for (auto target : table.targets()) targeted[*target] = true;
+		}
+	}
+
+	// top-level code runs straight through, so a global is readable from its definition on,
+	// and so is every function created after it
+	GlobalInliner inliner{};
+	std::optional<size_t> previous{};
+	for (size_t offset = 0; offset < chunk.code.size(); offset += instructionLength(chunk, offset)) {
+		if (auto op = asOpCode(chunk.code[offset]); op == OpCode::DefineGlobal || op == OpCode::DefineConstant) {
+			auto name = globalName(chunk, chunk.code[offset + 1]);
+			auto value = previous && !targeted[offset] ? pushedValue(chunk, previous.value()) : std::nullopt;
+			if (value && !assigned.contains(name) && definitions[name] == 1) inliner.values[name] = value.value();
+		} else {
+			inliner.rewrite(chunk, offset);
+		}
+		previous = offset;
+	}
+
+	if (!optimize) return;
+	// constants read from globals can now be folded
+	for (auto changed : inliner.changed) optimizeChunk(*changed);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "common.h"
+#include "chunk.h"
+
+// highest level accepted by -O; 0 keeps the compiler's bytecode as emitted
+constexpr int maxOptimizationLevel = 1;
+
+// lifts a finished chunk into an instruction list, simplifies it and lowers it back;
+// jump offsets and lines are rebuilt, constant and cache operands keep their indices;
+// the passes are local rewrites of the stack code, with no SSA form behind them
+void optimizeChunk(Chunk& chunk);
+
+struct ObjFunction;
+
+// for a whole program: globals the script defines once from a constant and never assigns
+// are read as that constant, but only by code that cannot run before the definition does
+void inlineReadOnlyGlobals(ObjFunction& script, bool optimize);
\ No newline at end of file
@@ -0,0 +1,157 @@
+#include "perf.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+const char* perfEventName(PerfEvent event) {
+	switch (event) {
+		case PerfEvent::Cycles:
+			return "cycles";
+		case PerfEvent::Instructions:
+			return "instructions";
+		case PerfEvent::BranchMisses:
+			return "branch misses";
+		case PerfEvent::L1DataMisses:
+			return "L1 data misses";
+		case PerfEvent::LastLevelMisses:
+			return "last level cache misses";
+		case PerfEvent::PERFEVENT_LEN:
+			break;
+	}
+	unreachable();
+	return "";
+}
+
+std::optional<uint64_t> PerfCounts::operator[](PerfEvent event) const {
+	return events[static_cast<size_t>(event)];
+}
+
+PerfCounts operator+(const PerfCounts& a, const PerfCounts& b) {
+	PerfCounts sum{};
+	for (size_t i = 0; i < perfEventCount; i++) {
+		if (a.events[i] && b.events[i]) sum.events[i] = a.events[i].value() + b.events[i].value();
+	}
+	return sum;
+}
+
+PerfCounts operator-(const PerfCounts& a, const PerfCounts& b) {
+	PerfCounts difference{};
+	for (size_t i = 0; i < perfEventCount; i++) {
+		// scaling can make a later total come out a little lower
+		if (a.events[i] && b.events[i]) difference.events[i] = a.events[i].value() - std::min(a.events[i].value(), b.events[i].value());
+	}
+	return difference;
+}
+
+#ifdef __linux__
+static int openEvent(PerfEvent event) {
+	perf_event_attr attributes{};
+	attributes.size = sizeof(attributes);
+	attributes.exclude_kernel = 1;
+	attributes.exclude_hv = 1;
+	attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	auto cacheMisses = [] (uint64_t cache) {
+		return cache | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+	};
+	switch (event) {
+		case PerfEvent::Cycles:
+			attributes.type = PERF_TYPE_HARDWARE;
+			attributes.config = PERF_COUNT_HW_CPU_CYCLES;
+			break;
+		case PerfEvent::Instructions:
+			attributes.type = PERF_TYPE_HARDWARE;
+			attributes.config = PERF_COUNT_HW_INSTRUCTIONS;
+			break;
+		case PerfEvent::BranchMisses:
+			attributes.type = PERF_TYPE_HARDWARE;
+			attributes.config = PERF_COUNT_HW_BRANCH_MISSES;
+			break;
+		case PerfEvent::L1DataMisses:
+			attributes.type = PERF_TYPE_HW_CACHE;
+			attributes.config = cacheMisses(PERF_COUNT_HW_CACHE_L1D);
+			break;
+		case PerfEvent::LastLevelMisses:
+			attributes.type = PERF_TYPE_HW_CACHE;
+			attributes.config = cacheMisses(PERF_COUNT_HW_CACHE_LL);
+			break;
+		case PerfEvent::PERFEVENT_LEN:
+			unreachable();
+			break;
+	}
+	// this thread on any CPU, each event by itself so that one the hardware lacks doesn't take the rest down
+	return static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+}
+
+PerfCounters::PerfCounters() {
+	for (size_t i = 0; i < perfEventCount; i++) {
+		descriptors[i] = openEvent(PerfEvent(i));
+	}
+}
+
+PerfCounters::~PerfCounters() {
+	for (auto descriptor : descriptors) {
+		if (descriptor >= 0) close(descriptor);
+	}
+}
+
+PerfCounts PerfCounters::read() const {
+	PerfCounts counts{};
+	for (size_t i = 0; i < perfEventCount; i++) {
+		if (descriptors[i] < 0) continue;
+		// the count, then how long it was enabled and how long it was really counting
+		std::array<uint64_t, 3> values{};
+		if (::read(descriptors[i], values.data(), sizeof(values)) != sizeof(values)) continue;
+		auto [value, enabled, running] = values;
+		if (running == 0) {
+			counts.events[i] = 0;
+		} else if (running < enabled) {
+			counts.events[i] = static_cast<uint64_t>(static_cast<double>(value) * static_cast<double>(enabled) / static_cast<double>(running));
+		} else {
+			counts.events[i] = value;
+		}
+	}
+	return counts;
+}
+#else
+PerfCounters::PerfCounters() {
+	descriptors.fill(-1);
+}
+
+PerfCounters::~PerfCounters() {}
+
+PerfCounts PerfCounters::read() const {
+	return {};
+}
+#endif
+
+bool PerfCounters::anyOpen() const {
+	return std::any_of(descriptors.begin(), descriptors.end(), [] (int descriptor) { return descriptor >= 0; });
+}
+
+void printPerfCounts(std::ostream& out, const std::string& phase, const PerfCounts& counts) {
+	out << phase << " events:" << std::endl;
+	for (size_t i = 0; i < perfEventCount; i++) {
+		auto event = PerfEvent(i);
+		out << "  " << perfEventName(event) << ": ";
+		if (!counts.events[i]) {
+			out << "not counted" << std::endl;
+			continue;
+		}
+		out << counts.events[i].value();
+
+		// rates that show what a change to dispatch did, beyond the time it took
+		auto instructions = counts[PerfEvent::Instructions];
+		auto cycles = counts[PerfEvent::Cycles];
+		if (event == PerfEvent::Instructions && cycles && cycles.value() > 0) {
+			out << ", " << static_cast<double>(instructions.value()) / static_cast<double>(cycles.value()) << " per cycle";
+		} else if (event != PerfEvent::Cycles && event != PerfEvent::Instructions && instructions && instructions.value() > 0) {
+			out << ", " << 1000.0 * static_cast<double>(counts.events[i].value()) / static_cast<double>(instructions.value()) << " per 1000 instructions";
+		}
+		out << std::endl;
+	}
+}
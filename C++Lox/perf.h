@@ -0,0 +1,49 @@
+#pragma once
+
+#include "common.h"
+
+// hardware events that --perf-counters counts
+enum class PerfEvent : uint8_t {
+	Cycles,
+	Instructions,
+	BranchMisses,
+	L1DataMisses,
+	LastLevelMisses,
+
+	PERFEVENT_LEN
+};
+
+constexpr size_t perfEventCount = static_cast<size_t>(PerfEvent::PERFEVENT_LEN);
+
+const char* perfEventName(PerfEvent event);
+
+// events counted over some span; nullopt for one that couldn't be opened. the
+// kernel may share the hardware between more events than it has counters, so
+// these are scaled up from the time each was actually counting
+struct PerfCounts {
+	std::array<std::optional<uint64_t>, perfEventCount> events{};
+
+	std::optional<uint64_t> operator[](PerfEvent event) const;
+};
+
+PerfCounts operator+(const PerfCounts& a, const PerfCounts& b);
+PerfCounts operator-(const PerfCounts& a, const PerfCounts& b);
+
+// the calling thread's counters, in user space only. they need Linux with
+// perf_event_open allowed; anywhere else none of them open
+struct PerfCounters {
+	PerfCounters();
+	~PerfCounters();
+
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	bool anyOpen() const;
+	// totals since the counters opened
+	PerfCounts read() const;
+
+	private:
+	std::array<int, perfEventCount> descriptors{};
+};
+
+void printPerfCounts(std::ostream& out, const std::string& phase, const PerfCounts& counts);
\ No newline at end of file
@@ -0,0 +1,24 @@
+#pragma once
+
+// static tracepoints under the provider `lox`, for bpftrace, perf and the like
+// to attach to a running interpreter, e.g. `bpftrace -e 'usdt:./lox:lox:string__miss { ... }'`.
+// through <sys/sdt.h> each is one nop plus an ELF note saying where it is and
+// where its arguments live, so it does nothing until something attaches. keep
+// the arguments to values already at hand, since they're still worked out.
+// they compile to nothing without <sys/sdt.h>, or with LOX_NO_PROBES defined
+#if !defined(LOX_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define LOX_PROBES
+#endif
+#endif
+
+#ifdef LOX_PROBES
+#define PROBE(name) DTRACE_PROBE(lox, name)
+#define PROBE1(name, a) DTRACE_PROBE1(lox, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(lox, name, a, b)
+#else
+#define PROBE(name) ((void)0)
+#define PROBE1(name, a) ((void)0)
+#define PROBE2(name, a, b) ((void)0)
+#endif
\ No newline at end of file
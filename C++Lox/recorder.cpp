@@ -0,0 +1,379 @@
+#include "recorder.h"
+#include "compiler.h"
+#include "debug.h"
+#include "object.h"
+
+constexpr std::string_view traceMagic = "LOXTRACE";
+constexpr uint32_t traceVersion = 1;
+
+// FNV-1a, to tell a trace apart from one of a different source
+static uint64_t hashSource(std::string_view source) {
+	uint64_t hash = 0xcbf29ce484222325;
+	for (auto c : source) {
+		hash ^= static_cast<uint8_t>(c);
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+static std::atomic<bool> saveRequested{ false };
+
+static void requestSave(int) {
+	saveRequested = true;
+}
+
+void installRecorderSignal() {
+#if defined(SIGUSR1)
+	std::signal(SIGUSR1, requestSave);
+#elif defined(SIGBREAK)
+	std::signal(SIGBREAK, requestSave);
+#endif
+}
+
+TraceRecorder::TraceRecorder(std::string p, size_t bytes, int level, std::string_view source)
+	: path{ std::move(p) }, optimizationLevel{ level }, sourceHash{ hashSource(source) } {
+	auto blocks = std::max<size_t>(1, bytes / recorderBlockSize);
+	buffer.resize(blocks * recorderBlockSize);
+	used.resize(blocks);
+	cursor = buffer.data();
+	end = cursor + recorderBlockSize;
+}
+
+void TraceRecorder::nextBlock() {
+	auto start = buffer.data() + block * recorderBlockSize;
+	used[block] = static_cast<uint32_t>(cursor - start);
+	// a save asked for by the signal handler waits for this, the one point where the ring is consistent
+	if (saveRequested.exchange(false)) save();
+
+	block = (block + 1) % used.size();
+	if (block == 0) wrapped = true;
+	cursor = buffer.data() + block * recorderBlockSize;
+	end = cursor + recorderBlockSize;
+	used[block] = 0;
+	lastFunction = restart;
+}
+
+static void writeInteger(std::ostream& out, uint64_t value, size_t bytes) {
+	for (size_t i = 0; i < bytes; i++) {
+		out.put(static_cast<char>(value >> (i * 8)));
+	}
+}
+
+bool TraceRecorder::save() {
+	auto start = buffer.data() + block * recorderBlockSize;
+	used[block] = static_cast<uint32_t>(cursor - start);
+
+	std::vector<size_t> order{};
+	if (wrapped) {
+		for (auto i = block + 1; i < used.size(); i++) order.push_back(i);
+	}
+	for (size_t i = 0; i <= block; i++) order.push_back(i);
+
+	std::ofstream out{ path, std::ios::binary | std::ios::trunc };
+	if (!out.is_open()) {
+		std::cerr << "Could not write trace " << path << "." << std::endl;
+		return false;
+	}
+	out << traceMagic;
+	writeInteger(out, traceVersion, 4);
+	writeInteger(out, optimizationLevel, 4);
+	writeInteger(out, sourceHash, 8);
+	writeInteger(out, recorded, 8);
+	writeInteger(out, order.size(), 4);
+	for (auto index : order) {
+		writeInteger(out, used[index], 4);
+		out.write(reinterpret_cast<const char*>(buffer.data() + index * recorderBlockSize), used[index]);
+	}
+	out.flush();
+	return out.good();
+}
+
+struct SavedTrace {
+	int optimizationLevel{ 0 };
+	uint64_t sourceHash{ 0 };
+	uint64_t recorded{ 0 };
+	std::vector<std::vector<uint8_t>> blocks{};
+};
+
+static std::optional<uint64_t> readInteger(std::istream& in, size_t bytes) {
+	uint64_t value = 0;
+	for (size_t i = 0; i < bytes; i++) {
+		auto c = in.get();
+		if (c == std::char_traits<char>::eof()) return std::nullopt;
+		value |= static_cast<uint64_t>(static_cast<uint8_t>(c)) << (i * 8);
+	}
+	return value;
+}
+
+static std::optional<SavedTrace> readTrace(const std::string& path) {
+	std::ifstream in{ path, std::ios::binary };
+	if (!in.is_open()) return std::nullopt;
+
+	std::string magic(traceMagic.size(), '\0');
+	in.read(magic.data(), magic.size());
+	auto version = readInteger(in, 4);
+	if (magic != traceMagic || version != traceVersion) return std::nullopt;
+
+	SavedTrace trace{};
+	auto level = readInteger(in, 4);
+	auto hash = readInteger(in, 8);
+	auto recorded = readInteger(in, 8);
+	auto blocks = readInteger(in, 4);
+	if (!level || !hash || !recorded || !blocks) return std::nullopt;
+	trace.optimizationLevel = static_cast<int>(level.value());
+	trace.sourceHash = hash.value();
+	trace.recorded = recorded.value();
+
+	for (uint64_t i = 0; i < blocks.value(); i++) {
+		auto size = readInteger(in, 4);
+		if (!size || size.value() > recorderBlockSize) return std::nullopt;
+		std::vector<uint8_t> block(size.value());
+		in.read(reinterpret_cast<char*>(block.data()), block.size());
+		if (!in) return std::nullopt;
+		trace.blocks.push_back(std::move(block));
+	}
+	return trace;
+}
+
+// in the order VM::load numbers them: each function before the ones in its constants
+// in the order VM::load numbers them, each once however many pools hold it
+static void collectFunctions(ObjFunction& function, std::vector<ObjFunction*>& functions, std::unordered_set<ObjFunction*>& seen) {
+	if (!seen.insert(&function).second) return;
+	functions.push_back(&function);
+	for (auto& constant : function.chunk.constants) {
+		if (constant.isObj() && constant.asObjRawUnsafe()->isFunction()) {
+			collectFunctions(*static_cast<ObjFunction*>(constant.asObjRawUnsafe()), functions, seen);
+		}
+	}
+}
+
+// what the trace says about one instruction site
+struct SiteCounts {
+	uint64_t executed{ 0 };
+	uint64_t taken{ 0 };
+	uint64_t fellThrough{ 0 };
+};
+
+struct BasicBlock {
+	size_t function;
+	size_t start;
+	size_t end;
+	uint64_t entries{ 0 };
+	uint64_t instructions{ 0 };
+};
+
+// offsets where a basic block starts: the entry, every jump and switch target,
+// and whatever follows a jump, a switch or a return
+static std::vector<bool> blockLeaders(Chunk& chunk) {
+	auto size = chunk.code.size();
+	std::vector<bool> leaders(size + 1);
+	leaders[0] = true;
+	for (size_t offset = 0; offset < size; offset += instructionLength(chunk, offset)) {
+		auto instruction = asOpCode(chunk.code[offset]);
+		auto next = offset + instructionLength(chunk, offset);
+		if (isJump(instruction)) {
+			leaders[jumpTarget(chunk, offset)] = true;
+			leaders[next] = true;
+		} else if (isSwitch(instruction)) {
+			auto& table = chunk.switches[chunk.code[offset + 1] << 8 | chunk.code[offset + 2]];
+			for (auto target : table.targets()) leaders[*target] = true;
+			leaders[next] = true;
+		} else if (instruction == OpCode::Return) {
+			leaders[next] = true;
+		}
+	}
+	return leaders;
+}
+
+static std::string functionName(const ObjFunction& function) {
+	return function.name.empty() ? "<script>" : function.name;
+}
+
+static double share(uint64_t part, uint64_t whole) {
+	return whole == 0 ? 0 : 100.0 * static_cast<double>(part) / static_cast<double>(whole);
+}
+
+// blocks and branches listed in the report
+constexpr size_t reportedBlocks = 10;
+constexpr size_t reportedBranches = 20;
+
+bool reportTrace(const std::string& tracePath, std::string_view source, std::ostream& out) {
+	auto trace = readTrace(tracePath);
+	if (!trace) {
+		std::cerr << "Could not read trace " << tracePath << "." << std::endl;
+		return false;
+	}
+	if (trace->sourceHash != hashSource(source)) {
+		std::cerr << "Trace " << tracePath << " was recorded from a different source." << std::endl;
+		return false;
+	}
+
+	Compiler compiler{ source };
+	compiler.optimizationLevel = trace->optimizationLevel;
+	compiler.wholeProgram = true;
+	auto script = compiler.compile();
+	if (!script) return false;
+
+	std::vector<ObjFunction*> functions{};
+	std::unordered_set<ObjFunction*> seen{};
+	collectFunctions(*script.value(), functions, seen);
+	std::vector<std::vector<SiteCounts>> sites{};
+	for (auto function : functions) sites.emplace_back(function->chunk.code.size());
+	std::array<uint64_t, static_cast<size_t>(OpCode::OPCODE_LEN)> opcodes{};
+	uint64_t kept = 0;
+
+	// the branch whose outcome the next record shows, while waiting is set;
+	// kept whole rather than in an optional so every field always has a value
+	struct PendingBranch {
+		bool waiting{ false };
+		size_t function{ 0 };
+		size_t offset{ 0 };
+		size_t target{ 0 };
+		size_t next{ 0 };
+	};
+	PendingBranch pending{};
+
+	for (auto& block : trace->blocks) {
+		size_t position = 0;
+		auto readVarint = [&] () -> std::optional<uint64_t> {
+			uint64_t value = 0;
+			for (size_t shift = 0; position < block.size() && shift < 64; shift += 7) {
+				auto byte = block[position++];
+				value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+				if (!(byte & 0x80)) return value;
+			}
+			return std::nullopt;
+		};
+		auto unzigzag = [] (uint64_t value) {
+			return static_cast<size_t>((value >> 1) ^ (~(value & 1) + 1));
+		};
+
+		size_t function = 0;
+		size_t offset = 0;
+		size_t depth = 0;
+		auto started = false;
+		while (position < block.size()) {
+			uint8_t code = 0;
+			if (block[position] == recorderAbsolute) {
+				position++;
+				auto newFunction = readVarint();
+				auto newOffset = readVarint();
+				auto newDepth = readVarint();
+				if (!newFunction || !newOffset || !newDepth || position >= block.size()) break;
+				function = newFunction.value();
+				offset = newOffset.value();
+				depth = newDepth.value();
+				code = block[position++];
+				started = true;
+			} else {
+				code = block[position++];
+				if (!started || position >= block.size()) break;
+				auto packed = block[position++];
+				std::optional<uint64_t> offsetDelta = packed & 0xF;
+				std::optional<uint64_t> depthDelta = packed >> 4;
+				if (packed == recorderWideDeltas) {
+					offsetDelta = readVarint();
+					depthDelta = readVarint();
+				}
+				if (!offsetDelta || !depthDelta) break;
+				offset += unzigzag(offsetDelta.value());
+				depth += unzigzag(depthDelta.value());
+			}
+
+			if (function >= functions.size() || offset >= sites[function].size() || !validOpCode(code)) {
+				std::cerr << "Trace " << tracePath << " doesn't match the code compiled from its source." << std::endl;
+				return false;
+			}
+
+			kept++;
+			opcodes[code]++;
+			sites[function][offset].executed++;
+
+			if (pending.waiting && pending.function == function) {
+				auto& branch = sites[function][pending.offset];
+				if (offset == pending.target) branch.taken++;
+				else if (offset == pending.next) branch.fellThrough++;
+			}
+			pending.waiting = false;
+
+			auto instruction = asOpCode(code);
+			if (instruction == OpCode::ConditionalJump || instruction == OpCode::JumpBackIfTrue) {
+				auto& chunk = functions[function]->chunk;
+				pending = PendingBranch{ true, function, offset, jumpTarget(chunk, offset), offset + instructionLength(chunk, offset) };
+			}
+		}
+	}
+
+	out << "== trace ==\n";
+	out << trace->recorded << " instructions recorded, the last " << kept << " kept, at -O" << trace->optimizationLevel << "\n";
+
+	out << "\n== instructions ==\n";
+	std::vector<uint8_t> byCount{};
+	for (uint8_t code = 0; validOpCode(code); code++) {
+		if (opcodes[code] > 0) byCount.push_back(code);
+	}
+	std::stable_sort(byCount.begin(), byCount.end(), [&] (uint8_t a, uint8_t b) { return opcodes[a] > opcodes[b]; });
+	out << std::fixed << std::setprecision(1);
+	for (auto code : byCount) {
+		out << std::setw(6) << share(opcodes[code], kept) << "% " << std::setw(12) << opcodes[code] << "  " << opCodeName(asOpCode(code)) << "\n";
+	}
+
+	out << "\n== hot blocks ==\n";
+	std::vector<BasicBlock> blocks{};
+	for (size_t function = 0; function < functions.size(); function++) {
+		auto& chunk = functions[function]->chunk;
+		auto leaders = blockLeaders(chunk);
+		for (size_t start = 0; start < chunk.code.size();) {
+			BasicBlock block{ function, start, start };
+			block.entries = sites[function][start].executed;
+			while (block.end < chunk.code.size() && (block.end == start || !leaders[block.end])) {
+				block.instructions += sites[function][block.end].executed;
+				block.end += instructionLength(chunk, block.end);
+			}
+			if (block.instructions > 0) blocks.push_back(block);
+			start = block.end;
+		}
+	}
+	std::stable_sort(blocks.begin(), blocks.end(), [] (const BasicBlock& a, const BasicBlock& b) { return a.instructions > b.instructions; });
+	if (blocks.size() > reportedBlocks) blocks.resize(reportedBlocks);
+	for (auto& block : blocks) {
+		auto& function = *functions[block.function];
+		out << std::setw(6) << share(block.instructions, kept) << "% " << std::setw(12) << block.entries << " entries  "
+			<< functionName(function) << " " << block.start << "-" << block.end << "\n";
+		for (auto offset = block.start; offset < block.end;) {
+			out << "        ";
+			offset = disassembleInstruction(function.chunk, offset, out);
+		}
+	}
+
+	out << "\n== branches ==\n";
+	struct Branch {
+		size_t function;
+		size_t offset;
+		SiteCounts counts;
+	};
+	std::vector<Branch> branches{};
+	for (size_t function = 0; function < functions.size(); function++) {
+		auto& chunk = functions[function]->chunk;
+		for (size_t offset = 0; offset < chunk.code.size(); offset += instructionLength(chunk, offset)) {
+			auto instruction = asOpCode(chunk.code[offset]);
+			auto& counts = sites[function][offset];
+			if ((instruction == OpCode::ConditionalJump || instruction == OpCode::JumpBackIfTrue) && counts.taken + counts.fellThrough > 0) {
+				branches.push_back({ function, offset, counts });
+			}
+		}
+	}
+	std::stable_sort(branches.begin(), branches.end(), [] (const Branch& a, const Branch& b) {
+		return a.counts.taken + a.counts.fellThrough > b.counts.taken + b.counts.fellThrough;
+	});
+	if (branches.size() > reportedBranches) branches.resize(reportedBranches);
+	for (auto& branch : branches) {
+		auto& function = *functions[branch.function];
+		auto outcomes = branch.counts.taken + branch.counts.fellThrough;
+		out << std::setw(6) << share(branch.counts.taken, outcomes) << "% taken of " << std::setw(12) << outcomes << "  "
+			<< functionName(function) << " line " << function.chunk.lines[branch.offset] << ", "
+			<< opCodeName(asOpCode(function.chunk.code[branch.offset])) << " at " << branch.offset << "\n";
+	}
+	out << std::flush;
+	return true;
+}
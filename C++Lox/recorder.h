@@ -0,0 +1,106 @@
+#pragma once
+
+#include "common.h"
+#include "chunk.h"
+
+struct ObjFunction;
+
+// the recorder's ring is this many blocks of this size by default
+constexpr size_t recorderBlockSize = 64 * 1024;
+constexpr size_t recorderDefaultBytes = 16 * 1024 * 1024;
+
+// the longest one record can be: a marker, three varints and an opcode
+constexpr size_t recorderMaxRecord = 1 + 3 * 10 + 1;
+
+// marks a record of absolute values rather than deltas
+constexpr uint8_t recorderAbsolute = 0xFF;
+// in place of the byte of packed deltas, marks deltas too large for it, as two varints after
+constexpr uint8_t recorderWideDeltas = 0x80;
+
+// each instruction run as its function, offset, opcode and stack depth, packed
+// into a ring of blocks so that a long run keeps only its latest history.
+// a block opens with absolute values and later records are the opcode and the
+// deltas from the one before, which for straight-line code fit one byte between
+// them, so records are mostly two bytes and any block decodes on its own
+struct TraceRecorder {
+	TraceRecorder(std::string path, size_t bytes, int optimizationLevel, std::string_view source);
+
+	TraceRecorder(const TraceRecorder&) = delete;
+	TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+	void record(size_t function, size_t offset, OpCode code, size_t depth) {
+		if (static_cast<size_t>(end - cursor) < recorderMaxRecord) nextBlock();
+		recorded++;
+
+		if (function != lastFunction) {
+			*cursor++ = recorderAbsolute;
+			writeVarint(function);
+			writeVarint(offset);
+			writeVarint(depth);
+			*cursor++ = asByte(code);
+		} else {
+			*cursor++ = asByte(code);
+			auto offsetDelta = zigzag(offset - lastOffset);
+			auto depthDelta = zigzag(depth - lastDepth);
+			// the offset's in the low four bits and the depth's in the three above
+			if (offsetDelta < 16 && depthDelta < 8) {
+				*cursor++ = static_cast<uint8_t>(offsetDelta | depthDelta << 4);
+			} else {
+				*cursor++ = recorderWideDeltas;
+				writeVarint(offsetDelta);
+				writeVarint(depthDelta);
+			}
+		}
+		lastFunction = function;
+		lastOffset = offset;
+		lastDepth = depth;
+	}
+
+	// writes the ring out oldest block first; false after reporting why not
+	bool save();
+
+	private:
+	std::string path;
+	int optimizationLevel;
+	uint64_t sourceHash;
+
+	std::vector<uint8_t> buffer;
+	// bytes used in each block; the current one's is only set when it is saved or left
+	std::vector<uint32_t> used;
+	size_t block{ 0 };
+	bool wrapped{ false };
+	uint8_t* cursor;
+	uint8_t* end;
+	uint64_t recorded{ 0 };
+
+	// no function has this index, so the next record is absolute
+	static constexpr size_t restart = std::numeric_limits<size_t>::max();
+	size_t lastFunction{ restart };
+	size_t lastOffset{ 0 };
+	size_t lastDepth{ 0 };
+
+	void nextBlock();
+
+	void writeVarint(uint64_t value) {
+		while (value >= 0x80) {
+			*cursor++ = static_cast<uint8_t>(value) | 0x80;
+			value >>= 7;
+		}
+		*cursor++ = static_cast<uint8_t>(value);
+	}
+
+	// small deltas either way become small unsigned numbers
+	static uint64_t zigzag(size_t delta) {
+		auto signedDelta = static_cast<int64_t>(delta);
+		return static_cast<uint64_t>(signedDelta << 1) ^ static_cast<uint64_t>(signedDelta >> 63);
+	}
+};
+
+// has the next block boundary save the ring as well, so a long run can be
+// looked at while it goes on; SIGUSR1, or SIGBREAK on Windows
+void installRecorderSignal();
+
+// decodes a saved trace against the source it was recorded from, compiled the
+// same way again, and prints instruction counts, the hottest basic blocks and
+// how often each conditional branch was taken. false after reporting why not
+bool reportTrace(const std::string& tracePath, std::string_view source, std::ostream& out);
\ No newline at end of file
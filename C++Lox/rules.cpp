@@ -1,17 +1,20 @@
 #include "compiler.h"
 
 std::unordered_map<TokenType, ParseRule> Compiler::rules{
-	{TokenType::LeftParen,    ParseRule(&Compiler::grouping, nullptr,            Precedence::None)},
+	{TokenType::LeftParen,    ParseRule(&Compiler::grouping, &Compiler::call,    Precedence::Call)},
 	{TokenType::RightParen,   ParseRule(nullptr,             nullptr,            Precedence::None)},
-	{TokenType::LeftBrace,    ParseRule(nullptr,             nullptr,            Precedence::None)},
+	{TokenType::LeftBrace,    ParseRule(&Compiler::map,      nullptr,            Precedence::None)},
 	{TokenType::RightBrace,   ParseRule(nullptr,             nullptr,            Precedence::None)},
+	{TokenType::LeftBracket,  ParseRule(&Compiler::array,    &Compiler::index,   Precedence::Call)},
+	{TokenType::RightBracket, ParseRule(nullptr,             nullptr,            Precedence::None)},
 	{TokenType::Comma,        ParseRule(nullptr,             nullptr,            Precedence::None)},
-	{TokenType::Dot,          ParseRule(nullptr,             nullptr,            Precedence::None)},
+	{TokenType::Dot,          ParseRule(nullptr,             &Compiler::dot,     Precedence::Call)},
 	{TokenType::Minus,        ParseRule(&Compiler::unary,    &Compiler::binary,  Precedence::Sum)},
 	{TokenType::Plus,         ParseRule(nullptr,             &Compiler::binary,  Precedence::Sum)},
 	{TokenType::Slash,        ParseRule(nullptr,             &Compiler::binary,  Precedence::Product)},
 	{TokenType::Star,         ParseRule(nullptr,             &Compiler::binary,  Precedence::Product)},
 	{TokenType::Semicolon,    ParseRule(nullptr,             nullptr,            Precedence::None)},
+	{TokenType::Colon,        ParseRule(nullptr,             nullptr,            Precedence::None)},
 	{TokenType::Bang,         ParseRule(&Compiler::unary,    nullptr,            Precedence::None)},
 	{TokenType::BangEqual,    ParseRule(nullptr,             &Compiler::binary,  Precedence::Equality)},
 	{TokenType::Equal,        ParseRule(nullptr,             nullptr,            Precedence::None)},
@@ -25,8 +28,13 @@ std::unordered_map<TokenType, ParseRule> Compiler::rules{
 	{TokenType::Number,       ParseRule(&Compiler::number,   nullptr,            Precedence::None)},
 	{TokenType::And,          ParseRule(nullptr,             &Compiler::andExpr, Precedence::And)},
 	{TokenType::Or,           ParseRule(nullptr,             &Compiler::orExpr,  Precedence::Or)},
+	{TokenType::Case,         ParseRule(nullptr,             nullptr,            Precedence::None)},
 	{TokenType::Class,        ParseRule(nullptr,             nullptr,            Precedence::None)},
+	{TokenType::Const,        ParseRule(nullptr,             nullptr,            Precedence::None)},
+	{TokenType::Default,      ParseRule(nullptr,             nullptr,            Precedence::None)},
+	{TokenType::Delete,       ParseRule(&Compiler::deleteExpr, nullptr,          Precedence::None)},
 	{TokenType::If,           ParseRule(nullptr,             nullptr,            Precedence::None)},
+	{TokenType::In,           ParseRule(nullptr,             &Compiler::binary,  Precedence::Comparison)},
 	{TokenType::Else,         ParseRule(nullptr,             nullptr,            Precedence::None)},
 	{TokenType::For,          ParseRule(nullptr,             nullptr,            Precedence::None)},
 	{TokenType::While,        ParseRule(nullptr,             nullptr,            Precedence::None)},
@@ -35,10 +43,13 @@ std::unordered_map<TokenType, ParseRule> Compiler::rules{
 	{TokenType::True,         ParseRule(&Compiler::literal,  nullptr,            Precedence::None)},
 	{TokenType::Nil,          ParseRule(&Compiler::literal,  nullptr,            Precedence::None)},
 	{TokenType::Print,        ParseRule(nullptr,             nullptr,            Precedence::None)},
+	{TokenType::Resume,       ParseRule(&Compiler::resumeExpr, nullptr,          Precedence::None)},
 	{TokenType::Return,       ParseRule(nullptr,             nullptr,            Precedence::None)},
-	{TokenType::This,         ParseRule(nullptr,             nullptr,            Precedence::None)},
-	{TokenType::Super,        ParseRule(nullptr,             nullptr,            Precedence::None)},
+	{TokenType::This,         ParseRule(&Compiler::thisExpr, nullptr,            Precedence::None)},
+	{TokenType::Super,        ParseRule(&Compiler::superExpr, nullptr,           Precedence::None)},
+	{TokenType::Switch,       ParseRule(nullptr,             nullptr,            Precedence::None)},
 	{TokenType::Var,          ParseRule(nullptr,             nullptr,            Precedence::None)},
+	{TokenType::Yield,        ParseRule(&Compiler::yieldExpr, nullptr,           Precedence::None)},
 	{TokenType::Error,        ParseRule(nullptr,             nullptr,            Precedence::None)},
 	{TokenType::EOF,          ParseRule(nullptr,             nullptr,            Precedence::None)},
 };
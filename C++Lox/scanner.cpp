@@ -1,4 +1,5 @@
 #include "scanner.h"
+#include "simd.h"
 
 Token::Token(Scanner& scanner, TokenType t) : type{ t } {
 	text = scanner.str.substr(scanner.start, scanner.current - scanner.start);
@@ -6,10 +7,7 @@ Token::Token(Scanner& scanner, TokenType t) : type{ t } {
 }
 
 Token Scanner::string() {
-	while (peek() != '"' && !isAtEnd()) {
-		if (peek() == '\n') line++;
-		advance();
-	}
+	current += textKernels().find(str.data() + current, str.size() - current, '"', line);
 
 	if (isAtEnd()) return errorToken("Unterminated string literal.");
 
@@ -18,11 +16,11 @@ Token Scanner::string() {
 }
 
 Token Scanner::number() {
-	while (isDigit(peek())) advance();
+	while (current < str.size() && isDigit(str[current])) current++;
 
 	if (peek() == '.' && isDigit(peekNext())) {
 		advance();
-		while (isDigit(peek())) advance();
+		while (current < str.size() && isDigit(str[current])) current++;
 	}
 
 	return makeToken(TokenType::Number);
@@ -31,16 +29,46 @@ Token Scanner::number() {
 TokenType Scanner::identifierType() {
 	switch (str[start]) {
 		case 'a': return checkKeyword(1, "nd",    TokenType::And);
-		case 'c': return checkKeyword(1, "lass",  TokenType::Class);
+		case 'c':
+			if (current - start > 1) {
+				switch (str[start + 1]) {
+					case 'a': return checkKeyword(2, "se",  TokenType::Case);
+					case 'l': return checkKeyword(2, "ass", TokenType::Class);
+					case 'o': return checkKeyword(2, "nst", TokenType::Const);
+					default: return TokenType::Identifier;
+				}
+			} else return TokenType::Identifier;
+		case 'd':
+			if (current - start > 2 && str[start + 1] == 'e') {
+				switch (str[start + 2]) {
+					case 'f': return checkKeyword(3, "ault", TokenType::Default);
+					case 'l': return checkKeyword(3, "ete",  TokenType::Delete);
+					default: return TokenType::Identifier;
+				}
+			} else return TokenType::Identifier;
 		case 'e': return checkKeyword(1, "lse",   TokenType::Else);
-		case 'i': return checkKeyword(1, "f",     TokenType::If);
 		case 'n': return checkKeyword(1, "il",    TokenType::Nil);
 		case 'o': return checkKeyword(1, "r",     TokenType::Or);
 		case 'p': return checkKeyword(1, "rint",  TokenType::Print);
-		case 'r': return checkKeyword(1, "eturn", TokenType::Return);
-		case 's': return checkKeyword(1, "uper",  TokenType::Super);
+		case 'r':
+			if (current - start > 2 && str[start + 1] == 'e') {
+				switch (str[start + 2]) {
+					case 's': return checkKeyword(3, "ume", TokenType::Resume);
+					case 't': return checkKeyword(3, "urn", TokenType::Return);
+					default: return TokenType::Identifier;
+				}
+			} else return TokenType::Identifier;
+		case 's':
+			if (current - start > 1) {
+				switch (str[start + 1]) {
+					case 'u': return checkKeyword(2, "per",  TokenType::Super);
+					case 'w': return checkKeyword(2, "itch", TokenType::Switch);
+					default: return TokenType::Identifier;
+				}
+			} else return TokenType::Identifier;
 		case 'v': return checkKeyword(1, "ar",    TokenType::Var);
 		case 'w': return checkKeyword(1, "hile",  TokenType::While);
+		case 'y': return checkKeyword(1, "ield",  TokenType::Yield);
 		case 'f':
 			if (current - start > 1) {
 				switch (str[start + 1]) {
@@ -50,6 +78,14 @@ TokenType Scanner::identifierType() {
 					default: return TokenType::Identifier;
 				}
 			} else return TokenType::Identifier;
+		case 'i':
+			if (current - start > 1) {
+				switch (str[start + 1]) {
+					case 'f': return checkKeyword(2, "", TokenType::If);
+					case 'n': return checkKeyword(2, "", TokenType::In);
+					default: return TokenType::Identifier;
+				}
+			} else return TokenType::Identifier;
 		case 't':
 			if (current - start > 1) {
 				switch (str[start + 1]) {
@@ -68,39 +104,23 @@ TokenType Scanner::checkKeyword(size_t sstart, const std::string& rest, TokenTyp
 }
 
 void Scanner::skipWhitespace() {
-	while (true) {
-		auto c = peek();
-		switch (c) {
-			case ' ':
-			case '\r':
-			case '\t':
-				advance();
-				break;
-			case '\n':
-				line++;
-				advance();
-				break;
-			case '/':
-				if (peekNext() == '/') {
-					while (peek() != '\n' && !isAtEnd()) advance();
-				} else {
-					return;
-				}
-				break;
-			default:
-				return;
-		}
+	auto& kernels = textKernels();
+	while (!isAtEnd()) {
+		current += kernels.skipBlanks(str.data() + current, str.size() - current, line);
+		if (peek() != '/' || peekNext() != '/') return;
+		// the newline ending the comment is left for the next blank run
+		current += kernels.find(str.data() + current, str.size() - current, '\n', line);
 	}
 }
 
 char Scanner::peekNext() {
-	if (isAtEnd()) return '\0';
-	if (current == str.size()) return '\0';
+	// a mapped source has nothing readable past its last byte
+	if (current + 1 >= str.size()) return '\0';
 	return str[current + 1];
 }
 
 Token Scanner::identifier() {
-	while (isAlphaNumeric(peek())) advance();
+	while (current < str.size() && isAlphaNumeric(str[current])) current++;
 	return makeToken(identifierType());
 }
 
@@ -121,7 +141,10 @@ Token Scanner::scanToken() {
 		case ')': return makeToken(TokenType::RightParen);
 		case '{': return makeToken(TokenType::LeftBrace);
 		case '}': return makeToken(TokenType::RightBrace);
+		case '[': return makeToken(TokenType::LeftBracket);
+		case ']': return makeToken(TokenType::RightBracket);
 		case ';': return makeToken(TokenType::Semicolon);
+		case ':': return makeToken(TokenType::Colon);
 		case ',': return makeToken(TokenType::Comma);
 		case '.': return makeToken(TokenType::Dot);
 		case '+': return makeToken(TokenType::Plus);
@@ -170,3 +193,121 @@ char Scanner::peek() {
 	if (current >= str.size()) return '\0';
 	return str[current];
 }
+
+// the tokens that start in [begin, end) of a scan resumed at begin, which has to
+// be outside any token for them to be right; lines count from 1 at begin
+struct ScannedPiece {
+	std::vector<Token> tokens{};
+	// where the first token at or after end starts, so where the next piece has to resume
+	size_t resume{ 0 };
+	// set when the scan ran to the end of the source, so no piece after this one is needed
+	bool reachedEnd{ false };
+};
+
+static ScannedPiece scanPiece(std::string_view source, size_t begin, size_t end) {
+	ScannedPiece piece{};
+	Scanner scanner{ source, begin };
+	while (true) {
+		auto token = scanner.scanToken();
+		if (token.type == TokenType::EOF) {
+			piece.tokens.push_back(token);
+			piece.resume = source.size();
+			piece.reachedEnd = true;
+			return piece;
+		}
+		if (scanner.start >= end) {
+			piece.resume = scanner.start;
+			return piece;
+		}
+		piece.tokens.push_back(token);
+	}
+}
+
+// where the scan of a piece first lands on a token, to check it against the piece before
+static size_t firstToken(std::string_view source, size_t begin) {
+	Scanner scanner{ source, begin };
+	auto token = scanner.scanToken();
+	return token.type == TokenType::EOF ? source.size() : scanner.start;
+}
+
+static size_t scanPieces(std::string_view source) {
+	auto threads = size_t(std::max(1u, std::thread::hardware_concurrency()));
+	return std::min(threads, source.size() / parallelScanMinimum);
+}
+
+std::vector<Token> tokenize(std::string_view source) {
+	auto pieces = scanPieces(source);
+	if (pieces < 2) return scanPiece(source, 0, source.size()).tokens;
+
+	// pieces start just after a newline; only a string literal can span one,
+	// and the merge below rescans a piece whose start such a string covered
+	std::vector<size_t> starts{ 0 };
+	for (size_t i = 1; i < pieces; i++) {
+		auto newline = source.find('\n', std::max(starts.back(), source.size() / pieces * i));
+		if (newline == std::string_view::npos) break;
+		if (newline + 1 > starts.back()) starts.push_back(newline + 1);
+	}
+	starts.push_back(source.size());
+	auto count = starts.size() - 1;
+
+	std::vector<ScannedPiece> scanned(count);
+	std::vector<size_t> newlines(count);
+	std::vector<size_t> firsts(count);
+	auto work = [&](size_t i) {
+		auto begin = starts[i];
+		scanned[i] = scanPiece(source, begin, starts[i + 1]);
+		newlines[i] = textKernels().countNewlines(source.data() + begin, starts[i + 1] - begin);
+		firsts[i] = firstToken(source, begin);
+	};
+	std::vector<std::thread> workers{};
+	for (size_t i = 1; i < count; i++) workers.emplace_back(work, i);
+	work(0);
+	for (auto& worker : workers) worker.join();
+
+	std::vector<Token> tokens{};
+	size_t startLine = 1;
+	auto resume = firsts[0];
+	for (size_t i = 0; i < count; i++) {
+		auto begin = starts[i];
+		if (resume != firsts[i]) {
+			// a string from the piece before ran past this one's start: scan it again from where that one stopped
+			begin = resume;
+			scanned[i] = scanPiece(source, begin, std::max(begin, starts[i + 1]));
+		}
+
+		auto& piece = scanned[i];
+		auto line = startLine + textKernels().countNewlines(source.data() + starts[i], begin - starts[i]);
+		for (auto& token : piece.tokens) {
+			token.line += int(line - 1);
+			tokens.push_back(std::move(token));
+		}
+		if (piece.reachedEnd) break;
+
+		resume = piece.resume;
+		startLine += newlines[i];
+	}
+	return tokens;
+}
+
+TokenBuffer::TokenBuffer(std::string_view source) : scanner{ source } {
+	if (scanPieces(source) < 2) return;
+	tokens = tokenize(source);
+	scannedAll = true;
+}
+
+Token TokenBuffer::scanToken() {
+	if (next < tokens.size()) {
+		// the final EOF stays, to be returned again
+		if (scannedAll && next + 1 == tokens.size()) return tokens.back();
+		return std::move(tokens[next++]);
+	}
+
+	tokens.clear();
+	next = 0;
+	return scanner.scanToken();
+}
+
+const Token& TokenBuffer::peek(size_t distance) {
+	while (!scannedAll && tokens.size() <= next + distance) tokens.push_back(scanner.scanToken());
+	return tokens[std::min(next + distance, tokens.size() - 1)];
+}
@@ -5,17 +5,18 @@
 enum class TokenType {
 	LeftParen, RightParen,
 	LeftBrace, RightBrace,
+	LeftBracket, RightBracket,
 	Comma, Dot, Minus, Plus,
-	Semicolon, Slash, Star,
+	Semicolon, Colon, Slash, Star,
 	Bang, BangEqual,
 	Equal, EqualEqual,
 	Greater, GreaterEqual,
 	Less, LessEqual,
 	Identifier, String, Number,
-	And, Class, Else, False,
-	For, Fun, If, Nil, Or,
-	Print, Return, Super, This,
-	True, Var, While,
+	And, Case, Class, Const, Default, Delete, Else, False,
+	For, Fun, If, In, Nil, Or,
+	Print, Resume, Return, Super, Switch, This,
+	True, Var, While, Yield,
 	Error, EOF
 };
 
@@ -37,6 +38,8 @@ struct Scanner {
 	int line = 1;
 
 	Scanner(std::string_view source) : str{ source } { }
+	// starts mid-source, at a point outside any token
+	Scanner(std::string_view source, size_t begin) : str{ source }, start{ begin }, current{ begin } { }
 
 	Token scanToken();
 
@@ -62,4 +65,28 @@ struct Scanner {
 	TokenType checkKeyword(size_t sstart, const std::string& rest, TokenType type);
 
 	void skipWhitespace();
+};
+
+// sources at least this large are split at line starts and scanned on several threads
+constexpr size_t parallelScanMinimum = 1024 * 1024;
+
+// every token of the source up to and including EOF, with the same lines the Scanner gives
+std::vector<Token> tokenize(std::string_view source);
+
+// the tokens the compiler reads; a source large enough to scan in parallel is
+// scanned whole up front, anything smaller as the compiler asks for tokens
+struct TokenBuffer {
+	TokenBuffer(std::string_view source);
+
+	// EOF again and again once the source is used up
+	Token scanToken();
+	// `distance` tokens past the next one scanToken returns, without consuming any
+	const Token& peek(size_t distance);
+
+	private:
+	Scanner scanner;
+	// scanned but not yet returned
+	std::vector<Token> tokens{};
+	size_t next{ 0 };
+	bool scannedAll{ false };
 };
\ No newline at end of file
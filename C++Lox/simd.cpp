@@ -0,0 +1,392 @@
+#include "simd.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+// MSVC emits any intrinsic without per-function target flags
+#define SIMD_TARGET_AVX2
+#else
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+struct AddOp {
+	static double scalar(double a, double b) { return a + b; }
+#ifdef SIMD_X86
+	static __m128d sse2(__m128d a, __m128d b) { return _mm_add_pd(a, b); }
+	SIMD_TARGET_AVX2 static __m256d avx2(__m256d a, __m256d b) { return _mm256_add_pd(a, b); }
+#endif
+};
+
+struct SubtractOp {
+	static double scalar(double a, double b) { return a - b; }
+#ifdef SIMD_X86
+	static __m128d sse2(__m128d a, __m128d b) { return _mm_sub_pd(a, b); }
+	SIMD_TARGET_AVX2 static __m256d avx2(__m256d a, __m256d b) { return _mm256_sub_pd(a, b); }
+#endif
+};
+
+struct MultiplyOp {
+	static double scalar(double a, double b) { return a * b; }
+#ifdef SIMD_X86
+	static __m128d sse2(__m128d a, __m128d b) { return _mm_mul_pd(a, b); }
+	SIMD_TARGET_AVX2 static __m256d avx2(__m256d a, __m256d b) { return _mm256_mul_pd(a, b); }
+#endif
+};
+
+struct DivideOp {
+	static double scalar(double a, double b) { return a / b; }
+#ifdef SIMD_X86
+	static __m128d sse2(__m128d a, __m128d b) { return _mm_div_pd(a, b); }
+	SIMD_TARGET_AVX2 static __m256d avx2(__m256d a, __m256d b) { return _mm256_div_pd(a, b); }
+#endif
+};
+
+struct MinOp {
+	static double scalar(double a, double b) { return b < a ? b : a; }
+#ifdef SIMD_X86
+	static __m128d sse2(__m128d a, __m128d b) { return _mm_min_pd(a, b); }
+	SIMD_TARGET_AVX2 static __m256d avx2(__m256d a, __m256d b) { return _mm256_min_pd(a, b); }
+#endif
+};
+
+struct MaxOp {
+	static double scalar(double a, double b) { return b > a ? b : a; }
+#ifdef SIMD_X86
+	static __m128d sse2(__m128d a, __m128d b) { return _mm_max_pd(a, b); }
+	SIMD_TARGET_AVX2 static __m256d avx2(__m256d a, __m256d b) { return _mm256_max_pd(a, b); }
+#endif
+};
+
+#ifdef SIMD_X86
+template <typename Op> static void mapSse2(double* out, const double* a, const double* b, size_t count) {
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2) {
+		_mm_storeu_pd(out + i, Op::sse2(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+	}
+	for (; i < count; i++) out[i] = Op::scalar(a[i], b[i]);
+}
+
+template <typename Op> static double reduceSse2(const double* values, size_t count, double initial) {
+	auto acc = _mm_set1_pd(initial);
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2) acc = Op::sse2(acc, _mm_loadu_pd(values + i));
+
+	alignas(16) double lanes[2];
+	_mm_store_pd(lanes, acc);
+	auto result = Op::scalar(lanes[0], lanes[1]);
+	for (; i < count; i++) result = Op::scalar(result, values[i]);
+	return result;
+}
+
+static double sumSse2(const double* values, size_t count) {
+	return reduceSse2<AddOp>(values, count, 0.0);
+}
+
+static double minSse2(const double* values, size_t count) {
+	return reduceSse2<MinOp>(values, count, values[0]);
+}
+
+static double maxSse2(const double* values, size_t count) {
+	return reduceSse2<MaxOp>(values, count, values[0]);
+}
+
+static double dotSse2(const double* a, const double* b, size_t count) {
+	auto acc = _mm_setzero_pd();
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2) acc = _mm_add_pd(acc, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+
+	alignas(16) double lanes[2];
+	_mm_store_pd(lanes, acc);
+	auto result = lanes[0] + lanes[1];
+	for (; i < count; i++) result += a[i] * b[i];
+	return result;
+}
+
+static void fillSse2(double* out, double value, size_t count) {
+	auto splat = _mm_set1_pd(value);
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2) _mm_storeu_pd(out + i, splat);
+	for (; i < count; i++) out[i] = value;
+}
+
+template <typename Op> SIMD_TARGET_AVX2 static void mapAvx2(double* out, const double* a, const double* b, size_t count) {
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		_mm256_storeu_pd(out + i, Op::avx2(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+	}
+	for (; i < count; i++) out[i] = Op::scalar(a[i], b[i]);
+}
+
+template <typename Op> SIMD_TARGET_AVX2 static double reduceAvx2(const double* values, size_t count, double initial) {
+	// two accumulators hide the latency of the dependent vector op
+	auto acc0 = _mm256_set1_pd(initial);
+	auto acc1 = acc0;
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		acc0 = Op::avx2(acc0, _mm256_loadu_pd(values + i));
+		acc1 = Op::avx2(acc1, _mm256_loadu_pd(values + i + 4));
+	}
+	acc0 = Op::avx2(acc0, acc1);
+
+	alignas(32) double lanes[4];
+	_mm256_store_pd(lanes, acc0);
+	auto result = Op::scalar(Op::scalar(lanes[0], lanes[1]), Op::scalar(lanes[2], lanes[3]));
+	for (; i < count; i++) result = Op::scalar(result, values[i]);
+	return result;
+}
+
+SIMD_TARGET_AVX2 static double sumAvx2(const double* values, size_t count) {
+	return reduceAvx2<AddOp>(values, count, 0.0);
+}
+
+SIMD_TARGET_AVX2 static double minAvx2(const double* values, size_t count) {
+	return reduceAvx2<MinOp>(values, count, values[0]);
+}
+
+SIMD_TARGET_AVX2 static double maxAvx2(const double* values, size_t count) {
+	return reduceAvx2<MaxOp>(values, count, values[0]);
+}
+
+SIMD_TARGET_AVX2 static double dotAvx2(const double* a, const double* b, size_t count) {
+	auto acc0 = _mm256_setzero_pd();
+	auto acc1 = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+		acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+	}
+	acc0 = _mm256_add_pd(acc0, acc1);
+
+	alignas(32) double lanes[4];
+	_mm256_store_pd(lanes, acc0);
+	auto result = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	for (; i < count; i++) result += a[i] * b[i];
+	return result;
+}
+
+SIMD_TARGET_AVX2 static void fillAvx2(double* out, double value, size_t count) {
+	auto splat = _mm256_set1_pd(value);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) _mm256_storeu_pd(out + i, splat);
+	for (; i < count; i++) out[i] = value;
+}
+
+static bool cpuHasAvx2() {
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) return false;
+
+	__cpuid(info, 1);
+	auto osxsave = (info[2] & (1 << 27)) != 0;
+	auto avx = (info[2] & (1 << 28)) != 0;
+	// the OS must also save the upper halves of the ymm registers
+	if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6) return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#else
+template <typename Op> static void mapScalar(double* out, const double* a, const double* b, size_t count) {
+	for (size_t i = 0; i < count; i++) out[i] = Op::scalar(a[i], b[i]);
+}
+
+template <typename Op> static double reduceScalar(const double* values, size_t count, double initial) {
+	auto acc = initial;
+	for (size_t i = 0; i < count; i++) acc = Op::scalar(acc, values[i]);
+	return acc;
+}
+
+static double sumScalar(const double* values, size_t count) {
+	return reduceScalar<AddOp>(values, count, 0.0);
+}
+
+static double minScalar(const double* values, size_t count) {
+	return reduceScalar<MinOp>(values, count, values[0]);
+}
+
+static double maxScalar(const double* values, size_t count) {
+	return reduceScalar<MaxOp>(values, count, values[0]);
+}
+
+static double dotScalar(const double* a, const double* b, size_t count) {
+	auto acc = 0.0;
+	for (size_t i = 0; i < count; i++) acc += a[i] * b[i];
+	return acc;
+}
+
+static void fillScalar(double* out, double value, size_t count) {
+	for (size_t i = 0; i < count; i++) out[i] = value;
+}
+#endif
+
+static bool isBlank(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// scalar versions, also used for the tail shorter than one vector
+static size_t skipBlanksScalar(const char* text, size_t size, int& lines) {
+	size_t i = 0;
+	for (; i < size && isBlank(text[i]); i++) lines += text[i] == '\n';
+	return i;
+}
+
+static size_t findScalar(const char* text, size_t size, char byte, int& lines) {
+	size_t i = 0;
+	for (; i < size && text[i] != byte; i++) lines += text[i] == '\n';
+	return i;
+}
+
+static size_t countNewlinesScalar(const char* text, size_t size) {
+	return size_t(std::count(text, text + size, '\n'));
+}
+
+// bit i of a mask is set when byte i of the vector matched
+static int newlinesBefore(uint32_t newlines, int index) {
+	return std::popcount(newlines & ((uint32_t(1) << index) - 1));
+}
+
+#ifdef SIMD_X86
+static uint32_t matchSse2(__m128i bytes, char c) {
+	return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(c))));
+}
+
+static size_t skipBlanksSse2(const char* text, size_t size, int& lines) {
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+		auto newlines = matchSse2(bytes, '\n');
+		auto blanks = newlines | matchSse2(bytes, ' ') | matchSse2(bytes, '\t') | matchSse2(bytes, '\r');
+		if (blanks != 0xFFFF) {
+			auto index = std::countr_one(blanks);
+			lines += newlinesBefore(newlines, index);
+			return i + index;
+		}
+		lines += std::popcount(newlines);
+	}
+	return i + skipBlanksScalar(text + i, size - i, lines);
+}
+
+static size_t findSse2(const char* text, size_t size, char byte, int& lines) {
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+		auto newlines = matchSse2(bytes, '\n');
+		auto found = matchSse2(bytes, byte);
+		if (found) {
+			auto index = std::countr_zero(found);
+			lines += newlinesBefore(newlines, index);
+			return i + index;
+		}
+		lines += std::popcount(newlines);
+	}
+	return i + findScalar(text + i, size - i, byte, lines);
+}
+
+static size_t countNewlinesSse2(const char* text, size_t size) {
+	size_t count = 0;
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		count += std::popcount(matchSse2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i)), '\n'));
+	}
+	return count + countNewlinesScalar(text + i, size - i);
+}
+
+SIMD_TARGET_AVX2 static uint32_t matchAvx2(__m256i bytes, char c) {
+	return uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(c))));
+}
+
+SIMD_TARGET_AVX2 static size_t skipBlanksAvx2(const char* text, size_t size, int& lines) {
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		auto bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i));
+		auto newlines = matchAvx2(bytes, '\n');
+		auto blanks = newlines | matchAvx2(bytes, ' ') | matchAvx2(bytes, '\t') | matchAvx2(bytes, '\r');
+		if (blanks != 0xFFFFFFFF) {
+			auto index = std::countr_one(blanks);
+			lines += newlinesBefore(newlines, index);
+			return i + index;
+		}
+		lines += std::popcount(newlines);
+	}
+	return i + skipBlanksScalar(text + i, size - i, lines);
+}
+
+SIMD_TARGET_AVX2 static size_t findAvx2(const char* text, size_t size, char byte, int& lines) {
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		auto bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i));
+		auto newlines = matchAvx2(bytes, '\n');
+		auto found = matchAvx2(bytes, byte);
+		if (found) {
+			auto index = std::countr_zero(found);
+			lines += newlinesBefore(newlines, index);
+			return i + index;
+		}
+		lines += std::popcount(newlines);
+	}
+	return i + findScalar(text + i, size - i, byte, lines);
+}
+
+SIMD_TARGET_AVX2 static size_t countNewlinesAvx2(const char* text, size_t size) {
+	size_t count = 0;
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		count += std::popcount(matchAvx2(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i)), '\n'));
+	}
+	return count + countNewlinesScalar(text + i, size - i);
+}
+#endif
+
+static TextKernels selectTextKernels() {
+#ifdef SIMD_X86
+	if (cpuHasAvx2()) return TextKernels{ "avx2", skipBlanksAvx2, findAvx2, countNewlinesAvx2 };
+	return TextKernels{ "sse2", skipBlanksSse2, findSse2, countNewlinesSse2 };
+#else
+	return TextKernels{ "scalar", skipBlanksScalar, findScalar, countNewlinesScalar };
+#endif
+}
+
+static ArrayKernels selectKernels() {
+#ifdef SIMD_X86
+	if (cpuHasAvx2()) {
+		return ArrayKernels{
+			"avx2",
+			mapAvx2<AddOp>, mapAvx2<SubtractOp>, mapAvx2<MultiplyOp>, mapAvx2<DivideOp>,
+			sumAvx2, minAvx2, maxAvx2, dotAvx2,
+			fillAvx2,
+		};
+	}
+
+	// every x86 target we build for has SSE2
+	return ArrayKernels{
+		"sse2",
+		mapSse2<AddOp>, mapSse2<SubtractOp>, mapSse2<MultiplyOp>, mapSse2<DivideOp>,
+		sumSse2, minSse2, maxSse2, dotSse2,
+		fillSse2,
+	};
+#else
+	return ArrayKernels{
+		"scalar",
+		mapScalar<AddOp>, mapScalar<SubtractOp>, mapScalar<MultiplyOp>, mapScalar<DivideOp>,
+		sumScalar, minScalar, maxScalar, dotScalar,
+		fillScalar,
+	};
+#endif
+}
+
+const ArrayKernels& arrayKernels() {
+	static const ArrayKernels kernels = selectKernels();
+	return kernels;
+}
+
+const TextKernels& textKernels() {
+	static const TextKernels kernels = selectTextKernels();
+	return kernels;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "common.h"
+
+// bulk kernels over packed doubles, picked once per process from the best
+// instruction set the CPU supports (AVX2, then SSE2, then plain loops)
+struct ArrayKernels {
+	const char* name;
+
+	void (*add)(double* out, const double* a, const double* b, size_t count);
+	void (*subtract)(double* out, const double* a, const double* b, size_t count);
+	void (*multiply)(double* out, const double* a, const double* b, size_t count);
+	void (*divide)(double* out, const double* a, const double* b, size_t count);
+
+	double (*sum)(const double* values, size_t count);
+	// min and max expect count > 0
+	double (*min)(const double* values, size_t count);
+	double (*max)(const double* values, size_t count);
+	double (*dot)(const double* a, const double* b, size_t count);
+
+	void (*fill)(double* out, double value, size_t count);
+};
+
+const ArrayKernels& arrayKernels();
+
+// byte scans for the scanner, picked the same way; each adds the newlines it
+// passes over to `lines` so that token lines stay exact
+struct TextKernels {
+	const char* name;
+
+	// length of the run of ' ', '\t', '\r' and '\n' that text starts with
+	size_t (*skipBlanks)(const char* text, size_t size, int& lines);
+	// offset of the first `byte`, or size when there is none
+	size_t (*find)(const char* text, size_t size, char byte, int& lines);
+	size_t (*countNewlines)(const char* text, size_t size);
+};
+
+const TextKernels& textKernels();
\ No newline at end of file
@@ -14,19 +14,17 @@ std::optional<bool> Value::asBool() {
 	return std::nullopt;
 }
 
-bool Value::isNumber() {
-	return type == ValueType::Number;
-}
-
-double Value::asNumberUnsafe() {
-	return std::get<double>(contents);
-}
-
 std::optional<double> Value::asNumber() {
 	if (isNumber()) return asNumberUnsafe();
 	return std::nullopt;
 }
 
+Value Value::number(double number) {
+	auto integral = number == std::floor(number) && !(number == 0 && std::signbit(number));
+	if (!integral || number < std::numeric_limits<int32_t>::min() || number > std::numeric_limits<int32_t>::max()) return Value{ number };
+	return integer(static_cast<int64_t>(number));
+}
+
 bool Value::isObj() {
 	return type == ValueType::Obj;
 }
@@ -35,6 +33,10 @@ std::shared_ptr<Obj> Value::asObjUnsafe() {
 	return std::get<std::shared_ptr<Obj>>(contents);
 }
 
+Obj* Value::asObjRawUnsafe() {
+	return std::get<std::shared_ptr<Obj>>(contents).get();
+}
+
 std::optional<std::shared_ptr<Obj>> Value::asObj() {
 	if (isObj()) return asObjUnsafe();
 	return std::nullopt;
@@ -67,7 +69,14 @@ std::string Value::stringify() {
 		case ValueType::Nil:
 			return "nil";
 		case ValueType::Number:
-			return read_cast<std::string>(asNumberUnsafe());
+		{
+			// the stream's six significant digits show integers below a million exactly
+			auto number = asNumberUnsafe();
+			if (number == std::floor(number) && std::abs(number) < 1e6 && !(number == 0 && std::signbit(number))) {
+				return std::to_string(static_cast<int32_t>(number));
+			}
+			return read_cast<std::string>(number);
+		}
 		case ValueType::Obj:
 			return asObjUnsafe()->stringify();
 		default:
@@ -102,6 +111,20 @@ bool operator==(Obj& a, Obj& b) {
 	switch (a.type) {
 		case ObjType::String:
 			return a.asStringUnsafe() == b.asStringUnsafe();
+		case ObjType::Function:
+		case ObjType::Native:
+		case ObjType::Closure:
+		case ObjType::Upvalue:
+		case ObjType::Class:
+		case ObjType::Instance:
+		case ObjType::BoundMethod:
+		case ObjType::Array:
+		case ObjType::Map:
+		case ObjType::Fiber:
+			return &a == &b;
+		// each isolate that receives a channel gets its own handle on it
+		case ObjType::Channel:
+			return static_cast<ObjChannel&>(a).channel == static_cast<ObjChannel&>(b).channel;
 		default:
 			unreachable();
 			return false;
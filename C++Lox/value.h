@@ -13,7 +13,9 @@ enum class ValueType : size_t {
 
 struct Value {
 	private:
-	std::variant<bool, double, std::shared_ptr<Obj>> contents;
+	// integral numbers that fit are kept as int32, so that arithmetic on them can skip
+	// floating point; they are still of type Number, and asNumberUnsafe() widens them
+	std::variant<bool, double, std::shared_ptr<Obj>, int32_t> contents;
 
 	public:
 	ValueType type;
@@ -27,13 +29,23 @@ struct Value {
 	bool asBoolUnsafe();
 	std::optional<bool> asBool();
 
+	// these and the integer accessors are defined below, so that the run loop's number fast paths inline them
 	bool isNumber();
 	double asNumberUnsafe();
 	std::optional<double> asNumber();
 
+	// an int32 when the number is integral, in range and not -0, for constants
+	static Value number(double number);
+	// an int32 when it fits, otherwise the double nearest it
+	static Value integer(int64_t integer);
+	bool isInteger();
+	int32_t asIntegerUnsafe();
+
 	bool isObj();
 	std::shared_ptr<Obj> asObjUnsafe();
 	std::optional<std::shared_ptr<Obj>> asObj();
+	// borrows the object without touching its reference count
+	Obj* asObjRawUnsafe();
 
 	bool isNil();
 
@@ -43,4 +55,31 @@ struct Value {
 	void print();
 };
 
-bool operator==(Value a, Value b);
\ No newline at end of file
+bool operator==(Value a, Value b);
+
+inline bool Value::isNumber() {
+	return type == ValueType::Number;
+}
+
+inline double Value::asNumberUnsafe() {
+	if (auto integer = std::get_if<int32_t>(&contents)) return *integer;
+	return *std::get_if<double>(&contents);
+}
+
+inline bool Value::isInteger() {
+	return std::holds_alternative<int32_t>(contents);
+}
+
+inline int32_t Value::asIntegerUnsafe() {
+	return *std::get_if<int32_t>(&contents);
+}
+
+inline Value Value::integer(int64_t integer) {
+	if (integer < std::numeric_limits<int32_t>::min() || integer > std::numeric_limits<int32_t>::max()) {
+		return Value{ static_cast<double>(integer) };
+	}
+	Value value{};
+	value.type = ValueType::Number;
+	value.contents = static_cast<int32_t>(integer);
+	return value;
+}
\ No newline at end of file
@@ -0,0 +1,395 @@
+#include "verifier.h"
+#include "object.h"
+
+StackEffect stackEffect(const Chunk& chunk, size_t offset) {
+	auto operand = [&] (size_t index) { return static_cast<size_t>(chunk.code[offset + index]); };
+
+	switch (asOpCode(chunk.code[offset])) {
+		case OpCode::Constant:
+		case OpCode::Nil:
+		case OpCode::True:
+		case OpCode::False:
+		case OpCode::GetGlobal:
+		case OpCode::GetLocal:
+		case OpCode::GetUpvalue:
+		case OpCode::Closure:
+		case OpCode::Class:
+			return { 0, 1 };
+		case OpCode::Jump:
+		case OpCode::JumpBack:
+		case OpCode::ForPrep:
+		case OpCode::ForLoop:
+			return { 0, 0 };
+		case OpCode::Return:
+		case OpCode::Drop:
+		case OpCode::Print:
+		case OpCode::DefineGlobal:
+		case OpCode::DefineConstant:
+		case OpCode::CloseUpvalue:
+		case OpCode::TableSwitch:
+		case OpCode::LookupSwitch:
+			return { 1, 0 };
+		// these only peek at the value they test or store
+		case OpCode::Not:
+		case OpCode::Negate:
+		case OpCode::NegateNumberUnchecked:
+		case OpCode::SetGlobal:
+		case OpCode::SetLocal:
+		case OpCode::SetUpvalue:
+		case OpCode::ConditionalJump:
+		case OpCode::JumpBackIfTrue:
+		case OpCode::GetProperty:
+		case OpCode::Yield:
+			return { 1, 1 };
+		case OpCode::Add:
+		case OpCode::Subtract:
+		case OpCode::Multiply:
+		case OpCode::Divide:
+		case OpCode::Equal:
+		case OpCode::Less:
+		case OpCode::Greater:
+		case OpCode::AddNumber:
+		case OpCode::AddString:
+		case OpCode::SubtractNumber:
+		case OpCode::MultiplyNumber:
+		case OpCode::DivideNumber:
+		case OpCode::LessNumber:
+		case OpCode::GreaterNumber:
+		case OpCode::AddNumberUnchecked:
+		case OpCode::SubtractNumberUnchecked:
+		case OpCode::MultiplyNumberUnchecked:
+		case OpCode::DivideNumberUnchecked:
+		case OpCode::LessNumberUnchecked:
+		case OpCode::GreaterNumberUnchecked:
+		case OpCode::GetIndex:
+		case OpCode::HasKey:
+		case OpCode::DeleteKey:
+		case OpCode::Inherit:
+		case OpCode::Method:
+		case OpCode::SetProperty:
+		case OpCode::GetSuper:
+		case OpCode::Resume:
+			return { 2, 1 };
+		case OpCode::SetIndex:
+			return { 3, 1 };
+		case OpCode::Call:
+			return { operand(1) + 1, 1 };
+		case OpCode::Invoke:
+			return { operand(2) + 1, 1 };
+		// the superclass as well as the receiver
+		case OpCode::SuperInvoke:
+			return { operand(2) + 2, 1 };
+		case OpCode::Array:
+			return { operand(1), 1 };
+		case OpCode::Map:
+			return { operand(1) * 2, 1 };
+		case OpCode::OPCODE_LEN:
+			break;
+	}
+	unreachable();
+	return { 0, 0 };
+}
+
+static bool isConstant(const Chunk& chunk, size_t index, bool (Obj::* is)()) {
+	if (index >= chunk.constants.size()) return false;
+	auto constant = chunk.constants[index];
+	return constant.isObj() && (constant.asObjRawUnsafe()->*is)();
+}
+
+static bool isNumberConstant(const Chunk& chunk, size_t index) {
+	return index < chunk.constants.size() && Value{ chunk.constants[index] }.isNumber();
+}
+
+// where a jump goes, or nullopt when it would leave the code
+static std::optional<size_t> jumpDestination(const Chunk& chunk, size_t offset) {
+	auto end = offset + instructionLength(chunk, offset);
+	auto distance = static_cast<size_t>((chunk.code[end - 2] << 8) | chunk.code[end - 1]);
+	if (isBackwardJump(asOpCode(chunk.code[offset]))) {
+		if (distance > end) return std::nullopt;
+		return end - distance;
+	}
+	if (end + distance >= chunk.code.size()) return std::nullopt;
+	return end + distance;
+}
+
+static std::vector<size_t> switchTargets(const SwitchTable& table) {
+	std::vector<size_t> targets{ table.defaultTarget };
+	targets.insert(targets.end(), table.dense.begin(), table.dense.end());
+	for (auto& [label, target] : table.numbers) targets.push_back(target);
+	for (auto& [label, target] : table.strings) targets.push_back(target);
+	return targets;
+}
+
+std::optional<std::string> checkInstruction(const ObjFunction& function, size_t offset, std::optional<size_t> height) {
+	auto& chunk = function.chunk;
+	auto& code = chunk.code;
+	if (offset >= code.size()) return "runs off the end of the code";
+	if (!validOpCode(code[offset])) return "unknown opcode " + std::to_string(code[offset]);
+
+	auto instruction = asOpCode(code[offset]);
+	// a closure's length depends on its function, so that is checked first
+	if (instruction == OpCode::Closure && (offset + 1 >= code.size() || !isConstant(chunk, code[offset + 1], &Obj::isFunction))) {
+		return "closure over a constant that isn't a function";
+	}
+	if (offset + instructionLength(chunk, offset) > code.size()) return "operands run off the end of the code";
+
+	auto operand = [&] (size_t index) { return static_cast<size_t>(code[offset + index]); };
+	auto wide = [&] (size_t index) { return operand(index) << 8 | operand(index + 1); };
+	auto local = [&] (size_t slot) { return !height || slot < height.value(); };
+
+	switch (instruction) {
+		case OpCode::Constant:
+			if (operand(1) >= chunk.constants.size()) return "constant out of range";
+			break;
+		case OpCode::DefineGlobal:
+		case OpCode::DefineConstant:
+		case OpCode::GetGlobal:
+		case OpCode::SetGlobal:
+		case OpCode::Class:
+		case OpCode::Method:
+		case OpCode::GetSuper:
+		case OpCode::SuperInvoke:
+			if (!isConstant(chunk, operand(1), &Obj::isString)) return "name isn't a string constant";
+			break;
+		case OpCode::GetProperty:
+		case OpCode::SetProperty:
+			if (!isConstant(chunk, operand(1), &Obj::isString)) return "name isn't a string constant";
+			if (wide(2) >= chunk.caches.size()) return "inline cache out of range";
+			break;
+		case OpCode::Invoke:
+			if (!isConstant(chunk, operand(1), &Obj::isString)) return "name isn't a string constant";
+			if (wide(3) >= chunk.caches.size()) return "inline cache out of range";
+			break;
+		case OpCode::GetLocal:
+		case OpCode::SetLocal:
+			if (!local(operand(1))) return "local slot out of range";
+			break;
+		case OpCode::GetUpvalue:
+		case OpCode::SetUpvalue:
+			if (operand(1) >= function.upvalueCount) return "upvalue out of range";
+			break;
+		case OpCode::Closure:
+		{
+			auto constant = chunk.constants[operand(1)];
+			auto& captured = *static_cast<ObjFunction*>(constant.asObjRawUnsafe());
+			for (size_t i = 0; i < captured.upvalueCount; i++) {
+				auto isLocal = operand(2 + i * 2);
+				auto index = operand(3 + i * 2);
+				if (isLocal > 1) return "upvalue neither local nor enclosing";
+				// a local function that calls itself captures the slot this closure is pushed into
+				auto capturable = !height || index <= height.value();
+				if (isLocal ? !capturable : index >= function.upvalueCount) return "captured variable out of range";
+			}
+			break;
+		}
+		case OpCode::ConditionalJump:
+		case OpCode::Jump:
+		case OpCode::JumpBack:
+		case OpCode::JumpBackIfTrue:
+			if (!jumpDestination(chunk, offset)) return "jump leaves the code";
+			break;
+		case OpCode::TableSwitch:
+		case OpCode::LookupSwitch:
+		{
+			if (wide(1) >= chunk.switches.size()) return "switch table out of range";
+			for (auto target : switchTargets(chunk.switches[wide(1)])) {
+				if (target >= code.size()) return "switch target leaves the code";
+			}
+			break;
+		}
+		case OpCode::ForPrep:
+		case OpCode::ForLoop:
+		{
+			if (!local(operand(1))) return "loop variable out of range";
+			auto index = operand(3);
+			switch (operand(2)) {
+				case size_t(ForLimit::Constant):
+					if (!isNumberConstant(chunk, index)) return "loop bound isn't a number constant";
+					break;
+				case size_t(ForLimit::Local):
+					if (!local(index)) return "loop bound out of range";
+					break;
+				case size_t(ForLimit::Global):
+					if (!isConstant(chunk, index, &Obj::isString)) return "loop bound name isn't a string constant";
+					break;
+				default:
+					return "unknown loop bound kind";
+			}
+			if (operand(4) > size_t(ForCompare::GreaterEqual)) return "unknown loop comparison";
+			if (instruction == OpCode::ForLoop && !isNumberConstant(chunk, operand(5))) return "loop step isn't a number constant";
+			if (!jumpDestination(chunk, offset)) return "jump leaves the code";
+			break;
+		}
+		default:
+			break;
+	}
+
+	if (height && stackEffect(chunk, offset).pops > height.value()) return "pops more values than the frame holds";
+	return std::nullopt;
+}
+
+// what's known of each value above the frame's base, ordered so that where paths
+// meet the lesser holds. a captured local can change through its upvalue at any
+// call, so it's never known to be a number while captured
+enum class SlotType : uint8_t {
+	Captured,
+	Unknown,
+	Number,
+};
+
+// the type of the value the instruction at offset leaves on top, for those that leave one
+static SlotType resultType(const Chunk& chunk, size_t offset, const std::vector<SlotType>& slots) {
+	auto readable = [] (SlotType type) { return type == SlotType::Number ? SlotType::Number : SlotType::Unknown; };
+	switch (asOpCode(chunk.code[offset])) {
+		case OpCode::Constant:
+			return isNumberConstant(chunk, chunk.code[offset + 1]) ? SlotType::Number : SlotType::Unknown;
+		case OpCode::GetLocal:
+			return readable(slots[chunk.code[offset + 1]]);
+		// these leave the value they looked at
+		case OpCode::SetGlobal:
+		case OpCode::SetLocal:
+		case OpCode::SetUpvalue:
+		case OpCode::ConditionalJump:
+		case OpCode::JumpBackIfTrue:
+			return readable(slots.back());
+		// anything else these leave is a runtime error
+		case OpCode::Negate:
+		case OpCode::Subtract:
+		case OpCode::Multiply:
+		case OpCode::Divide:
+		case OpCode::AddNumber:
+		case OpCode::SubtractNumber:
+		case OpCode::MultiplyNumber:
+		case OpCode::DivideNumber:
+		case OpCode::AddNumberUnchecked:
+		case OpCode::SubtractNumberUnchecked:
+		case OpCode::MultiplyNumberUnchecked:
+		case OpCode::DivideNumberUnchecked:
+		case OpCode::NegateNumberUnchecked:
+			return SlotType::Number;
+		default:
+			return SlotType::Unknown;
+	}
+}
+
+// the slots after the instruction at offset, which has been checked against their height
+static std::vector<SlotType> slotsAfter(const Chunk& chunk, size_t offset, std::vector<SlotType> slots) {
+	auto operand = [&] (size_t index) { return static_cast<size_t>(chunk.code[offset + index]); };
+	auto effect = stackEffect(chunk, offset);
+	auto result = effect.pushes ? resultType(chunk, offset, slots) : SlotType::Unknown;
+	slots.resize(slots.size() - effect.pops);
+	if (effect.pushes) slots.push_back(result);
+
+	switch (asOpCode(chunk.code[offset])) {
+		case OpCode::SetLocal:
+			if (slots[operand(1)] != SlotType::Captured) slots[operand(1)] = result;
+			break;
+		// both go on only with a number in the loop variable
+		case OpCode::ForPrep:
+		case OpCode::ForLoop:
+			if (slots[operand(1)] != SlotType::Captured) slots[operand(1)] = SlotType::Number;
+			break;
+		case OpCode::Closure:
+		{
+			auto constant = chunk.constants[operand(1)];
+			auto& captured = *static_cast<ObjFunction*>(constant.asObjRawUnsafe());
+			for (size_t i = 0; i < captured.upvalueCount; i++) {
+				if (operand(2 + i * 2)) slots[operand(3 + i * 2)] = SlotType::Captured;
+			}
+			break;
+		}
+		default:
+			break;
+	}
+	return slots;
+}
+
+std::optional<std::string> verify(const ObjFunction& function) {
+	auto& chunk = function.chunk;
+	auto size = chunk.code.size();
+	auto at = [] (size_t offset, const std::string& error) {
+		return "offset " + std::to_string(offset) + ": " + error;
+	};
+
+	// decoding from the start finds every instruction, reachable or not
+	std::vector<bool> starts(size);
+	for (size_t offset = 0; offset < size; offset += instructionLength(chunk, offset)) {
+		if (auto error = checkInstruction(function, offset, std::nullopt)) return at(offset, error.value());
+		starts[offset] = true;
+	}
+	if (size == 0) return at(0, "runs off the end of the code");
+
+	// then the values on the stack flow along every edge from the entry, where
+	// the frame holds the callee and its arguments. the height must agree where
+	// paths meet, and what's known of each value is what all of them agree on,
+	// so an instruction is looked at again each time that drops
+	std::vector<std::optional<std::vector<SlotType>>> stacks(size);
+	std::vector<size_t> pending{ 0 };
+	stacks[0] = std::vector<SlotType>(static_cast<size_t>(function.arity) + 1, SlotType::Unknown);
+
+	while (!pending.empty()) {
+		auto offset = pending.back();
+		pending.pop_back();
+		auto& slots = stacks[offset].value();
+		if (auto error = checkInstruction(function, offset, slots.size())) return at(offset, error.value());
+
+		auto instruction = asOpCode(chunk.code[offset]);
+		if (isUncheckedNumberOp(instruction)) {
+			auto operands = instruction == OpCode::NegateNumberUnchecked ? 1 : 2;
+			for (size_t i = 1; i <= operands; i++) {
+				if (slots[slots.size() - i] != SlotType::Number) return at(offset, "unchecked operand not known to be a number");
+			}
+		}
+
+		auto after = slotsAfter(chunk, offset, slots);
+		std::optional<std::string> error{};
+		auto reach = [&] (size_t target) {
+			if (error) return;
+			if (target >= size) {
+				error = "runs off the end of the code";
+			} else if (!starts[target]) {
+				error = "jumps into the middle of an instruction";
+			} else if (!stacks[target]) {
+				stacks[target] = after;
+				pending.push_back(target);
+			} else if (stacks[target]->size() != after.size()) {
+				error = "reaches offset " + std::to_string(target) + " with a different stack height";
+			} else {
+				auto& known = stacks[target].value();
+				auto changed = false;
+				for (size_t i = 0; i < known.size(); i++) {
+					if (after[i] >= known[i]) continue;
+					known[i] = after[i];
+					changed = true;
+				}
+				if (changed) pending.push_back(target);
+			}
+		};
+
+		auto next = offset + instructionLength(chunk, offset);
+		switch (instruction) {
+			case OpCode::Return:
+				break;
+			case OpCode::Jump:
+			case OpCode::JumpBack:
+				reach(jumpDestination(chunk, offset).value());
+				break;
+			case OpCode::ConditionalJump:
+			case OpCode::JumpBackIfTrue:
+			case OpCode::ForPrep:
+			case OpCode::ForLoop:
+				reach(next);
+				reach(jumpDestination(chunk, offset).value());
+				break;
+			case OpCode::TableSwitch:
+			case OpCode::LookupSwitch:
+				for (auto target : switchTargets(chunk.switches[chunk.code[offset + 1] << 8 | chunk.code[offset + 2]])) reach(target);
+				break;
+			default:
+				reach(next);
+				break;
+		}
+		if (error) return at(offset, error.value());
+	}
+	return std::nullopt;
+}
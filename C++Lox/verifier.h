@@ -0,0 +1,25 @@
+#pragma once
+
+#include "common.h"
+#include "chunk.h"
+
+struct ObjFunction;
+
+// values an instruction takes off the stack and puts back
+struct StackEffect {
+	size_t pops;
+	size_t pushes;
+};
+
+// expects the instruction's operands to be in range
+StackEffect stackEffect(const Chunk& chunk, size_t offset);
+
+// checks one instruction by itself: a known opcode, operands inside the code and
+// the chunk's tables, and jumps landing inside the code. given the values above the
+// frame's base, also that its locals exist and it pops no more than are there
+std::optional<std::string> checkInstruction(const ObjFunction& function, size_t offset, std::optional<size_t> height);
+
+// checks every instruction, that jumps land on instruction boundaries, that
+// each reachable instruction starts at the same stack height along every path to
+// it, and that the unchecked number opcodes are only ever handed numbers
+std::optional<std::string> verify(const ObjFunction& function);
\ No newline at end of file
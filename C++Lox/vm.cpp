@@ -3,6 +3,10 @@
 #include "debug.h"
 #include "compiler.h"
 #include "object.h"
+#include "natives.h"
+#include "isolate.h"
+#include "verifier.h"
+#include "recorder.h"
 
 #define ReturnIfError(value) do {\
   auto result = value;\
@@ -11,30 +15,441 @@
 	}\
 } while (false)
 
+// a place where the budget may run out: one decrement unless a check is due.
+// only the VM's own structures hold objects here, so the nursery is swept here too
+#define Checkpoint() do {\
+	if (--stepsUntilCheck == 0) ReturnIfError(checkBudget());\
+	if (nursery.size() >= nurseryCapacity || nurseryBytes >= nurseryByteCapacity) scavenge();\
+} while (false)
+
 void VM::runtimeError(const std::string & format, ...) {
 	auto str = format.c_str();
 	va_list args;
 	va_start(args, str);
-	vfprintf(stderr, str, args);
+	va_list measuring;
+	va_copy(measuring, args);
+	std::vector<char> message(vsnprintf(nullptr, 0, str, measuring) + 1);
+	va_end(measuring);
+	vsnprintf(message.data(), message.size(), str, args);
 	va_end(args);
-	std::cerr << std::endl;
+	std::cerr << message.data() << std::endl;
+
+#ifdef LOX_PROBES
+	// only worth looking up when there's a probe to hand it to
+	auto line = 0;
+	if (!frames.empty()) {
+		auto& current = frame();
+		line = current.function->chunk.lines[current.ip == 0 ? 0 : current.ip - 1];
+	}
+	PROBE2(runtime__error, message.data(), line);
+#endif
 
-	std::cerr << "[line " << chunk.lines[ip] << "] in script" << std::endl;
+	for (auto it = frames.rbegin(); it != frames.rend(); it++) {
+		auto& function = *it->function;
+		// a frame stopped at a call checkpoint hasn't run its first instruction yet
+		auto instruction = it->ip == 0 ? 0 : it->ip - 1;
+		std::cerr << "[line " << function.chunk.lines[instruction] << "] in ";
+		if (function.name.empty()) {
+			std::cerr << "script" << std::endl;
+		} else {
+			std::cerr << function.name << "()" << std::endl;
+		}
+	}
+	resetStack();
+}
+
+// an error ends the script, and with it the fibers waiting on the one that
+// failed and those queued to run; the next script starts on the root fiber
+void VM::resetStack() {
 	stack.clear();
+	frames.clear();
+	openUpvalues.clear();
+
+	auto end = [&] (ObjFiber* ended) {
+		ended->stack.clear();
+		ended->frames.clear();
+		ended->openUpvalues.clear();
+		ended->state = ended == rootFiber.get() ? FiberState::Running : FiberState::Done;
+	};
+	for (auto waiting = std::exchange(fiber->caller, nullptr); waiting; waiting = std::exchange(waiting->caller, nullptr)) {
+		end(waiting);
+	}
+	for (; !readyFibers.empty(); readyFibers.pop()) end(readyFibers.top().fiber);
+
+	// the failed fiber's own vectors are already empty, as they are for any running fiber
+	end(fiber);
+	fiber = rootFiber.get();
 }
 
-InterpretResult VM::run() {
+VM::VM() {
+	rootFiber = allocate<ObjFiber>(ObjType::Fiber, 0);
+	fiber = rootFiber.get();
+	initString = string("init");
+	defineNative("clock", 0, [] (VM&, std::span<Value>) -> std::optional<Value> {
+		return Value{ static_cast<double>(std::clock()) / CLOCKS_PER_SEC };
+	});
+	defineArrayNatives(*this);
+	defineFiberNatives(*this);
+	defineIsolateNatives(*this);
+}
+
+void VM::defineNative(const std::string& name, int arity, NativeFn function) {
+	globals[string(name)] = Value{ allocate<ObjNative>(ObjType::Native, 0, name, arity, function) };
+}
+
+InterpretResult VM::call(std::shared_ptr<ObjFunction> function, std::shared_ptr<ObjClosure> closure, uint8_t argCount) {
+	if (argCount != function->arity) {
+		runtimeError("Expected %d arguments but got %d.", function->arity, argCount);
+		return InterpretResult::RuntimeError;
+	}
+
+	if (frames.size() == framesMax) {
+		runtimeError("Stack overflow.");
+		return InterpretResult::RuntimeError;
+	}
+
+	frames.push_back(CallFrame{ function, closure, 0, stack.size() - argCount - 1 });
+	return InterpretResult::Ok;
+}
+
+InterpretResult VM::callValue(Value callee, uint8_t argCount) {
+	if (callee.isObj()) {
+		auto obj = callee.asObjUnsafe();
+		switch (obj->type) {
+			case ObjType::Function:
+				return call(std::static_pointer_cast<ObjFunction>(obj), nullptr, argCount);
+			case ObjType::Closure:
+			{
+				auto closure = std::static_pointer_cast<ObjClosure>(obj);
+				return call(closure->function, closure, argCount);
+			}
+			case ObjType::Class:
+			{
+				auto klass = std::static_pointer_cast<ObjClass>(obj);
+				auto instance = allocate<ObjInstance>(ObjType::Instance, 0, klass);
+				if (!instance) return InterpretResult::OutOfMemory;
+				stack[stack.size() - 1 - argCount] = Value{ instance };
+				if (auto initializer = klass->methods.find(initString); initializer != klass->methods.end()) {
+					return callValue(initializer->second, argCount);
+				} else if (argCount != 0) {
+					runtimeError("Expected 0 arguments but got %d.", argCount);
+					return InterpretResult::RuntimeError;
+				}
+				return InterpretResult::Ok;
+			}
+			case ObjType::BoundMethod:
+			{
+				auto bound = std::static_pointer_cast<ObjBoundMethod>(obj);
+				stack[stack.size() - 1 - argCount] = bound->receiver;
+				return callValue(bound->method, argCount);
+			}
+			case ObjType::Native:
+			{
+				auto native = std::static_pointer_cast<ObjNative>(obj);
+				if (argCount != native->arity) {
+					runtimeError("Expected %d arguments but got %d.", native->arity, argCount);
+					return InterpretResult::RuntimeError;
+				}
+				auto result = native->function(*this, std::span<Value>{ stack.data() + stack.size() - argCount, argCount });
+				if (!result && std::exchange(blocking, false)) {
+					// the callee and arguments stay on the stack for the retry
+					blockedCall = argCount;
+					return InterpretResult::Blocked;
+				}
+				if (!result) return failure();
+				stack.resize(stack.size() - argCount - 1);
+				push(result.value());
+				return InterpretResult::Ok;
+			}
+			default:
+				break;
+		}
+	}
+	runtimeError("Can only call functions and classes.");
+	return InterpretResult::RuntimeError;
+}
+
+InterpretResult VM::invokeFromClass(std::shared_ptr<ObjClass> klass, std::shared_ptr<ObjString> name, uint8_t argCount) {
+	auto method = klass->methods.find(name);
+	if (method == klass->methods.end()) {
+		runtimeError("Undefined property '%s'.", name->str.c_str());
+		return InterpretResult::RuntimeError;
+	}
+	return callValue(method->second, argCount);
+}
+
+std::optional<size_t> VM::arrayIndex(Value array, Value index) {
+	if (!array.isObj() || !array.asObjUnsafe()->isArray()) {
+		runtimeError("Only arrays can be indexed.");
+		return std::nullopt;
+	}
+
+	auto position = index.asNumber();
+	if (!position || position.value() != std::floor(position.value())) {
+		runtimeError("Array index must be a whole number.");
+		return std::nullopt;
+	}
+
+	auto size = static_cast<ObjArray*>(array.asObjUnsafe().get())->values.size();
+	if (position.value() < 0 || position.value() >= static_cast<double>(size)) {
+		runtimeError("Array index out of bounds.");
+		return std::nullopt;
+	}
+	return static_cast<size_t>(position.value());
+}
+
+bool VM::checkKey(Value key) {
+	if (isHashable(key)) return true;
+	runtimeError("Map keys must be strings or numbers.");
+	return false;
+}
+
+std::optional<Value> VM::forLimit(ForLimit kind, uint8_t index) {
+	switch (kind) {
+		case ForLimit::Constant:
+			return constant(index);
+		case ForLimit::Local:
+			return stack[frame().slots + index];
+		case ForLimit::Global:
+		{
+			auto name = constantString(index);
+			auto global = globals.find(name);
+			if (global == globals.end()) {
+				runtimeError("Unknown global variable %s.", name->str.c_str());
+				return std::nullopt;
+			}
+			return global->second;
+		}
+	}
+	unreachable();
+	return std::nullopt;
+}
+
+// strings match by identity, which interning makes the same as by contents
+static size_t switchTarget(OpCode kind, SwitchTable& table, Value value) {
+	if (kind == OpCode::TableSwitch) {
+		if (!value.isNumber()) return table.defaultTarget;
+		auto position = value.asNumberUnsafe() - table.low;
+		if (position < 0 || position >= static_cast<double>(table.dense.size()) || position != std::floor(position)) {
+			return table.defaultTarget;
+		}
+		return table.dense[static_cast<size_t>(position)];
+	}
+
+	if (value.isNumber()) {
+		auto target = table.numbers.find(value.asNumberUnsafe());
+		return target == table.numbers.end() ? table.defaultTarget : target->second;
+	}
+	if (value.isObj() && value.asObjRawUnsafe()->isString()) {
+		auto target = table.strings.find(std::static_pointer_cast<ObjString>(value.asObjUnsafe()));
+		return target == table.strings.end() ? table.defaultTarget : target->second;
+	}
+	return table.defaultTarget;
+}
+
+// the int32 halves of the quickened arithmetic. they work in int64, where no sum,
+// difference or product of two int32s overflows, and fall back to a double when
+// the result doesn't fit back in an int32
+static Value integerSum(int64_t a, int64_t b) {
+	return Value::integer(a + b);
+}
+
+static Value integerDifference(int64_t a, int64_t b) {
+	return Value::integer(a - b);
+}
+
+static Value integerProduct(int64_t a, int64_t b) {
+	// only a double can hold the -0 of a zero times a negative
+	if (a * b == 0 && (a < 0 || b < 0)) return Value{ -0.0 };
+	return Value::integer(a * b);
+}
+
+static Value integerQuotient(int64_t a, int64_t b) {
+	return Value{ static_cast<double>(a) / static_cast<double>(b) };
+}
+
+static Value integerLess(int64_t a, int64_t b) {
+	return Value{ a < b };
+}
+
+static Value integerGreater(int64_t a, int64_t b) {
+	return Value{ a > b };
+}
+
+// <= and >= negate the opposite test, so NaN behaves as in the generic opcodes
+static bool forTest(ForCompare compare, double value, double limit) {
+	switch (compare) {
+		case ForCompare::Less: return value < limit;
+		case ForCompare::LessEqual: return !(value > limit);
+		case ForCompare::Greater: return value > limit;
+		case ForCompare::GreaterEqual: return !(value < limit);
+	}
+	unreachable();
+	return false;
+}
+
+InterpretResult VM::bindMethod(std::shared_ptr<ObjClass> klass, std::shared_ptr<ObjString> name) {
+	auto method = klass->methods.find(name);
+	if (method == klass->methods.end()) {
+		runtimeError("Undefined property '%s'.", name->str.c_str());
+		return InterpretResult::RuntimeError;
+	}
+
+	auto bound = allocate<ObjBoundMethod>(ObjType::BoundMethod, 0, peek(0), method->second);
+	if (!bound) return InterpretResult::OutOfMemory;
+	pop_unsafe();
+	push(Value{ bound });
+	return InterpretResult::Ok;
+}
+
+std::shared_ptr<ObjUpvalue> VM::captureUpvalue(size_t slot) {
+	auto it = std::lower_bound(openUpvalues.begin(), openUpvalues.end(), slot, [] (const std::shared_ptr<ObjUpvalue>& upvalue, size_t slot) {
+		return upvalue->slot < slot;
+	});
+	if (it != openUpvalues.end() && (*it)->slot == slot) return *it;
+
+	auto upvalue = allocate<ObjUpvalue>(ObjType::Upvalue, 0, slot, fiber);
+	if (!upvalue) return nullptr;
+	openUpvalues.insert(it, upvalue);
+	return upvalue;
+}
+
+void VM::closeUpvalues(size_t last) {
+	while (!openUpvalues.empty() && openUpvalues.back()->slot >= last) {
+		auto& upvalue = *openUpvalues.back();
+		upvalue.closed = stack[upvalue.slot];
+		upvalue.isOpen = false;
+		openUpvalues.pop_back();
+	}
+}
+
+Value& VM::upvalueValue(ObjUpvalue& upvalue) {
+	if (!upvalue.isOpen) return upvalue.closed;
+	// a fiber that isn't running holds its own stack
+	return upvalue.fiber == fiber ? stack[upvalue.slot] : upvalue.fiber->stack[upvalue.slot];
+}
+
+void VM::schedule(ObjFiber* ready, int priority) {
+	ready->state = FiberState::Ready;
+	ready->priority = priority;
+	readyFibers.push(ReadyFiber{ priority, readySequence++, ready });
+}
+
+// the running fiber's stacks live in the VM while its own are left empty, so a
+// switch is a swap of each vector with the outgoing fiber's and then the incoming one's
+void VM::switchTo(ObjFiber* next) {
+	std::swap(stack, fiber->stack);
+	std::swap(frames, fiber->frames);
+	std::swap(openUpvalues, fiber->openUpvalues);
+	fiber = next;
+	std::swap(stack, fiber->stack);
+	std::swap(frames, fiber->frames);
+	std::swap(openUpvalues, fiber->openUpvalues);
+	fiber->state = FiberState::Running;
+}
+
+// runs `next` from where it stopped, with `value` as the result of the yield or
+// resume it stopped at, or as its argument if it hasn't started
+InterpretResult VM::enter(ObjFiber* next, Value value) {
+	switchTo(next);
+	if (!frames.empty()) {
+		push(value);
+		return InterpretResult::Ok;
+	}
+
+	// a fiber that hasn't started holds only its callee, a function of at most one parameter
+	auto callee = stack.back();
+	auto obj = callee.asObjRawUnsafe();
+	auto function = obj->isClosure() ? static_cast<ObjClosure*>(obj)->function.get() : static_cast<ObjFunction*>(obj);
+	auto argCount = static_cast<uint8_t>(function->arity);
+	if (argCount == 1) push(value);
+	return callValue(callee, argCount);
+}
+
+// a fiber nothing resumed gives the rest of its turn to the next ready one, and its yield evaluates to nil
+InterpretResult VM::yieldToScheduler() {
+	schedule(fiber, fiber->priority);
+	auto next = readyFibers.top().fiber;
+	readyFibers.pop();
+	return enter(next, Value{});
+}
+
+// the running fiber's function returned `result`: carries on with whatever
+// runs next, or returns the result of the whole run once nothing is left
+std::optional<InterpretResult> VM::finishFiber(Value result) {
+	if (fiber != rootFiber.get()) fiber->state = FiberState::Done;
+
+	std::optional<InterpretResult> entered{};
+	if (auto caller = std::exchange(fiber->caller, nullptr)) {
+		entered = enter(caller, result);
+	} else if (!readyFibers.empty()) {
+		auto next = readyFibers.top().fiber;
+		readyFibers.pop();
+		entered = enter(next, Value{});
+	} else {
+		// the root fiber holds the next script
+		switchTo(rootFiber.get());
+		return InterpretResult::Ok;
+	}
+
+	if (entered != InterpretResult::Ok) return entered;
+	return std::nullopt;
+}
+
+bool TraceFilter::includes(OpCode code, int line) const {
+	if (lines && (line < lines->first || line > lines->second)) return false;
+	return opcodes.empty() || opcodes[asByte(code)];
+}
+
+void VM::traceInstruction() {
+	auto& current = frame();
+	auto& chunk = current.function->chunk;
+	if (!trace->includes(asOpCode(chunk.code[current.ip]), chunk.lines[current.ip])) return;
+
+	traceBuffer << "          ";
+	for (auto& element : stack) {
+		traceBuffer << "[ " << element.stringify() << " ]";
+	}
+	traceBuffer << "\n";
+	disassembleInstruction(chunk, current.ip, traceBuffer);
+	if (static_cast<size_t>(traceBuffer.tellp()) >= traceBufferSize) flushTrace();
+}
+
+void VM::flushTrace() {
+	std::cerr << traceBuffer.view() << std::flush;
+	traceBuffer.str({});
+}
+
+void VM::recordInstruction() {
+	auto& current = frame();
+	auto code = asOpCode(current.function->chunk.code[current.ip]);
+	recorder->record(current.function->loadIndex, current.ip, code, stack.size());
+}
+
+template <bool counting, bool checked, Tracing tracing>
+InterpretResult VM::execute() {
 	while (true) {
-		if (debug_traceExecution) {
-			std::cout << "          ";
-			for (auto element : stack) {
-				std::cout << "[ ";
-				element.print();
-				std::cout << " ]";
-			}
-			std::cout << std::endl;
-			disassembleInstruction(chunk, ip);
+		if constexpr (checked) {
+			auto& current = frame();
+			if (auto error = checkInstruction(*current.function, current.ip, stack.size() - current.slots)) {
+				runtimeError("Invalid bytecode: %s.", error.value().c_str());
+				return InterpretResult::RuntimeError;
+			}
+			// what the verifier would have proven before letting these run
+			auto code = asOpCode(current.function->chunk.code[current.ip]);
+			auto operands = code == OpCode::NegateNumberUnchecked ? 1 : 2;
+			if (isUncheckedNumberOp(code) && !std::all_of(stack.end() - operands, stack.end(), [] (Value value) { return value.isNumber(); })) {
+				runtimeError("Invalid bytecode: unchecked operand isn't a number.");
+				return InterpretResult::RuntimeError;
+			}
+		}
+		if constexpr (counting) {
+			counted.instructions++;
+			counted.peakStack = std::max(counted.peakStack, stack.size());
+			counted.peakFrames = std::max(counted.peakFrames, frames.size());
 		}
+		if constexpr (tracing == Tracing::Print) traceInstruction();
+		if constexpr (tracing == Tracing::Record) recordInstruction();
 
 		auto instruction = readOpCode();
 		switch (instruction) {
@@ -68,12 +483,15 @@ InterpretResult VM::run() {
 			}
 			case OpCode::Add:
 			{
-				if (peek(0).isObj() && peek(0).asObjUnsafe()->isString() && peek(1).isObj() && peek(1).asObjUnsafe()->isString()) {
+				if (bothStrings()) {
+					quicken(OpCode::AddString);
 					auto b = pop_unsafe().asObjUnsafe()->asStringUnsafe();
 					auto a = pop_unsafe().asObjUnsafe()->asStringUnsafe();
-					auto str = string(a + b);
+					auto str = concatenate(a, b);
+					if (!str) return InterpretResult::OutOfMemory;
 					push(Value{ str });
-				} else if (peek(0).isNumber() && peek(1).isNumber()) {
+				} else if (bothNumbers()) {
+					quicken(OpCode::AddNumber);
 					auto b = pop_unsafe().asNumberUnsafe();
 					auto a = pop_unsafe().asNumberUnsafe();
 					push(Value{ a + b });
@@ -83,9 +501,18 @@ InterpretResult VM::run() {
 				}
 				break;
 			}
-			case OpCode::Subtract: ReturnIfError(binaryOperator([] (double a, double b) { return a - b; })); break;
-			case OpCode::Multiply: ReturnIfError(binaryOperator([] (double a, double b) { return a * b; })); break;
-			case OpCode::Divide: ReturnIfError(binaryOperator([] (double a, double b) { return a / b; })); break;
+			case OpCode::Subtract:
+				if (bothNumbers()) quicken(OpCode::SubtractNumber);
+				ReturnIfError(binaryOperator([] (double a, double b) { return a - b; }));
+				break;
+			case OpCode::Multiply:
+				if (bothNumbers()) quicken(OpCode::MultiplyNumber);
+				ReturnIfError(binaryOperator([] (double a, double b) { return a * b; }));
+				break;
+			case OpCode::Divide:
+				if (bothNumbers()) quicken(OpCode::DivideNumber);
+				ReturnIfError(binaryOperator([] (double a, double b) { return a / b; }));
+				break;
 			case OpCode::Equal:
 			{
 				auto b = pop_unsafe();
@@ -93,19 +520,87 @@ InterpretResult VM::run() {
 				push(Value{ a == b });
 				break;
 			}
-			case OpCode::Greater: ReturnIfError(binaryOperator([] (double a, double b) { return a > b; })); break;
-			case OpCode::Less: ReturnIfError(binaryOperator([] (double a, double b) { return a < b; })); break;
-			case OpCode::Return: return InterpretResult::Ok;
+			case OpCode::Greater:
+				if (bothNumbers()) quicken(OpCode::GreaterNumber);
+				ReturnIfError(binaryOperator([] (double a, double b) { return a > b; }));
+				break;
+			case OpCode::Less:
+				if (bothNumbers()) quicken(OpCode::LessNumber);
+				ReturnIfError(binaryOperator([] (double a, double b) { return a < b; }));
+				break;
+			case OpCode::AddNumber:
+				if (!numberOperator([] (double a, double b) { return a + b; }, integerSum)) deoptimize(OpCode::Add);
+				break;
+			case OpCode::AddString:
+			{
+				if (!bothStrings()) {
+					deoptimize(OpCode::Add);
+					break;
+				}
+				auto& b = static_cast<ObjString*>(peek(0).asObjRawUnsafe())->str;
+				auto& a = static_cast<ObjString*>(peek(1).asObjRawUnsafe())->str;
+				auto str = concatenate(a, b);
+				if (!str) return InterpretResult::OutOfMemory;
+				stack.pop_back();
+				stack.back() = Value{ str };
+				break;
+			}
+			case OpCode::SubtractNumber:
+				if (!numberOperator([] (double a, double b) { return a - b; }, integerDifference)) deoptimize(OpCode::Subtract);
+				break;
+			case OpCode::MultiplyNumber:
+				if (!numberOperator([] (double a, double b) { return a * b; }, integerProduct)) deoptimize(OpCode::Multiply);
+				break;
+			case OpCode::DivideNumber:
+				if (!numberOperator([] (double a, double b) { return a / b; }, integerQuotient)) deoptimize(OpCode::Divide);
+				break;
+			case OpCode::LessNumber:
+				if (!numberOperator([] (double a, double b) { return a < b; }, integerLess)) deoptimize(OpCode::Less);
+				break;
+			case OpCode::GreaterNumber:
+				if (!numberOperator([] (double a, double b) { return a > b; }, integerGreater)) deoptimize(OpCode::Greater);
+				break;
+			case OpCode::AddNumberUnchecked: uncheckedNumberOperator([] (double a, double b) { return a + b; }, integerSum); break;
+			case OpCode::SubtractNumberUnchecked: uncheckedNumberOperator([] (double a, double b) { return a - b; }, integerDifference); break;
+			case OpCode::MultiplyNumberUnchecked: uncheckedNumberOperator([] (double a, double b) { return a * b; }, integerProduct); break;
+			case OpCode::DivideNumberUnchecked: uncheckedNumberOperator([] (double a, double b) { return a / b; }, integerQuotient); break;
+			case OpCode::LessNumberUnchecked: uncheckedNumberOperator([] (double a, double b) { return a < b; }, integerLess); break;
+			case OpCode::GreaterNumberUnchecked: uncheckedNumberOperator([] (double a, double b) { return a > b; }, integerGreater); break;
+			case OpCode::NegateNumberUnchecked:
+			{
+				auto& value = stack.back();
+				// -0 again needs a double
+				value = value.isInteger() && value.asIntegerUnsafe() != 0 ? Value::integer(-int64_t{ value.asIntegerUnsafe() }) : Value{ -value.asNumberUnsafe() };
+				break;
+			}
+			case OpCode::Return:
+			{
+				auto result = pop_unsafe();
+				auto slots = frame().slots;
+				closeUpvalues(slots);
+				frames.pop_back();
+				stack.resize(slots);
+				if (frames.empty()) {
+					if (auto finished = finishFiber(result)) return finished.value();
+					break;
+				}
+
+				push(result);
+				break;
+			}
 			case OpCode::Drop: pop_unsafe(); break;
 			case OpCode::DefineGlobal:
+			case OpCode::DefineConstant:
 			{
 				auto str = readConstant().asObjUnsafe().get()->asStringUnsafe();
 				auto name = strings[str];
+				PROBE1(global__define, str.c_str());
 				if (globals.contains(name)) {
 					runtimeError("Global variable %s already declared.", str.c_str());
 					return InterpretResult::RuntimeError;
 				}
 				globals[name] = peek(0);
+				if (instruction == OpCode::DefineConstant) constantGlobals.insert(name);
 				pop_unsafe();
 				break;
 			}
@@ -113,6 +608,7 @@ InterpretResult VM::run() {
 			{
 				auto str = readConstant().asObjUnsafe().get()->asStringUnsafe();
 				auto name = strings[str];
+				PROBE1(global__get, str.c_str());
 				if (!globals.contains(name)) {
 					runtimeError("Unknown global variable %s.", str.c_str());
 					return InterpretResult::RuntimeError;
@@ -128,43 +624,428 @@ InterpretResult VM::run() {
 					runtimeError("Cannot assign to unknown global variable %s.", str.c_str());
 					return InterpretResult::RuntimeError;
 				}
+				// code compiled before the `const` was declared still has the plain store
+				if (constantGlobals.contains(name)) {
+					runtimeError("Cannot assign to constant %s.", str.c_str());
+					return InterpretResult::RuntimeError;
+				}
 				globals[name] = peek(0);
 				break;
 			}
 			case OpCode::GetLocal:
 			{
 				auto slot = readByte();
-				push(stack[slot]);
+				push(stack[frame().slots + slot]);
 				break;
 			}
 			case OpCode::SetLocal:
 			{
 				auto slot = readByte();
-				stack[slot] = peek(0);
+				stack[frame().slots + slot] = peek(0);
 				break;
 			}
 			case OpCode::ConditionalJump:
 			{
 				auto offset = readShort();
-				if (!peek(0).castToBool()) ip += offset;
+				if (!peek(0).castToBool()) frame().ip += offset;
 				break;
 			}
 			case OpCode::Jump:
 			{
 				auto offset = readShort();
-				ip += offset;
+				frame().ip += offset;
+				break;
+			}
+			case OpCode::JumpBackIfTrue:
+			{
+				auto offset = readShort();
+				if (peek(0).castToBool()) {
+					frame().ip -= offset;
+					Checkpoint();
+				}
 				break;
 			}
 			case OpCode::JumpBack:
 			{
 				auto offset = readShort();
-				ip -= offset;
+				frame().ip -= offset;
+				Checkpoint();
+				break;
+			}
+			case OpCode::Call:
+			{
+				auto argCount = readByte();
+				ReturnIfError(callValue(peek(argCount), argCount));
+				Checkpoint();
+				break;
+			}
+			case OpCode::Closure:
+			{
+				auto function = std::static_pointer_cast<ObjFunction>(readConstant().asObjUnsafe());
+				auto closure = allocate<ObjClosure>(ObjType::Closure, function->upvalueCount * sizeof(std::shared_ptr<ObjUpvalue>), function);
+				if (!closure) return InterpretResult::OutOfMemory;
+				closure->upvalues.reserve(function->upvalueCount);
+				for (size_t i = 0; i < function->upvalueCount; i++) {
+					auto isLocal = readByte();
+					auto index = readByte();
+					if (isLocal) {
+						auto upvalue = captureUpvalue(frame().slots + index);
+						if (!upvalue) return InterpretResult::OutOfMemory;
+						closure->upvalues.push_back(upvalue);
+					} else {
+						closure->upvalues.push_back(frame().closure->upvalues[index]);
+					}
+				}
+				push(Value{ closure });
+				break;
+			}
+			case OpCode::GetUpvalue:
+			{
+				auto slot = readByte();
+				push(upvalueValue(*frame().closure->upvalues[slot]));
+				break;
+			}
+			case OpCode::SetUpvalue:
+			{
+				auto slot = readByte();
+				upvalueValue(*frame().closure->upvalues[slot]) = peek(0);
+				break;
+			}
+			case OpCode::CloseUpvalue:
+			{
+				closeUpvalues(stack.size() - 1);
+				pop_unsafe();
+				break;
+			}
+			case OpCode::Class:
+			{
+				auto name = constantString(readByte());
+				auto klass = allocate<ObjClass>(ObjType::Class, 0, name->str);
+				if (!klass) return InterpretResult::OutOfMemory;
+				push(Value{ klass });
+				break;
+			}
+			case OpCode::Inherit:
+			{
+				auto superclass = peek(1);
+				if (!superclass.isObj() || !superclass.asObjUnsafe()->isClass()) {
+					runtimeError("Superclass must be a class.");
+					return InterpretResult::RuntimeError;
+				}
+				auto subclass = std::static_pointer_cast<ObjClass>(peek(0).asObjUnsafe());
+				auto& methods = std::static_pointer_cast<ObjClass>(superclass.asObjUnsafe())->methods;
+				subclass->methods.insert(methods.begin(), methods.end());
+				pop_unsafe();
+				break;
+			}
+			case OpCode::Method:
+			{
+				auto name = constantString(readByte());
+				auto klass = std::static_pointer_cast<ObjClass>(peek(1).asObjUnsafe());
+				klass->methods[name] = peek(0);
+				pop_unsafe();
+				break;
+			}
+			case OpCode::GetProperty:
+			{
+				auto nameIndex = readByte();
+				auto& cache = readCache();
+				auto receiver = peek(0);
+				if (!receiver.isObj() || !receiver.asObjUnsafe()->isInstance()) {
+					runtimeError("Only instances have properties.");
+					return InterpretResult::RuntimeError;
+				}
+				auto instance = static_cast<ObjInstance*>(receiver.asObjUnsafe().get());
+
+				if (auto entry = cache.find(instance->shape)) {
+					stack.back() = instance->fields[entry->slot.value()];
+					break;
+				}
+
+				auto name = constantString(nameIndex);
+				if (auto slot = instance->shape->lookup(name)) {
+					cache.add(CacheEntry{ instance->shape, slot });
+					stack.back() = instance->fields[slot.value()];
+					break;
+				}
+				ReturnIfError(bindMethod(instance->klass, name));
+				break;
+			}
+			case OpCode::SetProperty:
+			{
+				auto nameIndex = readByte();
+				auto& cache = readCache();
+				auto target = peek(1);
+				if (!target.isObj() || !target.asObjUnsafe()->isInstance()) {
+					runtimeError("Only instances have fields.");
+					return InterpretResult::RuntimeError;
+				}
+				auto instance = static_cast<ObjInstance*>(target.asObjUnsafe().get());
+
+				auto entry = cache.find(instance->shape);
+				if (!entry) {
+					auto name = constantString(nameIndex);
+					if (auto slot = instance->shape->lookup(name)) {
+						entry = &cache.add(CacheEntry{ instance->shape, slot });
+					} else {
+						auto next = instance->shape->withField(name);
+						entry = &cache.add(CacheEntry{ instance->shape, instance->fields.size(), next });
+					}
+				}
+
+				if (entry->transition) {
+					auto capacity = instance->fields.capacity();
+					instance->shape = entry->transition;
+					instance->fields.push_back(peek(0));
+					if (!charge(ObjType::Instance, (instance->fields.capacity() - capacity) * sizeof(Value))) return InterpretResult::OutOfMemory;
+				} else {
+					instance->fields[entry->slot.value()] = peek(0);
+				}
+
+				auto value = pop_unsafe();
+				pop_unsafe();
+				push(value);
+				break;
+			}
+			case OpCode::Invoke:
+			{
+				auto nameIndex = readByte();
+				auto argCount = readByte();
+				auto& cache = readCache();
+				auto receiver = peek(argCount);
+				if (!receiver.isObj() || !receiver.asObjUnsafe()->isInstance()) {
+					runtimeError("Only instances have methods.");
+					return InterpretResult::RuntimeError;
+				}
+				auto instance = static_cast<ObjInstance*>(receiver.asObjUnsafe().get());
+
+				auto entry = cache.find(instance->shape);
+				if (!entry) {
+					auto name = constantString(nameIndex);
+					if (auto slot = instance->shape->lookup(name)) {
+						entry = &cache.add(CacheEntry{ instance->shape, slot });
+					} else if (auto method = instance->klass->methods.find(name); method != instance->klass->methods.end()) {
+						entry = &cache.add(CacheEntry{ instance->shape, std::nullopt, nullptr, method->second });
+					} else {
+						runtimeError("Undefined property '%s'.", name->str.c_str());
+						return InterpretResult::RuntimeError;
+					}
+				}
+
+				if (entry->slot) {
+					auto field = instance->fields[entry->slot.value()];
+					stack[stack.size() - 1 - argCount] = field;
+					ReturnIfError(callValue(field, argCount));
+				} else {
+					ReturnIfError(callValue(entry->method, argCount));
+				}
+				Checkpoint();
+				break;
+			}
+			case OpCode::GetSuper:
+			{
+				auto name = constantString(readByte());
+				auto superclass = std::static_pointer_cast<ObjClass>(pop_unsafe().asObjUnsafe());
+				ReturnIfError(bindMethod(superclass, name));
+				break;
+			}
+			case OpCode::SuperInvoke:
+			{
+				auto name = constantString(readByte());
+				auto argCount = readByte();
+				auto superclass = std::static_pointer_cast<ObjClass>(pop_unsafe().asObjUnsafe());
+				ReturnIfError(invokeFromClass(superclass, name, argCount));
+				Checkpoint();
+				break;
+			}
+			case OpCode::Array:
+			{
+				auto count = readByte();
+				std::vector<double> values(count);
+				for (size_t i = 0; i < count; i++) {
+					auto element = peek(count - 1 - i).asNumber();
+					if (!element) {
+						runtimeError("Array elements must be numbers.");
+						return InterpretResult::RuntimeError;
+					}
+					values[i] = element.value();
+				}
+				stack.resize(stack.size() - count);
+
+				auto array = allocate<ObjArray>(ObjType::Array, count * sizeof(double), std::move(values));
+				if (!array) return InterpretResult::OutOfMemory;
+				push(Value{ array });
+				break;
+			}
+			case OpCode::GetIndex:
+			{
+				if (peek(1).isObj() && peek(1).asObjRawUnsafe()->isMap()) {
+					auto key = peek(0);
+					if (!checkKey(key)) return InterpretResult::RuntimeError;
+					auto value = static_cast<ObjMap*>(peek(1).asObjRawUnsafe())->get(key);
+					stack.resize(stack.size() - 2);
+					push(value.value_or(Value{}));
+					break;
+				}
+
+				auto index = arrayIndex(peek(1), peek(0));
+				if (!index) return InterpretResult::RuntimeError;
+				auto value = static_cast<ObjArray*>(peek(1).asObjUnsafe().get())->values[index.value()];
+				stack.resize(stack.size() - 2);
+				push(Value{ value });
+				break;
+			}
+			case OpCode::SetIndex:
+			{
+				if (peek(2).isObj() && peek(2).asObjRawUnsafe()->isMap()) {
+					if (!checkKey(peek(1))) return InterpretResult::RuntimeError;
+					auto map = static_cast<ObjMap*>(peek(2).asObjRawUnsafe());
+					auto capacity = map->entries.capacity();
+					map->set(peek(1), peek(0));
+					if (!charge(ObjType::Map, (map->entries.capacity() - capacity) * sizeof(MapEntry))) return InterpretResult::OutOfMemory;
+					auto result = pop_unsafe();
+					stack.resize(stack.size() - 2);
+					push(result);
+					break;
+				}
+
+				auto index = arrayIndex(peek(2), peek(1));
+				if (!index) return InterpretResult::RuntimeError;
+				auto value = peek(0).asNumber();
+				if (!value) {
+					runtimeError("Arrays can only hold numbers.");
+					return InterpretResult::RuntimeError;
+				}
+				static_cast<ObjArray*>(peek(2).asObjUnsafe().get())->values[index.value()] = value.value();
+				auto result = pop_unsafe();
+				stack.resize(stack.size() - 2);
+				push(result);
+				break;
+			}
+			case OpCode::Map:
+			{
+				auto count = readByte();
+				auto map = allocate<ObjMap>(ObjType::Map, 0);
+				if (!map) return InterpretResult::OutOfMemory;
+				for (size_t i = count; i > 0; i--) {
+					auto key = peek(i * 2 - 1);
+					if (!checkKey(key)) return InterpretResult::RuntimeError;
+					map->set(key, peek(i * 2 - 2));
+				}
+				stack.resize(stack.size() - count * 2);
+				if (!charge(ObjType::Map, map->entries.capacity() * sizeof(MapEntry))) return InterpretResult::OutOfMemory;
+
+				push(Value{ map });
+				break;
+			}
+			case OpCode::HasKey:
+			case OpCode::DeleteKey:
+			{
+				auto map = peek(instruction == OpCode::HasKey ? 0 : 1);
+				auto key = peek(instruction == OpCode::HasKey ? 1 : 0);
+				if (!map.isObj() || !map.asObjRawUnsafe()->isMap()) {
+					runtimeError(instruction == OpCode::HasKey ? "Right operand of 'in' must be a map." : "Can only delete entries from a map.");
+					return InterpretResult::RuntimeError;
+				}
+				if (!checkKey(key)) return InterpretResult::RuntimeError;
+
+				auto target = static_cast<ObjMap*>(map.asObjRawUnsafe());
+				auto result = instruction == OpCode::HasKey ? target->get(key).has_value() : target->remove(key);
+				stack.resize(stack.size() - 2);
+				push(Value{ result });
+				break;
+			}
+			case OpCode::TableSwitch:
+			case OpCode::LookupSwitch:
+			{
+				auto& table = frame().function->chunk.switches[readShort()];
+				frame().ip = switchTarget(instruction, table, pop_unsafe());
+				break;
+			}
+			case OpCode::Yield:
+			{
+				auto value = pop_unsafe();
+				if (auto caller = std::exchange(fiber->caller, nullptr)) {
+					fiber->state = FiberState::Suspended;
+					ReturnIfError(enter(caller, value));
+				} else {
+					ReturnIfError(yieldToScheduler());
+				}
+				break;
+			}
+			case OpCode::Resume:
+			{
+				auto value = pop_unsafe();
+				auto target = pop_unsafe();
+				if (!target.isObj() || !target.asObjRawUnsafe()->isFiber()) {
+					runtimeError("Can only resume fibers.");
+					return InterpretResult::RuntimeError;
+				}
+
+				auto next = static_cast<ObjFiber*>(target.asObjRawUnsafe());
+				switch (next->state) {
+					case FiberState::New:
+					case FiberState::Suspended:
+						break;
+					case FiberState::Ready:
+						runtimeError("Can't resume a scheduled fiber.");
+						return InterpretResult::RuntimeError;
+					case FiberState::Running:
+					case FiberState::Waiting:
+						runtimeError("Can't resume a running fiber.");
+						return InterpretResult::RuntimeError;
+					case FiberState::Done:
+						runtimeError("Can't resume a finished fiber.");
+						return InterpretResult::RuntimeError;
+				}
+
+				next->caller = fiber;
+				fiber->state = FiberState::Waiting;
+				ReturnIfError(enter(next, value));
+				break;
+			}
+			case OpCode::ForPrep:
+			case OpCode::ForLoop:
+			{
+				auto slot = readByte();
+				auto kind = static_cast<ForLimit>(readByte());
+				auto index = readByte();
+				auto compare = static_cast<ForCompare>(readByte());
+				uint8_t step = instruction == OpCode::ForLoop ? readByte() : 0;
+				auto offset = readShort();
+
+				auto& variable = stack[frame().slots + slot];
+				if (instruction == OpCode::ForLoop) {
+					// the same checks `i = i + step` would make
+					if (!variable.isNumber()) {
+						runtimeError("Operands must be either two numbers or two strings.");
+						return InterpretResult::RuntimeError;
+					}
+					auto increment = constant(step);
+					variable = variable.isInteger() && increment.isInteger()
+						? integerSum(variable.asIntegerUnsafe(), increment.asIntegerUnsafe())
+						: Value{ variable.asNumberUnsafe() + increment.asNumberUnsafe() };
+				}
+
+				auto limit = forLimit(kind, index);
+				if (!limit) return InterpretResult::RuntimeError;
+				if (!variable.isNumber() || !limit->isNumber()) {
+					runtimeError("Operands must be numbers.");
+					return InterpretResult::RuntimeError;
+				}
+
+				auto passed = forTest(compare, variable.asNumberUnsafe(), limit->asNumberUnsafe());
+				if (instruction == OpCode::ForPrep && !passed) frame().ip += offset;
+				if (instruction == OpCode::ForLoop && passed) {
+					frame().ip -= offset;
+					Checkpoint();
+				}
 				break;
 			}
 			case OpCode::Print:
 			{
-				pop_unsafe().print();
-				std::cout << std::endl;
+				// one write per line, so isolates printing at once don't interleave within a line
+				std::cout << pop_unsafe().stringify() + "\n" << std::flush;
 				break;
 			}
 
@@ -176,30 +1057,356 @@ InterpretResult VM::run() {
 
 std::shared_ptr<ObjString> VM::string(std::string str) {
 	if (strings.contains(str)) {
+		PROBE2(string__hit, str.c_str(), str.size());
 		return strings[str];
 	} else {
-		auto string = std::make_shared<ObjString>(str);
-		objects.push_back(std::static_pointer_cast<Obj>(string));
+		PROBE2(string__miss, str.c_str(), str.size());
+		// the intern table keeps a second copy of the text as its key
+		auto string = allocate<ObjString>(ObjType::String, str.size() * 2, str);
+		if (!string) return nullptr;
 		strings[str] = string;
 		return string;
 	}
 }
 
+// a young string is garbage once the nursery's reference and the intern
+// table's are all that's left; anything else that holds one, be it a value on a
+// stack, a global or a local in the VM, counts as a reference of its own. the
+// survivors move to the old objects, and since liveness is read off the counts
+// rather than traced from roots, stores into old objects need no write barrier
+void VM::scavenge() {
+	counted.scavenges++;
+	for (auto& young : nursery) {
+		if (young.use_count() > 2) {
+			objects.push_back(std::move(young));
+			counted.promotedStrings++;
+			continue;
+		}
+
+		auto& text = static_cast<ObjString&>(*young).str;
+		auto bytes = sizeof(ObjString) + text.size() * 2;
+		heap.total -= bytes;
+		heap.bytes[size_t(ObjType::String)] -= bytes;
+		heap.objects[size_t(ObjType::String)]--;
+		counted.scavengedStrings++;
+		strings.erase(text);
+	}
+	nursery.clear();
+	nurseryBytes = 0;
+}
+
+bool VM::fits(size_t bytes) {
+	return !heapLimit || bytes <= heapLimit.value() - std::min(heap.total, heapLimit.value());
+}
+
+// dead young strings count against the limit until a scavenge, so one is due
+// before giving up. safe between checkpoints too, as whatever holds a young
+// string across an allocation holds a reference to it
+bool VM::makeRoom(size_t bytes) {
+	if (fits(bytes)) return true;
+	if (nursery.empty()) return false;
+	scavenge();
+	return fits(bytes);
+}
+
+bool VM::charge(ObjType type, size_t bytes) {
+	if (!makeRoom(bytes)) {
+		outOfMemory(bytes);
+		return false;
+	}
+	heap.total += bytes;
+	heap.bytes[size_t(type)] += bytes;
+	return true;
+}
+
+VMStats VM::stats() {
+	auto snapshot = counted;
+	snapshot.heap = heap;
+	snapshot.strings = strings.size();
+	snapshot.stringLoadFactor = strings.load_factor();
+	snapshot.globals = globals.size();
+	snapshot.quickenedSites = quickenedSites;
+	snapshot.deoptimizedSites = deoptimizedSites;
+	return snapshot;
+}
+
+void printStats(std::ostream& out, const VMStats& stats) {
+	auto milliseconds = [] (std::chrono::steady_clock::duration duration) {
+		return std::chrono::duration<double, std::milli>(duration).count();
+	};
+
+	out << "== stats ==" << std::endl;
+	out << "compile time: " << milliseconds(stats.compileTime) << " ms" << std::endl;
+	out << "run time: " << milliseconds(stats.runTime) << " ms" << std::endl;
+	out << "instructions: " << stats.instructions << std::endl;
+	out << "peak stack: " << stats.peakStack << " values, " << stats.peakFrames << " frames" << std::endl;
+	out << "functions: " << stats.functions << ", " << stats.codeBytes << " code bytes, "
+		<< stats.constants << " constants, " << stats.lineBytes << " line table bytes" << std::endl;
+	out << "quickened sites: " << stats.quickenedSites << ", " << stats.deoptimizedSites << " deoptimized" << std::endl;
+	out << "interned strings: " << stats.strings << ", load factor " << stats.stringLoadFactor << std::endl;
+	out << "globals: " << stats.globals << std::endl;
+	out << "nursery: " << stats.scavenges << " scavenges, " << stats.scavengedStrings << " strings freed, "
+		<< stats.promotedStrings << " promoted" << std::endl;
+	out << "heap: " << stats.heap.total << " bytes" << std::endl;
+	for (size_t type = 0; type < objTypeCount; type++) {
+		if (stats.heap.objects[type] == 0 && stats.heap.bytes[type] == 0) continue;
+		out << "  " << objTypeName(ObjType(type)) << ": " << stats.heap.objects[type] << " objects, "
+			<< stats.heap.bytes[type] << " bytes" << std::endl;
+	}
+	if (stats.compileEvents) printPerfCounts(out, "compile", stats.compileEvents.value());
+	if (stats.runEvents) printPerfCounts(out, "run", stats.runEvents.value());
+}
+
+void VM::outOfMemory(size_t request) {
+	// the type holding the most is the likeliest culprit
+	auto largest = size_t(std::max_element(heap.bytes.begin(), heap.bytes.end()) - heap.bytes.begin());
+	heapExhausted = true;
+	runtimeError("Out of memory: %zu more bytes wanted with %zu in use, %zu of them held by %s objects.",
+		request, heap.total, heap.bytes[largest], objTypeName(ObjType(largest)));
+}
+
+// the joined text is checked against the limit before it is built, as it can
+// be the largest thing a script makes
+std::shared_ptr<ObjString> VM::concatenate(const std::string& a, const std::string& b) {
+	auto size = a.size() + b.size();
+	if (!makeRoom(sizeof(ObjString) + size * 2)) {
+		outOfMemory(sizeof(ObjString) + size * 2);
+		return nullptr;
+	}
+
+	std::string joined{};
+	try {
+		joined.reserve(size);
+	} catch (const std::bad_alloc&) {
+		outOfMemory(size);
+		return nullptr;
+	}
+	joined.append(a).append(b);
+	return string(std::move(joined));
+}
+
+void VM::block() {
+	blocking = true;
+}
+
+InterpretResult VM::failure() {
+	return heapExhausted ? InterpretResult::OutOfMemory : InterpretResult::RuntimeError;
+}
+
+InterpretResult VM::run() {
+	auto start = std::chrono::steady_clock::now();
+	auto events = readEvents();
+	// indexed by counting and checked as the two lowest bits, then by tracing.
+	// bytecode that skipped verification has each instruction checked as it runs instead
+	static constexpr std::array<InterpretResult (VM::*)(), 12> loops{
+		&VM::execute<false, false, Tracing::Off>, &VM::execute<true, false, Tracing::Off>,
+		&VM::execute<false, true, Tracing::Off>, &VM::execute<true, true, Tracing::Off>,
+		&VM::execute<false, false, Tracing::Print>, &VM::execute<true, false, Tracing::Print>,
+		&VM::execute<false, true, Tracing::Print>, &VM::execute<true, true, Tracing::Print>,
+		&VM::execute<false, false, Tracing::Record>, &VM::execute<true, false, Tracing::Record>,
+		&VM::execute<false, true, Tracing::Record>, &VM::execute<true, true, Tracing::Record>,
+	};
+	auto tracing = trace ? Tracing::Print : recorder ? Tracing::Record : Tracing::Off;
+	auto loop = size_t{ collectStats } | size_t{ !trusted } << 1 | static_cast<size_t>(tracing) << 2;
+	auto result = (this->*loops[loop])();
+	if (trace) flushTrace();
+	counted.runTime += std::chrono::steady_clock::now() - start;
+	countEvents(counted.runEvents, events);
+	return result;
+}
+
+std::optional<PerfCounts> VM::readEvents() {
+	if (!perfCounters) return std::nullopt;
+	return perfCounters->read();
+}
+
+void VM::countEvents(std::optional<PerfCounts>& total, const std::optional<PerfCounts>& start) {
+	if (!start) return;
+	auto events = perfCounters->read() - start.value();
+	total = total ? total.value() + events : events;
+}
+
 InterpretResult VM::interpret(std::string_view source) {
+	PROBE1(interpret__start, source.size());
+	auto result = compileAndRun(source);
+	PROBE1(interpret__done, static_cast<int>(result));
+	return result;
+}
+
+InterpretResult VM::compileAndRun(std::string_view source) {
+	auto start = std::chrono::steady_clock::now();
+	auto events = readEvents();
 	Compiler compiler{ source };
+	compiler.optimizationLevel = optimizationLevel;
+	compiler.wholeProgram = wholeProgram;
+	// so that a REPL line can neither assign an earlier line's constants nor redeclare them
+	for (auto& name : constantGlobals) compiler.constantGlobals[name->str] = globals[name];
 
-	auto newChunk = compiler.compile();
+	auto function = compiler.compile();
+	counted.compileTime += std::chrono::steady_clock::now() - start;
+	countEvents(counted.compileEvents, events);
 
-	if (!newChunk) {
+	if (!function) {
 		return InterpretResult::CompileTimeError;
 	}
 
-	chunk = newChunk.value();
-	ip = 0;
+	heapExhausted = false;
+	ReturnIfError(load(*function.value()));
+
+	push(Value{ function.value() });
+	ReturnIfError(call(function.value(), nullptr, 0));
 
+	startSlice();
 	return run();
 }
 
+InterpretResult VM::resume() {
+	if (blockedCall) {
+		auto argCount = std::exchange(blockedCall, std::nullopt).value();
+		ReturnIfError(callValue(peek(argCount), argCount));
+	}
+	if (frames.empty()) return InterpretResult::Ok;
+
+	startSlice();
+	return run();
+}
+
+void VM::startSlice() {
+	stepsLeft = budget.steps.value_or(std::numeric_limits<uint64_t>::max());
+	if (budget.time) deadline = std::chrono::steady_clock::now() + budget.time.value();
+	scheduleCheck();
+}
+
+void VM::scheduleCheck() {
+	checkBatch = budget.time ? std::min(stepsLeft, budgetClockInterval) : stepsLeft;
+	// a zero budget still lets the first step through to be counted
+	checkBatch = std::max<uint64_t>(checkBatch, 1);
+	stepsUntilCheck = checkBatch;
+}
+
+InterpretResult VM::checkBudget() {
+	stepsLeft -= std::min(stepsLeft, checkBatch);
+	auto outOfTime = budget.time && std::chrono::steady_clock::now() >= deadline;
+	if (stepsLeft > 0 && !outOfTime) {
+		scheduleCheck();
+		return InterpretResult::Ok;
+	}
+
+	if (budget.resumable) return InterpretResult::Suspended;
+
+	runtimeError("Execution budget exhausted.");
+	return InterpretResult::BudgetExhausted;
+}
+
+// hands compiled batches from the compiler thread to the VM; bounded so that a
+// compiler far ahead of execution doesn't hold the whole program's bytecode
+struct BatchQueue {
+	static constexpr size_t capacity = 4;
+
+	// false once the VM has stopped taking batches
+	bool push(std::shared_ptr<ObjFunction> batch) {
+		std::unique_lock lock{ mutex };
+		spaceFree.wait(lock, [&] { return batches.size() < capacity || closed; });
+		if (closed) return false;
+		batches.push_back(std::move(batch));
+		batchReady.notify_one();
+		return true;
+	}
+
+	// null once every batch has been taken and the compiler is done
+	std::shared_ptr<ObjFunction> pop() {
+		std::unique_lock lock{ mutex };
+		batchReady.wait(lock, [&] { return !batches.empty() || finished; });
+		if (batches.empty()) return nullptr;
+		auto batch = std::move(batches.front());
+		batches.pop_front();
+		spaceFree.notify_one();
+		return batch;
+	}
+
+	void finish(bool hadError) {
+		std::lock_guard lock{ mutex };
+		finished = true;
+		failed = hadError;
+		batchReady.notify_one();
+	}
+
+	void close() {
+		std::lock_guard lock{ mutex };
+		closed = true;
+		batches.clear();
+		spaceFree.notify_one();
+	}
+
+	bool hadError() {
+		std::lock_guard lock{ mutex };
+		return failed;
+	}
+
+	private:
+	std::mutex mutex{};
+	std::condition_variable batchReady{};
+	std::condition_variable spaceFree{};
+	std::deque<std::shared_ptr<ObjFunction>> batches{};
+	bool finished{ false };
+	bool failed{ false };
+	bool closed{ false };
+};
+
+// compiles on a second thread while the VM runs the batches already compiled.
+// a compile error stops new batches from being queued, but the batches before
+// it have run by then, so unlike interpret() a broken file can have partly executed
+InterpretResult VM::interpretStream(std::string_view source) {
+	BatchQueue queue{};
+	// the compiler's own time, overlapping the run's; read once the producer has joined
+	std::chrono::steady_clock::duration compiling{};
+	std::thread producer{ [&] {
+		auto start = std::chrono::steady_clock::now();
+		// built here so that scanning the source is off the VM thread too
+		Compiler compiler{ source };
+		compiler.optimizationLevel = optimizationLevel;
+
+		compiler.beginStream();
+		compiling += std::chrono::steady_clock::now() - start;
+		while (!compiler.streamDone()) {
+			// waiting for the VM to take a batch isn't compiling
+			start = std::chrono::steady_clock::now();
+			auto batch = compiler.compileBatch();
+			compiling += std::chrono::steady_clock::now() - start;
+			// keep parsing after an error, only to report the rest
+			if (!batch) continue;
+			if (!queue.push(batch.value())) break;
+		}
+		queue.finish(compiler.parser.hadError);
+	} };
+
+	// the VM can't pause between batches, so a suspension would lose the rest of the source
+	auto resumable = std::exchange(budget.resumable, false);
+
+	auto result = InterpretResult::Ok;
+	heapExhausted = false;
+	while (auto batch = queue.pop()) {
+		result = load(*batch);
+		if (result != InterpretResult::Ok) break;
+
+		push(Value{ batch });
+		result = call(batch, nullptr, 0);
+		if (result == InterpretResult::Ok) {
+			startSlice();
+			result = run();
+		}
+		if (result != InterpretResult::Ok) break;
+	}
+
+	budget.resumable = resumable;
+	queue.close();
+	producer.join();
+	counted.compileTime += compiling;
+
+	if (result == InterpretResult::Ok && queue.hadError()) return InterpretResult::CompileTimeError;
+	return result;
+}
+
 void VM::push(Value value) {
 	stack.push_back(value);
 }
@@ -214,8 +1421,11 @@ std::optional<Value> VM::pop() {
 	}
 }
 
+// the verifier, or the checked run loop, has already made sure there is a value to pop
 Value VM::pop_unsafe() {
-	return pop().value();
+	auto result = std::move(stack.back());
+	stack.pop_back();
+	return result;
 }
 
 Value VM::peek(size_t distance) {
@@ -224,18 +1434,57 @@ Value VM::peek(size_t distance) {
 
 void VM::free() {
 	if (debug_logFrees) {
-		std::cout << "Freeing " << objects.size() << " objects." << std::endl;
+		std::cout << "Freeing " << objects.size() + nursery.size() << " objects." << std::endl;
+	}
+	if (debug_logQuickening) {
+		std::cout << "Quickened " << quickenedSites << " sites, " << deoptimizedSites << " deoptimized." << std::endl;
 	}
 	objects.clear();
+	nursery.clear();
+	nurseryBytes = 0;
+}
+
+bool VM::bothNumbers() {
+	auto size = stack.size();
+	return stack[size - 1].isNumber() && stack[size - 2].isNumber();
+}
+
+bool VM::bothStrings() {
+	auto size = stack.size();
+	return stack[size - 1].isObj() && stack[size - 1].asObjRawUnsafe()->isString()
+		&& stack[size - 2].isObj() && stack[size - 2].asObjRawUnsafe()->isString();
+}
+
+// called while executing a generic opcode: rewrites it in place so later
+// executions of this site take the specialised path
+void VM::quicken(OpCode specialized) {
+	auto& current = frame();
+	current.function->chunk.code[current.ip - 1] = asByte(specialized);
+	quickenedSites++;
+}
+
+// called when a specialised opcode's guard fails: puts the generic opcode
+// back and rewinds so that it runs, and may quicken again, on the next dispatch
+void VM::deoptimize(OpCode generic) {
+	auto& current = frame();
+	current.ip--;
+	current.function->chunk.code[current.ip] = asByte(generic);
+	deoptimizedSites++;
+}
+
+CallFrame& VM::frame() {
+	return frames.back();
 }
 
 uint8_t VM::readByte() {
-	return chunk.code[ip++];
+	auto& current = frame();
+	return current.function->chunk.code[current.ip++];
 }
 
 uint16_t VM::readShort() {
-	ip += 2;
-	return static_cast<uint16_t>(chunk.code[ip - 2]) << 8 | chunk.code[ip - 1];
+	auto& current = frame();
+	current.ip += 2;
+	return static_cast<uint16_t>(current.function->chunk.code[current.ip - 2]) << 8 | current.function->chunk.code[current.ip - 1];
 }
 
 OpCode VM::readOpCode() {
@@ -243,13 +1492,61 @@ OpCode VM::readOpCode() {
 }
 
 Value VM::readConstant() {
-	auto constant = chunk.constants[readByte()];
-	if (constant.isObj()) {
-		if (constant.asObjUnsafe().get()->isString()) {
-			return Value{ string(constant.asObjUnsafe().get()->asStringUnsafe()) };
-		} else {
-			objects.push_back(constant.asObjUnsafe());
-		};
+	return constant(readByte());
+}
+
+Value VM::constant(uint8_t index) {
+	return frame().function->chunk.constants[index];
+}
+
+// every compiled function passes through here once, before any of it runs. its
+// bytecode is verified, and string constants are swapped for their interned
+// copies so that reading one never allocates and keys compare by identity
+InterpretResult VM::load(ObjFunction& function) {
+	if (function.loaded) return InterpretResult::Ok;
+	function.loaded = true;
+	function.loadIndex = counted.functions;
+	counted.functions++;
+	counted.codeBytes += function.chunk.code.size();
+	counted.constants += function.chunk.constants.size();
+	counted.lineBytes += function.chunk.lines.size() * sizeof(int);
+
+	if (!verifyBytecode) {
+		trusted = false;
+	} else if (auto error = verify(function)) {
+		std::cerr << "Invalid bytecode in " << (function.name.empty() ? "script" : function.name) << " at " << error.value() << "." << std::endl;
+		return InterpretResult::CompileTimeError;
+	}
+
+	for (auto& table : function.chunk.switches) {
+		std::unordered_map<std::shared_ptr<ObjString>, size_t> strings{};
+		for (auto& [label, target] : table.strings) {
+			auto interned = string(label->str);
+			if (!interned) return InterpretResult::OutOfMemory;
+			strings[interned] = target;
+		}
+		table.strings = std::move(strings);
+	}
+
+	for (auto& constant : function.chunk.constants) {
+		if (!constant.isObj()) continue;
+
+		auto obj = constant.asObjRawUnsafe();
+		if (obj->isString()) {
+			auto interned = string(obj->asStringUnsafe());
+			if (!interned) return InterpretResult::OutOfMemory;
+			constant = Value{ interned };
+		} else if (obj->isFunction()) {
+			ReturnIfError(load(*static_cast<ObjFunction*>(obj)));
+		}
 	}
-	return constant;
+	return InterpretResult::Ok;
+}
+
+std::shared_ptr<ObjString> VM::constantString(uint8_t index) {
+	return std::static_pointer_cast<ObjString>(constant(index).asObjUnsafe());
+}
+
+InlineCache& VM::readCache() {
+	return frame().function->chunk.caches[readShort()];
 }
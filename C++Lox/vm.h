@@ -3,27 +3,183 @@
 #include "common.h"
 #include "chunk.h"
 #include "object.h"
+#include "perf.h"
+#include "probes.h"
 
 struct Obj;
 struct ObjString;
+struct ObjFunction;
+struct ObjClosure;
+struct ObjUpvalue;
+struct ObjClass;
+struct InlineCache;
+struct Isolate;
+struct TraceRecorder;
+
+constexpr size_t framesMax = 64;
 
 enum class InterpretResult {
 	Ok,
 	RuntimeError,
 	CompileTimeError,
+	// the budget ran out and the script was abandoned
+	BudgetExhausted,
+	// the budget ran out in resumable mode; resume() carries on where it stopped
+	Suspended,
+	// an allocation would have taken the heap past VM::heapLimit
+	OutOfMemory,
+	// a native called VM::block(); resume() calls it again
+	Blocked,
+};
+
+// what the VM's objects hold, counted as they are created or grow. only young
+// strings are ever freed before VM::free, by a scavenge of the nursery
+struct HeapUsage {
+	size_t total{ 0 };
+	std::array<size_t, objTypeCount> bytes{};
+	std::array<size_t, objTypeCount> objects{};
+};
+
+// a snapshot of what the VM has compiled, allocated and run, from VM::stats()
+struct VMStats {
+	HeapUsage heap{};
+	size_t strings{ 0 };
+	float stringLoadFactor{ 0 };
+	size_t globals{ 0 };
+	// chunks of every function compiled so far
+	size_t functions{ 0 };
+	size_t codeBytes{ 0 };
+	size_t constants{ 0 };
+	size_t lineBytes{ 0 };
+	size_t quickenedSites{ 0 };
+	size_t deoptimizedSites{ 0 };
+	std::chrono::steady_clock::duration compileTime{};
+	std::chrono::steady_clock::duration runTime{};
+	// counted only while VM::collectStats is set, since they cost the run loop a little per instruction
+	uint64_t instructions{ 0 };
+	size_t peakStack{ 0 };
+	size_t peakFrames{ 0 };
+	size_t scavenges{ 0 };
+	size_t scavengedStrings{ 0 };
+	size_t promotedStrings{ 0 };
+	// hardware events, while VM::perfCounters is set. a streamed compile runs on
+	// another thread, which the counters don't follow
+	std::optional<PerfCounts> compileEvents{};
+	std::optional<PerfCounts> runEvents{};
+};
+
+void printStats(std::ostream& out, const VMStats& stats);
+
+// how far one run may go before control returns to the host; checked only at
+// back edges and calls, so straight-line code pays nothing for it
+struct Budget {
+	// back edges and calls taken
+	std::optional<uint64_t> steps{};
+	std::optional<std::chrono::steady_clock::duration> time{};
+	// suspend rather than abandon the script, so a host can time-slice many VMs;
+	// each resume() gets the whole budget again. interpretStream() never suspends
+	bool resumable{ false };
+};
+
+// what the run loop does with each instruction besides running it
+enum class Tracing : uint8_t {
+	Off,
+	Print,
+	Record,
+};
+
+// which instructions --trace prints; an empty filter lets every one through
+struct TraceFilter {
+	// first and last source line, inclusive
+	std::optional<std::pair<int, int>> lines{};
+	// indexed by opcode; empty means every opcode
+	std::vector<bool> opcodes{};
+
+	bool includes(OpCode code, int line) const;
+};
+
+// bytes of trace held back before they are written out
+constexpr size_t traceBufferSize = 64 * 1024;
+
+// young strings, or bytes of them, at which the run loop's next checkpoint scavenges them
+constexpr size_t nurseryCapacity = 4096;
+constexpr size_t nurseryByteCapacity = 1024 * 1024;
+
+// time budgets read the clock once per this many steps
+constexpr uint64_t budgetClockInterval = 1024;
+
+// higher priority runs first, and fibers of equal priority take turns in the order they became ready
+struct ReadyFiber {
+	int priority;
+	uint64_t sequence;
+	ObjFiber* fiber;
+
+	bool operator<(const ReadyFiber& other) const {
+		if (priority != other.priority) return priority < other.priority;
+		return sequence > other.sequence;
+	}
 };
 
 struct VM {
-	Chunk chunk;
-	size_t ip{ 0 };
+	// those of the running fiber
+	std::vector<CallFrame> frames{};
 	std::vector<Value> stack{};
+	// old objects, kept until free()
 	std::vector<std::shared_ptr<Obj>> objects{};
+	// strings made since the last scavenge. most are the results of + that die
+	// within a statement, so they are dropped here instead of kept as old objects
+	std::vector<std::shared_ptr<Obj>> nursery{};
+	size_t nurseryBytes{ 0 };
 	std::unordered_map<std::string, std::shared_ptr<ObjString>> strings{};
 	std::unordered_map<std::shared_ptr<ObjString>, Value> globals{};
+	// globals declared `const`; each later compile inlines them, as the one that declared them did
+	std::unordered_set<std::shared_ptr<ObjString>> constantGlobals{};
+	// sorted by stack slot, innermost last
+	std::vector<std::shared_ptr<ObjUpvalue>> openUpvalues{};
+	// runs the script; fibers are run on top of it
+	std::shared_ptr<ObjFiber> rootFiber{};
+	ObjFiber* fiber{ nullptr };
+	std::priority_queue<ReadyFiber> readyFibers{};
+	// instruction sites rewritten to a specialised opcode, and rewrites undone by a failed guard
+	size_t quickenedSites{ 0 };
+	size_t deoptimizedSites{ 0 };
+	// -O level handed to the compiler
+	int optimizationLevel{ 0 };
+	// a script file is the whole program; REPL lines may assign globals earlier lines read
+	bool wholeProgram{ false };
+	Budget budget{};
+	HeapUsage heap{};
+	std::optional<size_t> heapLimit{};
+	// set when the VM runs in the isolate pool, so natives park it rather than wait on a thread
+	Isolate* isolate{ nullptr };
+	// count instructions and track stack depth as the script runs
+	bool collectStats{ false };
+	// check each function's bytecode as it loads; once anything loads without
+	// that, every instruction is checked as it runs
+	bool verifyBytecode{ true };
+	// print each instruction and the stack before it to stderr. the run loop is
+	// compiled a second time for this, so that an untraced run tests nothing for it
+	std::optional<TraceFilter> trace{};
+	// takes every instruction when set and trace isn't, in another copy of the run loop
+	TraceRecorder* recorder{ nullptr };
+	// counts hardware events around compiling and running; opened on the VM's thread
+	PerfCounters* perfCounters{ nullptr };
+
+	VM();
 
+	// null only when out of memory
 	std::shared_ptr<ObjString> string(std::string str);
 
+	void defineNative(const std::string& name, int arity, NativeFn function);
+
+	// queues a fiber to run once the running one yields or finishes
+	void schedule(ObjFiber* fiber, int priority);
+
 	InterpretResult interpret(std::string_view source);
+	// compiles and runs in a pipeline, for sources too large to want to compile before running any of it
+	InterpretResult interpretStream(std::string_view source);
+	// continues a script that returned Suspended
+	InterpretResult resume();
 
 	void push(Value value);
 
@@ -35,13 +191,61 @@ struct VM {
 
 	void free();
 
+	void runtimeError(const std::string& format, ...);
+
+	// every object the VM creates comes through here, with `extra` the bytes it
+	// owns beyond its own struct; null after reporting a runtime error when the
+	// heap limit, or the system, can't spare them
+	template <typename T, typename... Args>
+	std::shared_ptr<T> allocate(ObjType type, size_t extra, Args&&... args) {
+		auto bytes = extra > std::numeric_limits<size_t>::max() - sizeof(T) ? std::numeric_limits<size_t>::max() : sizeof(T) + extra;
+		if (!charge(type, bytes)) return nullptr;
+
+		std::shared_ptr<T> object{};
+		try {
+			object = std::make_shared<T>(std::forward<Args>(args)...);
+		} catch (const std::bad_alloc&) {
+		} catch (const std::length_error&) {
+		}
+		if (!object) {
+			heap.total -= bytes;
+			heap.bytes[size_t(type)] -= bytes;
+			outOfMemory(bytes);
+			return nullptr;
+		}
+
+		heap.objects[size_t(type)]++;
+		if constexpr (std::is_same_v<T, ObjString>) {
+			nursery.push_back(object);
+			nurseryBytes += bytes;
+		} else {
+			objects.push_back(object);
+		}
+		PROBE2(object__alloc, static_cast<int>(type), bytes);
+		return object;
+	}
+
+	// counts bytes an existing object has grown by; false after reporting a runtime error
+	bool charge(ObjType type, size_t bytes);
+
+	VMStats stats();
+
+	// for a native that can't finish yet: it returns nullopt after calling this,
+	// and the run stops with Blocked instead of a runtime error
+	void block();
+
 	private:
+	CallFrame& frame();
+
 	uint8_t readByte();
 	uint16_t readShort();
 
 	OpCode readOpCode();
 
 	Value readConstant();
+	Value constant(uint8_t index);
+	std::shared_ptr<ObjString> constantString(uint8_t index);
+	InlineCache& readCache();
 
 	template <typename F>
 	InterpretResult binaryOperator(F f) {
@@ -55,7 +259,102 @@ struct VM {
 		return InterpretResult::Ok;
 	}
 
-	void runtimeError(const std::string& format, ...);
+	// fast path for quickened opcodes; false means the guard failed. two int32
+	// operands go to `integers` instead of f
+	template <typename F, typename G>
+	bool numberOperator(F f, G integers) {
+		auto size = stack.size();
+		if (!stack[size - 1].isNumber() || !stack[size - 2].isNumber()) return false;
+		uncheckedNumberOperator(f, integers);
+		return true;
+	}
+
+	// operands already proven to be numbers by the compiler
+	template <typename F, typename G>
+	void uncheckedNumberOperator(F f, G integers) {
+		auto& a = stack[stack.size() - 2];
+		auto& b = stack.back();
+		auto result = a.isInteger() && b.isInteger()
+			? integers(a.asIntegerUnsafe(), b.asIntegerUnsafe())
+			: Value{ f(a.asNumberUnsafe(), b.asNumberUnsafe()) };
+		stack.pop_back();
+		stack.back() = result;
+	}
+
+	bool bothNumbers();
+	bool bothStrings();
+
+	void quicken(OpCode specialized);
+	void deoptimize(OpCode generic);
+
+	InterpretResult call(std::shared_ptr<ObjFunction> function, std::shared_ptr<ObjClosure> closure, uint8_t argCount);
+	InterpretResult callValue(Value callee, uint8_t argCount);
+	InterpretResult invokeFromClass(std::shared_ptr<ObjClass> klass, std::shared_ptr<ObjString> name, uint8_t argCount);
+	InterpretResult bindMethod(std::shared_ptr<ObjClass> klass, std::shared_ptr<ObjString> name);
+
+	std::optional<size_t> arrayIndex(Value array, Value index);
+	bool checkKey(Value key);
+	std::optional<Value> forLimit(ForLimit kind, uint8_t index);
+
+	InterpretResult load(ObjFunction& function);
+	// every function loaded so far was verified, so the run loop can leave out its checks
+	bool trusted{ true };
+
+	std::shared_ptr<ObjString> initString{};
+	// set when the last runtime error was running out of memory
+	bool heapExhausted{ false };
+
+	bool fits(size_t bytes);
+	// fits(), after a scavenge if that's what it takes
+	bool makeRoom(size_t bytes);
+	void outOfMemory(size_t request);
+	std::shared_ptr<ObjString> concatenate(const std::string& a, const std::string& b);
+	// the result for a runtime error reported by a native or a helper
+	InterpretResult failure();
+
+	bool blocking{ false };
+	// the argument count of the native call to retry on resume()
+	std::optional<uint8_t> blockedCall{};
+
+	std::shared_ptr<ObjUpvalue> captureUpvalue(size_t slot);
+	void closeUpvalues(size_t last);
+	Value& upvalueValue(ObjUpvalue& upvalue);
+
+	void resetStack();
+
+	uint64_t readySequence{ 0 };
+
+	void switchTo(ObjFiber* next);
+	InterpretResult enter(ObjFiber* next, Value value);
+	InterpretResult yieldToScheduler();
+	std::optional<InterpretResult> finishFiber(Value result);
+
+	// steps left in the current slice, and how many run() counts down before the next check
+	uint64_t stepsLeft{ 0 };
+	uint64_t stepsUntilCheck{ 0 };
+	uint64_t checkBatch{ 0 };
+	std::chrono::steady_clock::time_point deadline{};
+
+	void startSlice();
+	void scheduleCheck();
+	InterpretResult checkBudget();
+
+	// the parts of stats() counted as they happen rather than read off the VM
+	VMStats counted{};
+
+	void scavenge();
+
+	std::optional<PerfCounts> readEvents();
+	// adds the events since start to total
+	void countEvents(std::optional<PerfCounts>& total, const std::optional<PerfCounts>& start);
+
+	std::ostringstream traceBuffer{};
+	void traceInstruction();
+	void flushTrace();
+	void recordInstruction();
 
+	InterpretResult compileAndRun(std::string_view source);
 	InterpretResult run();
+	template <bool counting, bool checked, Tracing tracing>
+	InterpretResult execute();
 };
\ No newline at end of file